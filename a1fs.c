@@ -1,13 +1,51 @@
-static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "a1fs_ioctl.h"
+#include "image.h"
+#include "lz.h"
+#include "ops.h"
+
+bool a1fs_init(fs_ctx *fs, a1fs_opts *opts, a1fs_mount_opts *mopts)
 {
 	// Nothing to initialize if only printing help
 	if (opts->help) return true;
 
 	size_t size;
-	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
+	void *image;
+	if (mopts->window_mb) {
+		//only the metadata is mapped up front, data blocks are mapped in windows
+		fs->windows = image_windows_open(opts->img_path, mopts->read_only,
+		                                 mopts->window_mb << 20, mopts->max_windows, &size);
+		if (!fs->windows) return false;
+		image = fs->windows->meta;
+	}
+	else if (mopts->read_only) image = map_file_ro(opts->img_path, A1FS_MIN_BLOCK_SIZE, &size);
+	else image = map_file(opts->img_path, A1FS_MIN_BLOCK_SIZE, &size);
 	if (!image) return false;
 
-	return fs_ctx_init(fs, image, size);
+	fs->read_only = mopts->read_only;
+	fs->hugepage = mopts->hugepage;
+	fs->mlock_meta = mopts->mlock_meta;
+	fs->prefault = mopts->prefault;
+	fs->ra_max = mopts->readahead_kb << 10;
+	fs->defrag_secs = mopts->defrag_secs;
+	fs->compress_dir = mopts->compress_dir;
+	if (fs->windows) fs->windows->hugepage = mopts->hugepage;
+	if (!fs_ctx_init(fs, image, size)) return false;
+
+	//freed blocks are punched through a descriptor of our own, the mapping doesn't keep one
+	fs->discard = (mopts->discard || mopts->discard_batch) && !mopts->read_only;
+	fs->discard_batch = mopts->discard_batch;
+	if (fs->discard) {
+		fs->discard_fd = open(opts->img_path, O_RDWR);
+		if (fs->discard_fd < 0) {
+			perror("a1fs: discard");
+			fs->discard = false;
+		}
+	}
+	return true;
 }
 
 /**
@@ -16,24 +54,149 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
  * Called when the file system is unmounted. Must cleanup all the resources
  * created in a1fs_init().
  */
+static void recount_free(fs_ctx *fs);
+static void discard_flush(fs_ctx *fs);
+static void orphan_step(fs_ctx *fs, uint64_t budget);
+
 static void a1fs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
-	if (fs->image) {
+	if (fs->prefault_running) {
+		fs->prefault_stop = true;
+		pthread_join(fs->prefault_thread, NULL);
+		fs->prefault_running = false;
+	}
+	if (fs->itable_running) {
+		fs->itable_stop = true;
+		pthread_join(fs->itable_thread, NULL);
+		fs->itable_running = false;
+	}
+	if (!fs->read_only && fs->itable_zeroed >= fs->itable_blocks) {
+		((struct a1fs_superblock *)fs->image)->features &= ~A1FS_FEATURE_LAZY_ITABLE;
+	}
+	//the next mount would finish freeing the orphans, but the image is smaller without them
+	if (!fs->read_only && ((struct a1fs_superblock *)fs->image)->s_orphan_head) orphan_step(fs, UINT64_MAX);
+	if (fs->discard) {
+		discard_flush(fs);
+		fprintf(stderr, "a1fs: discarded %lu blocks\n", (unsigned long)fs->discarded);
+		close(fs->discard_fd);
+		free(fs->discard_q);
+		fs->discard = false;
+	}
+	if (fs->defrag_files) {
+		fprintf(stderr, "a1fs: defragmented %lu files, %lu extents -> %lu\n", (unsigned long)fs->defrag_files,
+		        (unsigned long)fs->defrag_before, (unsigned long)fs->defrag_after);
+	}
+	if (fs->compressed_clusters) {
+		fprintf(stderr, "a1fs: compressed %lu clusters, %lu blocks saved\n", (unsigned long)fs->compressed_clusters,
+		        (unsigned long)fs->compressed_saved);
+	}
+	free(fs->zcache.data);
+	fs->zcache.data = NULL;
+	free(fs->refs);
+	fs->refs = NULL;
+	fs->refs_n = 0;
+	fs->refs_loaded = false;
+	free(fs->listings);
+	fs->listings = NULL;
+	fs->listings_n = 0;
+	//leave the free counts in the superblock right for the next mount
+	if (fs->counts_stale && !fs->read_only) recount_free(fs);
+	if (fs->windows) {
+		image_windows_close(fs->windows);
+		fs_ctx_destroy(fs);
+	}
+	else if (fs->image) {
 		munmap(fs->image, fs->size);
 		fs_ctx_destroy(fs);
 	}
 }
 
 
+/** Context the operations run against when they are called without FUSE. */
+static fs_ctx *direct_fs = NULL;
+
+void a1fs_attach(fs_ctx *fs)
+{
+	direct_fs = fs;
+}
+
 /** Get file system context. */
 static fs_ctx *get_fs(void)
 {
+	if (direct_fs) return direct_fs;
 	return (fs_ctx*)fuse_get_context()->private_data;
 }
 
-void *getpointer(void *image,int i){
-	return image+(A1FS_BLOCK_SIZE*i); 
+/** Per open file state, kept in fi->fh. */
+typedef struct a1fs_file {
+	/** Offset right after the previous read; a read starting here is sequential. */
+	off_t next;
+	/** Current readahead window in bytes, 0 while the access doesn't look sequential. */
+	size_t ra_window;
+	/** Readahead has been issued up to this offset. */
+	off_t ra_end;
+	/** Pages before this offset have been dropped from the mapping. */
+	off_t drop_end;
+	/** The file's extents are advised MADV_SEQUENTIAL. */
+	bool sequential;
+	/** Inode number of the file, so writes don't have to resolve the path; -1 if unknown. */
+	int ino;
+	/** The file has been written since it was opened (its clusters are compressed on release). */
+	bool written;
+	/** The compressed cluster the last read decompressed. */
+	a1fs_zcache zcache;
+} a1fs_file;
+
+/** Get the open file state of fi, NULL when there is none (e.g. no FUSE). */
+static a1fs_file *get_file(struct fuse_file_info *fi)
+{
+	if (!fi) return NULL;
+	return (a1fs_file *)(uintptr_t)fi->fh;
+}
+
+static void discard_due(fs_ctx *fs);
+static void defrag_due(fs_ctx *fs);
+
+/** Files of more blocks than this are freed in the background after unlink or truncate to 0. */
+#define ORPHAN_MIN_BLOCKS 256
+/** Blocks of orphans freed at the start of each operation. */
+#define ORPHAN_STEP_BLOCKS 4096
+
+/** Get file system context at the start of an operation. */
+static fs_ctx *begin_op(void)
+{
+	fs_ctx *fs = get_fs();
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	if (fs->windows) image_windows_begin_op(fs->windows);
+	//the features are only changed by operations, so the inode table thread leaves clearing its flag to here
+	if ((sb->features & A1FS_FEATURE_LAZY_ITABLE) && !fs->read_only) {
+		pthread_mutex_lock(&fs->itable_lock);
+		if (fs->itable_zeroed >= fs->itable_blocks) sb->features &= ~A1FS_FEATURE_LAZY_ITABLE;
+		pthread_mutex_unlock(&fs->itable_lock);
+	}
+	//batched discards, the defrag pass and the freeing of orphans go out between operations,
+	//never while one is changing the bitmap
+	if (fs->discard_n) discard_due(fs);
+	if (fs->defrag_secs) defrag_due(fs);
+	if (sb->s_orphan_head && !fs->read_only) orphan_step(fs, ORPHAN_STEP_BLOCKS);
+	return fs;
+}
+
+void *getpointer(void *image,uint64_t i){
+	//data blocks of a windowed image are mapped on demand. none of the callers can back out
+	//of an operation halfway, so a block that can't be mapped (a block number past the end
+	//of the image, or mmap failing) stops the daemon here instead of at a NULL dereference
+	fs_ctx *fs = get_fs();
+	if (fs->windows && i >= fs->first_data_block) {
+		void *block = image_window_get(fs->windows, i);
+		if (!block) {
+			fprintf(stderr, "a1fs: can't map block %lu of the image\n", (unsigned long)i);
+			abort();
+		}
+		return block;
+	}
+	return image+((size_t)i<<fs->block_shift); 
 }
 
 //some helper functions that prints stuff
@@ -52,27 +215,291 @@ void printmap(const char* bitmap,int size){
 }
 
 //write to the ith place in the bitmap, assume that this place is in the bitmap.
-void writemap(char** bitmap,int i){
-	int count = i/8;
+void writemap(char** bitmap,uint64_t i){
+	uint64_t count = i/8;
 	int count2 = i%8;
 	// printf("writing to the %d location of %d number\n",count2,count);
 	(*bitmap)[count]=((*bitmap)[count]|(1<<count2));
 }
 
 //read the ith place in bitmap
-int readmap(char* bitmap,int i){
-	int count = i/8;
+int readmap(char* bitmap,uint64_t i){
+	uint64_t count = i/8;
 	int count2 = i%8;
 	return (bitmap[count]&(1<<count2))>0?1:0;
 }
 
 //set the bit to 0. not combined with write map because we already used it many times.
-void erasemap(char** bitmap,int i){
-	int count = i/8;
+void erasemap(char** bitmap,uint64_t i){
+	uint64_t count = i/8;
 	int count2 = i%8;
 	(*bitmap)[count]=((*bitmap)[count]^(1<<count2));
 }
 
+/** A range of freed blocks waiting for the next batched discard. */
+struct discard_range {
+	uint64_t start, count;
+};
+
+/** Queued ranges after which a batch goes out before its time. */
+#define DISCARD_QUEUE_MAX 4096
+
+//punch the blocks of [start, start+count) that are still free out of the image file. a batch is
+//punched a while after the blocks were freed, some of them may be in use again by then
+static void discard_now(fs_ctx *fs, uint64_t start, uint64_t count){
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	uint64_t end = start + count, i = start;
+	while (i < end) {
+		if (readmap(bbitmap, i)) {
+			i++;
+			continue;
+		}
+		uint64_t run = i;
+		while (i < end && !readmap(bbitmap, i)) i++;
+		if (image_punch(fs->discard_fd, run << fs->block_shift, (i - run) << fs->block_shift)) {
+			fs->discarded += i - run;
+		}
+	}
+}
+
+static int cmp_discard(const void *a, const void *b){
+	const struct discard_range *x = a, *y = b;
+	if (x->start != y->start) return x->start < y->start ? -1 : 1;
+	return 0;
+}
+
+//punch out the queue, sorted and merged so that neighbouring frees go out as one hole
+static void discard_flush(fs_ctx *fs){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	fs->discard_last = now.tv_sec;
+	if (fs->discard_n == 0) return;
+	struct discard_range *q = fs->discard_q;
+	qsort(q, fs->discard_n, sizeof(*q), cmp_discard);
+	uint64_t start = q[0].start, end = q[0].start + q[0].count;
+	for (size_t i = 1; i < fs->discard_n; i++) {
+		if (q[i].start <= end) {
+			if (q[i].start + q[i].count > end) end = q[i].start + q[i].count;
+			continue;
+		}
+		discard_now(fs, start, end - start);
+		start = q[i].start;
+		end = q[i].start + q[i].count;
+	}
+	discard_now(fs, start, end - start);
+	fs->discard_n = 0;
+}
+
+//flush the queue once discard_batch seconds have gone by since the last batch
+static void discard_due(fs_ctx *fs){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if ((unsigned long)(now.tv_sec - fs->discard_last) >= fs->discard_batch) discard_flush(fs);
+}
+
+//blocks [start, start+count) have been freed: punch them out now, or queue them for the next batch
+static void discard_blocks(fs_ctx *fs, uint64_t start, uint64_t count){
+	if (!fs->discard || count == 0) return;
+	if (!fs->discard_batch) {
+		discard_now(fs, start, count);
+		return;
+	}
+	//a file is usually freed an extent or a run of blocks at a time, grow the last range when possible
+	if (fs->discard_n) {
+		struct discard_range *last = fs->discard_q + fs->discard_n - 1;
+		if (last->start + last->count == start) {
+			last->count += count;
+			return;
+		}
+		if (start + count == last->start) {
+			last->start = start;
+			last->count += count;
+			return;
+		}
+	}
+	if (fs->discard_n == fs->discard_cap) {
+		size_t cap = fs->discard_cap ? fs->discard_cap * 2 : 64;
+		struct discard_range *q = NULL;
+		if (cap <= DISCARD_QUEUE_MAX) q = realloc(fs->discard_q, cap * sizeof(*q));
+		if (q) {
+			fs->discard_q = q;
+			fs->discard_cap = cap;
+		}
+		else {
+			//full (or out of memory): send the batch out early
+			discard_flush(fs);
+			if (fs->discard_cap == 0) {
+				discard_now(fs, start, count);
+				return;
+			}
+		}
+	}
+	fs->discard_q[fs->discard_n].start = start;
+	fs->discard_q[fs->discard_n].count = count;
+	fs->discard_n++;
+}
+
+//clear count data blocks from start in the block bitmap and discard them. every data block that
+//is freed ends up here, once free_blocks has made sure no clone still uses it
+static void release_blocks(fs_ctx *fs, uint64_t start, uint64_t count){
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	for (uint64_t b = start; b < start + count; b++) erasemap(&bbitmap, b);
+	discard_blocks(fs, start, count);
+}
+
+//read the reference count table from the image the first time it is needed. returns false if
+//there was no memory for it
+static bool refs_load(fs_ctx *fs){
+	if (fs->refs_loaded) return true;
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	if ((sb->features & A1FS_FEATURE_REFLINK) && sb->refcount_num > 0) {
+		a1fs_ref *refs = malloc(sb->refcount_num * sizeof(*refs));
+		if (!refs) return false;
+		//a block at a time, a windowed image maps the table blocks separately
+		uint64_t per_block = fs->block_size / sizeof(a1fs_ref);
+		for (uint64_t i = 0; i < sb->refcount_num; i += per_block) {
+			uint64_t n = sb->refcount_num - i < per_block ? sb->refcount_num - i : per_block;
+			memcpy(refs + i, getpointer(fs->image, sb->s_refcount_table + i / per_block), n * sizeof(*refs));
+		}
+		fs->refs = refs;
+		fs->refs_n = sb->refcount_num;
+	}
+	fs->refs_loaded = true;
+	return true;
+}
+
+//true if some blocks are shared, i.e. freeing and writing blocks has to look at the counts
+static bool refs_shared(fs_ctx *fs){
+	if (!fs->refs_loaded && !refs_load(fs)) return true;
+	return fs->refs_n > 0;
+}
+
+//references to block b: 1 for a block that is not in the table
+static uint32_t refs_count(fs_ctx *fs, uint64_t b){
+	size_t lo = 0, hi = fs->refs_n;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		a1fs_ref *r = fs->refs + mid;
+		if (b < r->start) hi = mid;
+		else if (b >= (uint64_t)r->start + r->count) lo = mid + 1;
+		else return r->refs;
+	}
+	return 1;
+}
+
+//true if any of the blocks [start, start+count) is shared
+static bool refs_overlap(fs_ctx *fs, uint64_t start, uint64_t count){
+	for (size_t i = 0; i < fs->refs_n; i++) {
+		a1fs_ref *r = fs->refs + i;
+		if (r->start >= start + count) break;
+		if ((uint64_t)r->start + r->count > start) return true;
+	}
+	return false;
+}
+
+//append an entry to a table being built, merging it into the last one when they line up
+static void refs_push(a1fs_ref *out, size_t *n, uint64_t start, uint64_t count, uint32_t refs){
+	if (count == 0) return;
+	a1fs_ref *last = *n ? out + *n - 1 : NULL;
+	if (last && last->refs == refs && (uint64_t)last->start + last->count == start &&
+	    (uint64_t)last->count + count <= UINT32_MAX) {
+		last->count += count;
+		return;
+	}
+	out[*n].start = start;
+	out[*n].count = count;
+	out[*n].refs = refs;
+	out[*n].pad = 0;
+	(*n)++;
+}
+
+/**
+ * Add delta (+1 or -1) to the reference count of blocks [start, start+count).
+ *
+ * The entries that the range cuts are split at its ends. A block that was in
+ * no entry gets one with 2 references on +1, and is freed on -1. An entry
+ * that drops to one reference is removed. The table in the image is not
+ * written, see refs_sync().
+ *
+ * @return  0 on success; -ENOMEM if the new table couldn't be allocated.
+ */
+static int refs_adjust(fs_ctx *fs, uint64_t start, uint64_t count, int delta){
+	//every entry can be cut in two, and every gap between them can get an entry
+	a1fs_ref *out = malloc((fs->refs_n * 2 + 3) * sizeof(*out));
+	if (!out) return -ENOMEM;
+	size_t n = 0;
+	uint64_t pos = start, end = start + count;
+	for (size_t i = 0; i < fs->refs_n; i++) {
+		a1fs_ref *r = fs->refs + i;
+		uint64_t rs = r->start, re = rs + r->count;
+		if (re <= pos || rs >= end) {
+			//blocks of the range before this entry that are in no entry
+			if (rs >= end && pos < end) {
+				if (delta > 0) refs_push(out, &n, pos, end - pos, 2);
+				else release_blocks(fs, pos, end - pos);
+				pos = end;
+			}
+			refs_push(out, &n, rs, r->count, r->refs);
+			continue;
+		}
+		if (rs < pos) {
+			refs_push(out, &n, rs, pos - rs, r->refs);
+			rs = pos;
+		}
+		if (pos < rs) {
+			if (delta > 0) refs_push(out, &n, pos, rs - pos, 2);
+			else release_blocks(fs, pos, rs - pos);
+		}
+		uint64_t oe = re < end ? re : end;
+		if (r->refs + delta > 1) refs_push(out, &n, rs, oe - rs, r->refs + delta);
+		if (re > oe) refs_push(out, &n, oe, re - oe, r->refs);
+		pos = oe;
+	}
+	if (pos < end) {
+		if (delta > 0) refs_push(out, &n, pos, end - pos, 2);
+		else release_blocks(fs, pos, end - pos);
+	}
+	free(fs->refs);
+	if (n == 0) {
+		free(out);
+		out = NULL;
+	}
+	fs->refs = out;
+	fs->refs_n = n;
+	return 0;
+}
+
+static int refs_sync(fs_ctx *fs);
+static int unshare_block(fs_ctx *fs, struct a1fs_inode *inode, uint64_t n);
+
+//whether extents may be compressed, the write paths only look for compressed clusters then
+static bool compressed_fs(fs_ctx *fs){
+	return (((struct a1fs_superblock *)fs->image)->features & A1FS_FEATURE_COMPRESS) != 0;
+}
+
+static int uncompress_block(fs_ctx *fs, struct a1fs_inode *inode, uint64_t n);
+static const char *cluster_block(fs_ctx *fs, a1fs_file *file, struct a1fs_extent *e, uint64_t off);
+static void compress_inode(fs_ctx *fs, struct a1fs_inode *inode);
+
+//free count data blocks from start. every data block that is freed goes through here: blocks
+//shared with a clone only lose a reference, the rest are released (and discarded)
+static void free_blocks(fs_ctx *fs, uint64_t start, uint64_t count){
+	if (!refs_shared(fs)) {
+		release_blocks(fs, start, count);
+		return;
+	}
+	//without the counts in memory a shared block can't be told apart, leak the blocks instead
+	if (fs->refs_loaded && !refs_overlap(fs, start, count)) {
+		release_blocks(fs, start, count);
+		return;
+	}
+	if (!fs->refs_loaded || refs_adjust(fs, start, count, -1) < 0) {
+		fprintf(stderr, "free_blocks: out of memory, %lu blocks leaked\n", (unsigned long)count);
+		return;
+	}
+	refs_sync(fs);
+}
+
 //print out information about the num-th inode in the inode table
 void printnode(struct a1fs_inode *inode_table, int num){
 	struct a1fs_inode* node = inode_table+(num*sizeof(struct a1fs_inode));
@@ -113,32 +540,124 @@ void printsb(struct a1fs_superblock* sb,void* image){
 }
 
 //given a pointer, return the block of this pointer. used for debugging.
-int getblock(void* pt,void* image){
-	int offset = (int)(pt-image);
-	return offset/A1FS_BLOCK_SIZE;
+uint64_t getblock(void* pt,void* image){
+	size_t offset = (size_t)(pt-image);
+	return offset>>get_fs()->block_shift;
 }
 
 
-//get first free bit in bitmap, -1 if it can't find one
-int get_free_bit(fs_ctx *fs, char **bitmap, int bitmap_size, int ignore_bit) {
-	for (int i = 0; i < (int)fs->block_size * 8 * bitmap_size; i++) {
-		if (!((*bitmap)[i/8] & (1<<(i%8))) && i != ignore_bit) return i;
+//get first free bit among the first nbits of a bitmap, -1 if it can't find one
+int64_t get_free_bit(char **bitmap, uint64_t nbits, int64_t ignore_bit) {
+	for (uint64_t i = 0; i < nbits; i++) {
+		if (!((*bitmap)[i/8] & (1<<(i%8))) && (int64_t)i != ignore_bit) return i;
 	}
 	return -1;
 }
 
-int get_free_inode_bit(fs_ctx *fs, int ignore_bit) {
-	char *bitmap = (char *)getpointer(fs->image, fs->ibitmap);
-	int free_bit = get_free_bit(fs, &bitmap, fs->bbitmap - fs->ibitmap, ignore_bit);
-	return free_bit;
+//inodes are placed in groups of one inode table block, so an inode shares its block with its directory's
+static int inode_group(fs_ctx *fs){
+	return fs->block_size / fs->inode_size;
+}
+
+//first free inode in [from, to), -1 if there is none. full bytes of the bitmap are skipped whole.
+static int find_free_inode(fs_ctx *fs, int from, int to){
+	unsigned char *ibitmap = (unsigned char *)getpointer(fs->image, fs->ibitmap);
+	int i = from;
+	while (i < to) {
+		if (i % 8 == 0 && i + 8 <= to && ibitmap[i / 8] == 0xff) {
+			i += 8;
+			continue;
+		}
+		if (!(ibitmap[i / 8] & (1 << (i % 8)))) return i;
+		i++;
+	}
+	return -1;
+}
+
+//Orlov-style spreading of top level directories: among the groups with at least the average
+//number of free inodes, take the one holding the fewest directories. returns its first inode.
+static int orlov_goal(fs_ctx *fs){
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	int group = inode_group(fs);
+	int ngroups = (fs->inode_num + group - 1) / group;
+	int avg_free = fs->free_inum / ngroups;
+	int best = 0, best_dirs = -1, best_free = -1;
+	for (int g = 0; g < ngroups; g++) {
+		int free = 0, dirs = 0;
+		for (int i = g * group; i < (g + 1) * group && i < fs->inode_num; i++) {
+			if (!readmap(ibitmap, i)) free++;
+			else if (S_ISDIR(itable[i].mode)) dirs++;
+		}
+		if (free == 0 || free < avg_free) continue;
+		if (best_dirs == -1 || dirs < best_dirs || (dirs == best_dirs && free > best_free)) {
+			best = g;
+			best_dirs = dirs;
+			best_free = free;
+		}
+	}
+	return best * group;
+}
+
+//zero the inode table up to and including its block blk (counted from the start of the table)
+//and record the progress in the superblock. the caller holds itable_lock. this runs on the
+//background thread, where get_fs() has no context, so the table is addressed from fs (it is
+//metadata, mapped in one piece also in windowed mode). the flag is cleared by begin_op
+static void itable_zero_to(fs_ctx *fs, uint64_t blk){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	if (fs->itable_zeroed >= fs->itable_blocks) return;
+	while (fs->itable_zeroed <= blk && fs->itable_zeroed < fs->itable_blocks) {
+		memset((char *)fs->image + ((fs->inode_table + fs->itable_zeroed) << fs->block_shift), 0, fs->block_size);
+		fs->itable_zeroed++;
+	}
+	sb->itable_zeroed = fs->itable_zeroed;
+}
+
+//an inode is only handed out once its inode table block has been zeroed, so the background
+//zeroing never clears an inode in use. on a fully zeroed table this is just the check
+static void itable_ready(fs_ctx *fs, int ino){
+	uint64_t blk = ((uint64_t)ino * fs->inode_size) >> fs->block_shift;
+	pthread_mutex_lock(&fs->itable_lock);
+	if (blk >= fs->itable_zeroed) itable_zero_to(fs, blk);
+	pthread_mutex_unlock(&fs->itable_lock);
+}
+
+//find a free inode for a new file or directory in directory parent. it goes in the parent's
+//group when there is room (top level directories are spread out instead), otherwise at the
+//first free inode from fs->inode_hint. the bit is not set here. returns -1 if all are used.
+int get_inode_near(fs_ctx *fs, a1fs_ino_t parent, bool dir){
+	int group = inode_group(fs);
+	int goal = (dir && parent == 0) ? orlov_goal(fs) : (int)parent;
+	int group_start = goal - goal % group;
+	int group_end = group_start + group;
+	if (group_end > fs->inode_num) group_end = fs->inode_num;
+	int bit = find_free_inode(fs, goal, group_end);
+	if (bit == -1) bit = find_free_inode(fs, group_start, goal);
+	if (bit == -1) {
+		if (fs->inode_hint >= fs->inode_num) fs->inode_hint = 0;
+		bit = find_free_inode(fs, fs->inode_hint, fs->inode_num);
+		if (bit == -1) bit = find_free_inode(fs, 0, fs->inode_hint);
+	}
+	if (bit != -1) {
+		fs->inode_hint = bit + 1;
+		itable_ready(fs, bit);
+	}
+	return bit;
 }
 
-int get_free_block_bit(fs_ctx *fs, int ignore_bit) {
+int64_t get_free_block_bit(fs_ctx *fs, int64_t ignore_bit) {
 	char *bitmap = (char *)getpointer(fs->image, fs->bbitmap);
-	int free_bit = get_free_bit(fs, &bitmap, fs->inode_table - fs->bbitmap, ignore_bit);
+	int64_t free_bit = get_free_bit(&bitmap, fs->block_num, ignore_bit);
 	return free_bit;
 }
 
+//zero count blocks from start, a block at a time since a windowed image only maps part of an extent
+static void zero_blocks(fs_ctx *fs, uint64_t start, uint64_t count){
+	for(uint64_t i=0;i<count;i++){
+		memset(getpointer(fs->image,start+i),0,fs->block_size);
+	}
+}
+
 //IMPORTANT:this allocation algorithm keeps fragmentation low because newly allocated blocks are as close as possible to the last extent
 
 //allocate n free data blocks in a way that "keeps fragmentation low"
@@ -151,9 +670,11 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 	struct a1fs_extent* curr_extent = table+extent_num; 
 	int curr_extnum = extent_num;
 	struct a1fs_extent* last_extent = curr_extent-1; 
-	int last = (int)(last_extent->start+last_extent->count);
+	//a file without extents has no last extent to allocate after, start at the data blocks
+	uint64_t last = fs->first_data_block;
+	if(extent_num>0) last = (uint64_t)last_extent->start+a1fs_extent_used(last_extent);
 	//extent parameter
-	int start = 0;
+	uint64_t start = 0;
 	int count = 0;
 	//start from block last until the end	
 	//return as soon as we have the needed blocks
@@ -162,11 +683,11 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 	//printf("bbitmap before allocation:\n");
 	//printmap(bbitmap,10);
 	
-	for(int i=last;i<fs->block_num;i++){
+	for(uint64_t i=last;i<fs->block_num;i++){
 		//printf("%d:%d\n",i,n);
 		int num = readmap(bbitmap,i);
 		//when n==0, start and count does not equal to 0.
-		if(curr_extnum>=512){
+		if(curr_extnum>=fs->block_size/fs->extent_size){
 			fprintf(stderr,"allocate_blocks: Extent out of bound");	
 			return -ENOMEM;
 		}
@@ -175,8 +696,8 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 				curr_extent->start = start;
 				curr_extent->count = count;
 				//clear those blocks before allocation;
-				memset(getpointer(fs->image,start),0,(count-1)*fs->block_size);
-				printf("writen extent:%d:%d\n",start,count);
+				zero_blocks(fs,start,count);
+				printf("writen extent:%lu:%d\n",(unsigned long)start,count);
 				curr_extnum++;
 			}
 			return curr_extnum;
@@ -195,8 +716,8 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 		if((num==1&&start!=0)||i==fs->block_num-1){
 			curr_extent->start = start;
 			curr_extent->count = count;
-			memset(getpointer(fs->image,start),0,(count-1)*fs->block_size);
-			// printf("writen extent:%d:%d\n",start,count);
+			zero_blocks(fs,start,count);
+			// printf("writen extent:%lu:%d\n",(unsigned long)start,count);
 			curr_extent++;
 			curr_extnum++;
 			start = 0;	
@@ -204,11 +725,11 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 		}
 	}
 
-	for(int i=fs->first_data_block;i<last;i++){
+	for(uint64_t i=fs->first_data_block;i<last;i++){
 		// printf("%d:%d\n",i,n);
 		int num = readmap(bbitmap,i);
 		//when n==0, start and count does not equal to 0.
-		if(curr_extnum>=512){
+		if(curr_extnum>=fs->block_size/fs->extent_size){
 			fprintf(stderr,"allocate_blocks: Extent out of bound");	
 			return -ENOMEM;	
 		}
@@ -216,8 +737,8 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 			if(count!=0){
 				curr_extent->start = start;
 				curr_extent->count = count;
-				memset(getpointer(fs->image,start),0,(count-1)*fs->block_size);
-				printf("writen extent:%d:%d\n",start,count);
+				zero_blocks(fs,start,count);
+				printf("writen extent:%lu:%d\n",(unsigned long)start,count);
 				curr_extnum++;
 			}
 			return curr_extnum;
@@ -236,8 +757,8 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 		if((num==1&&start!=0)||i==last-1){
 			curr_extent->start = start;
 			curr_extent->count = count;
-			memset(getpointer(fs->image,start),0,(count-1)*fs->block_size);
-			printf("writen extent:%d:%d\n",start,count);
+			zero_blocks(fs,start,count);
+			printf("writen extent:%lu:%d\n",(unsigned long)start,count);
 			curr_extent++;
 			curr_extnum++;
 			start = 0;	
@@ -251,6 +772,147 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
 }
 
 
+//directory inode and its mtime, for sorting the directories to prefault
+struct dir_age {
+	int ino;
+	struct timespec mtime;
+};
+
+//newest first
+static int cmp_dir_age(const void *a, const void *b){
+	const struct dir_age *x = a, *y = b;
+	if (x->mtime.tv_sec != y->mtime.tv_sec) return x->mtime.tv_sec < y->mtime.tv_sec ? 1 : -1;
+	if (x->mtime.tv_nsec != y->mtime.tv_nsec) return x->mtime.tv_nsec < y->mtime.tv_nsec ? 1 : -1;
+	return 0;
+}
+
+/**
+ * Fault in the metadata and then every directory, most recently modified
+ * first, so the first lookups after mount don't wait on the disk.
+ *
+ * Runs next to the operations and only reads the image. In windowed mode only
+ * the pinned metadata is touched, the window table is not thread safe.
+ */
+static void *prefault_main(void *arg)
+{
+	fs_ctx *fs = arg;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	size_t meta_size = (size_t)fs->first_data_block * fs->block_size;
+	image_prefault(fs->image, meta_size, &fs->prefault_stop);
+	size_t touched = meta_size;
+
+	struct dir_age *dirs = NULL;
+	int n_dirs = 0;
+	if (!fs->windows) dirs = malloc(fs->inode_num * sizeof(*dirs));
+	if (dirs) {
+		char *ibitmap = (char *)fs->image + (size_t)fs->ibitmap * fs->block_size;
+		struct a1fs_inode *itable = (struct a1fs_inode *)((char *)fs->image + (size_t)fs->inode_table * fs->block_size);
+		for (int i = 0; i < fs->inode_num; i++) {
+			if (readmap(ibitmap, i) && S_ISDIR(itable[i].mode)) {
+				dirs[n_dirs].ino = i;
+				dirs[n_dirs].mtime = itable[i].mtime;
+				n_dirs++;
+			}
+		}
+		qsort(dirs, n_dirs, sizeof(*dirs), cmp_dir_age);
+
+		for (int i = 0; i < n_dirs && !fs->prefault_stop; i++) {
+			struct a1fs_inode *dir = itable + dirs[i].ino;
+			//the operations may be changing the directory, never trust a block number
+			if (dir->a1fs_extent_table >= (unsigned int)fs->block_num) continue;
+			struct a1fs_extent *table = (struct a1fs_extent *)((char *)fs->image + (size_t)dir->a1fs_extent_table * fs->block_size);
+			image_prefault(table, fs->block_size, &fs->prefault_stop);
+			touched += fs->block_size;
+			for (int e = 0; e < dir->extent_num && e < fs->block_size / fs->extent_size; e++) {
+				size_t first = table[e].start, count = table[e].count;
+				if (first >= (size_t)fs->block_num || count > fs->block_num - first) continue;
+				image_prefault((char *)fs->image + first * fs->block_size, count * fs->block_size, &fs->prefault_stop);
+				touched += count * fs->block_size;
+			}
+		}
+		free(dirs);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "a1fs: prefaulted %zu KiB (%d directories) in %.1f ms\n", touched >> 10, n_dirs,
+	        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	return NULL;
+}
+
+/** Inode table blocks zeroed per turn of the lock by the background thread. */
+#define ITABLE_ZERO_CHUNK 16
+
+/**
+ * Zero the part of the inode table mkfs -F left alone, a chunk at a time so
+ * that an allocation waiting on itable_lock is not held up for long. Progress
+ * is kept in the superblock, so an unmount part way through resumes at the
+ * next mount.
+ */
+static void *itable_main(void *arg)
+{
+	fs_ctx *fs = arg;
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	uint64_t zeroed = 0;
+	bool done = false;
+	while (!done && !fs->itable_stop) {
+		pthread_mutex_lock(&fs->itable_lock);
+		uint64_t before = fs->itable_zeroed;
+		itable_zero_to(fs, fs->itable_zeroed + ITABLE_ZERO_CHUNK - 1);
+		zeroed += fs->itable_zeroed - before;
+		done = fs->itable_zeroed >= fs->itable_blocks;
+		pthread_mutex_unlock(&fs->itable_lock);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	fprintf(stderr, "a1fs: zeroed %lu inode table blocks%s in %.1f ms\n", (unsigned long)zeroed,
+	        done ? "" : " (stopped early)",
+	        (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	return NULL;
+}
+
+/**
+ * Finish mounting the file system.
+ *
+ * Called by FUSE once the daemon is running, after it has forked into the
+ * background. Memory locks are not inherited across fork() and threads don't
+ * survive it, so the mapping is tuned here rather than in a1fs_init().
+ */
+static void *a1fs_fuse_init(struct fuse_conn_info *conn)
+{
+	(void)conn;
+	fs_ctx *fs = get_fs();
+	size_t meta_size = (size_t)fs->first_data_block * fs->block_size;
+
+	if (fs->hugepage) {
+		//data windows are advised as they are mapped
+		size_t len = fs->windows ? meta_size : fs->size;
+		if (madvise(fs->image, len, MADV_HUGEPAGE) != 0) perror("madvise(MADV_HUGEPAGE)");
+	}
+	if (fs->mlock_meta && mlock(fs->image, meta_size) != 0) {
+		perror("mlock");
+	}
+	if (fs->prefault) {
+		fs->prefault_stop = false;
+		fs->prefault_running = pthread_create(&fs->prefault_thread, NULL, prefault_main, fs) == 0;
+		if (!fs->prefault_running) fprintf(stderr, "a1fs: failed to start the prefault thread\n");
+	}
+	if (fs->itable_zeroed < fs->itable_blocks && !fs->read_only) {
+		//inodes past the zeroed part are zeroed on allocation until the thread gets there
+		fs->itable_stop = false;
+		fs->itable_running = pthread_create(&fs->itable_thread, NULL, itable_main, fs) == 0;
+		if (!fs->itable_running) fprintf(stderr, "a1fs: failed to start the inode table thread\n");
+	}
+	if (fs->compress_dir && a1fs_set_compress(fs->compress_dir, true) < 0) {
+		fprintf(stderr, "a1fs: compress=%s: no such directory\n", fs->compress_dir);
+	}
+	return fs;
+}
+
+
 /**
  * Get file system statistics.
  *
@@ -268,7 +930,7 @@ int allocate_blocks(int n, struct a1fs_extent* table, int extent_num){
  */
 static int a1fs_statfs(const char *path, struct statvfs *st)
 {
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
 
 	memset(st, 0, sizeof(*st));
 	//TODO: fill in the rest of required fields based on the information stored
@@ -276,14 +938,17 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
 
 	//everything here need to be stored in the superblock for data to persist
 	
+	if (fs->counts_stale) recount_free(fs);
 	st->f_bsize   = fs->block_size;
 	st->f_frsize  = fs->block_size;
 	st->f_blocks = fs->block_num;
-	st->f_bfree = fs->free_bnum;
+	//blocks and inodes of orphans are as good as free, they come back before anything runs short
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	st->f_bfree = fs->free_bnum + sb->orphan_blocks;
 	st->f_bavail = st->f_bfree;
 
 	st->f_files = fs->inode_num;
-	st->f_ffree = fs->free_inum;
+	st->f_ffree = fs->free_inum + sb->s_orphan_num;
 	st->f_favail = st->f_ffree;
 
 	//store the fsid although can be ignored because I need to check consistency
@@ -315,7 +980,7 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
 
 //a helper that, given a name and an inode, return the child inode that corresponds to the name
 struct a1fs_inode* getattr_helper(struct a1fs_inode* curr_inode, char* name, fs_ctx *fs){
-	//iterate the extents,find their inode (there are at most 512 extents per file)
+	//iterate the extents,find their inode (there are at most block_size/extent_size extents per file)
 	struct a1fs_extent* extent_table = getpointer(fs->image,curr_inode->a1fs_extent_table);
 	struct a1fs_inode* itable = getpointer(fs->image,fs->inode_table);
 	for(int i=0;i<curr_inode->extent_num;i++){
@@ -323,19 +988,21 @@ struct a1fs_inode* getattr_helper(struct a1fs_inode* curr_inode, char* name, fs_
 		struct a1fs_extent* curr_extent = (struct a1fs_extent*)((void*)extent_table+(fs->extent_size * i));
 		a1fs_blk_t start = (a1fs_blk_t) curr_extent->start;
 		//the size of the file divided by the size of dentry is how many enties there are.
-		int iterations = fs->block_size/fs->dentry_size;
-		//the starting block of the actual extents
-		struct a1fs_dentry* start_entry = (struct a1fs_dentry*) getpointer(fs->image,start);
-		//for each extent, read all the dir_entrys in order
-		for(int j=0;j<iterations;j++){
-			//first find the current entry in the data blocks
-			struct a1fs_dentry* curr_entry = start_entry + j;
-			// check its name, if same find the inode and return 
-			//printf("Getting: Extent %d Dentry: %d (%s|%d)\n", i, j, curr_entry->name, curr_entry->ino);
-			if(strcmp(curr_entry->name, name) == 0){
-				
-				a1fs_ino_t inode = curr_entry->ino;
-				return itable+inode;
+		int iterations = 1<<fs->dentry_shift;
+		for(a1fs_blk_t b=0;b<curr_extent->count;b++){
+			//the starting block of the actual extents
+			struct a1fs_dentry* start_entry = (struct a1fs_dentry*) getpointer(fs->image,start+b);
+			//for each block, read all the dir_entrys in order
+			for(int j=0;j<iterations;j++){
+				//first find the current entry in the data blocks
+				struct a1fs_dentry* curr_entry = start_entry + j;
+				// check its name, if same find the inode and return 
+				//printf("Getting: Extent %d Dentry: %d (%s|%d)\n", i, j, curr_entry->name, curr_entry->ino);
+				if(strcmp(curr_entry->name, name) == 0){
+					
+					a1fs_ino_t inode = curr_entry->ino;
+					return itable+inode;
+				}
 			}
 		}
 	}
@@ -343,10 +1010,40 @@ struct a1fs_inode* getattr_helper(struct a1fs_inode* curr_inode, char* name, fs_
 	return itable;
 }
 
+//resolve a path to its inode the way the operations do, the root if a component is missing
+static struct a1fs_inode *find_inode(fs_ctx *fs, const char *path){
+	struct a1fs_inode* curr_inode = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
+	char temp[A1FS_PATH_MAX];
+	strcpy(temp,path);
+	char *name = strtok(temp,"/");
+	while(name!=NULL){
+		curr_inode = getattr_helper(curr_inode,name,fs);
+		name = strtok(NULL,"/");
+	}
+	return curr_inode;
+}
+
+static uint64_t inode_blocks(fs_ctx *fs, struct a1fs_inode *inode);
+
+//fill in the attributes of an inode, shared by getattr and readdir
+static void fill_stat(struct a1fs_inode *inode, struct stat *st){
+	st->st_mode = inode->mode;
+	st->st_nlink = inode->links;
+	st->st_size = inode->size;
+	st->st_blocks = (inode->size)/512;
+	if(inode->size%512!=0) st->st_blocks++; 
+	//a compressed file takes less than its size, du should see that
+	if(inode->flags & A1FS_INODE_COMPRESS){
+		fs_ctx *fs = get_fs();
+		if(S_ISREG(inode->mode)) st->st_blocks = inode_blocks(fs,inode)<<(fs->block_shift-9);
+	}
+	st->st_mtim = inode->mtime;
+}
+
 static int a1fs_getattr(const char *path, struct stat *st)
 {
 	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
 	memset(st, 0, sizeof(*st));
 
 	struct a1fs_inode* root = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
@@ -359,11 +1056,7 @@ static int a1fs_getattr(const char *path, struct stat *st)
 	//edge case for the root
 	if(strcmp(path,"/")==0){
 		//printf("is root\n");
-		st->st_mode = root->mode;
-		st->st_nlink = root->links;
-		st->st_size = root->size;
-		st->st_blocks = (root->size)/512;
-		st->st_mtim = root->mtime;
+		fill_stat(root,st);
 		return 0;
 	}
 	if (strlen(path) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
@@ -379,12 +1072,7 @@ static int a1fs_getattr(const char *path, struct stat *st)
 		if((curr_inode->mode & S_IFREG) && name!=NULL) return -ENOTDIR;
 	}
 	//now the inode is found, set its stats.
-	st->st_mode = curr_inode->mode;
-	st->st_nlink = curr_inode->links;
-	st->st_size = curr_inode->size;
-	st->st_blocks = (curr_inode->size)/512;
-	if(curr_inode->size%512!=0) st->st_blocks++; 
-	st->st_mtim = curr_inode->mtime;
+	fill_stat(curr_inode,st);
 	return 0;
 }
 
@@ -392,20 +1080,21 @@ static int a1fs_getattr(const char *path, struct stat *st)
 /**
  * Read a directory.
  *
- * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
- * for each directory entry. See fuse.h in libfuse source code for details.
+ * Implements the readdir() system call. Calls filler(buf, name, st, off) for
+ * each directory entry, where st holds the entry's attributes (so a listing
+ * doesn't need a getattr per entry) and off is the slot after the entry.
+ * Listing resumes from that slot when FUSE comes back with it as offset.
+ * See fuse.h in libfuse source code for details.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
- * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
+ * Errors: none
  *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
+ * @param offset  slot to start at, 0 or an offset passed to filler before.
  * @param fi      unused.
  * @return        0 on success; -errno on error.
  */
@@ -414,53 +1103,57 @@ static int a1fs_getattr(const char *path, struct stat *st)
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-	(void)offset;// unused
 	(void)fi;// unused
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
 
 	//TODO: lookup the directory inode for given path and iterate through its
 	// directory entries
 	//printf("%s\n",path);
-	//find the root inode
 	struct a1fs_inode* root = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
-	//parse the string with strtok
-	char temp[A1FS_NAME_MAX];
-	strcpy(temp,path);
-	char *name = strtok(temp,"/");
-	struct a1fs_inode* curr_inode = root;
-	while(name!=NULL){
-		curr_inode = getattr_helper(curr_inode,name,fs);
-		name = strtok(NULL,"/");
-	}
-
-	//some duplicate(but with many subtle differences, hard to encapsulate) code
-	//now we have the directory inode,iterate all its contents, and call filler.
-	//printf("%d\n",curr_inode->a1fs_extent_table);
+	struct a1fs_inode* curr_inode = find_inode(fs,path);
+	if(offset<0) return 0;
+
+	//the offset is a slot number (see dir_slot), skip to the extent holding it. entries don't
+	//move while a listing is open (see compact_dir), so one that goes on while entries are
+	//removed misses none
+	int iterations = 1<<fs->dentry_shift;
+	uint64_t block = (uint64_t)offset>>fs->dentry_shift;
+	int first = offset&(iterations-1);
 	struct a1fs_extent* extent_table = getpointer(fs->image,curr_inode->a1fs_extent_table);
-	for(int i=0;i<curr_inode->extent_num;i++){
+	int i = 0;
+	while(i<curr_inode->extent_num && block>=extent_table[i].count){
+		block -= extent_table[i].count;
+		i++;
+	}
+	off_t slot = offset;
+	struct stat st;
+	for(;i<curr_inode->extent_num;i++){
 		//go to the ith extent in the extent table
 		struct a1fs_extent* curr_extent = extent_table + i;
-		a1fs_blk_t start = (a1fs_blk_t) curr_extent-> start;
-		//the size of the file divided by the size of dentry is how many enties there are.
-		int iterations = fs->block_size/fs->dentry_size;
-		//the starting block of the actual extents
-		struct a1fs_dentry* start_entry = (struct a1fs_dentry*) getpointer(fs->image,start);
-		//for each extent, read all the dir_entrys in order
-		for(int j=0;j<iterations;j++){
-			//first find the current entry in the data blocks
-			struct a1fs_dentry* curr_entry = start_entry+ j;
-			//for each entry, if it is . or .., continue, else call filler
-			if(strcmp(curr_entry->name,"")!=0&&curr_entry->ino!=0)
-			printf("name:%s,inode:%d\n",curr_entry->name,(int)curr_entry->ino);
-			if(strcmp(curr_entry->name,".")==0 || strcmp(curr_entry->name,"..")==0){
-				//printf("read self or prev\n");
-				continue;
-			} else if(strcmp(curr_entry->name, "")) {
-				if (filler(buf, curr_entry->name , NULL, 0) != 0) {
-					return -ENOMEM;	
-				}		
+		for(a1fs_blk_t b=block;b<curr_extent->count;b++){
+			//the starting block of the actual extents
+			struct a1fs_dentry* start_entry = (struct a1fs_dentry*) getpointer(fs->image,curr_extent->start+b);
+			//for each block, read all the dir_entrys in order
+			for(int j=first;j<iterations;j++,slot++){
+				//first find the current entry in the data blocks
+				struct a1fs_dentry* curr_entry = start_entry+ j;
+				//for each entry, if it is . or .., continue, else call filler
+				if(strcmp(curr_entry->name,".")==0 || strcmp(curr_entry->name,"..")==0){
+					//printf("read self or prev\n");
+					continue;
+				} else if(strcmp(curr_entry->name, "")) {
+					memset(&st,0,sizeof(st));
+					fill_stat(root+curr_entry->ino,&st);
+					st.st_ino = curr_entry->ino;
+					//the buffer is full, FUSE asks again from this entry
+					if (filler(buf, curr_entry->name , &st, slot+1) != 0) {
+						return 0;	
+					}		
+				}
 			}
+			first = 0;
 		}
+		block = 0;
 	}
 	return 0;
 }
@@ -474,93 +1167,70 @@ static a1fs_ino_t get_parent_inode(fs_ctx *fs, const char *path)
 {
 	fprintf(stderr, "a1fs_mkdir: Looking for parent inode of: %s\n", path);
 	
+	//the parent is everything before the last '/', "" for the root
 	char fullpath[A1FS_PATH_MAX];
-	strncpy(fullpath, path, A1FS_PATH_MAX);
-	char *ptr = strtok(fullpath, "/");
-	
-	char prev_ptr[A1FS_PATH_MAX];
-	strcpy(prev_ptr, ptr);
-	ptr = strtok(NULL,"/");
-	printf("ptr:%s\n\n\n",prev_ptr);
-	if (ptr == NULL) {
-		return (a1fs_ino_t) 0;
-	}
-	
+	strncpy(fullpath, path, A1FS_PATH_MAX - 1);
+	fullpath[A1FS_PATH_MAX - 1] = '\0';
+	char *slash = strrchr(fullpath, '/');
+	if (slash) *slash = '\0';
 	
-	struct a1fs_inode *curr_inode = (struct a1fs_inode*) getpointer(fs->image, fs->inode_table);
-	int parent_inode_num = 0;
-	while(ptr != NULL) {
-		struct a1fs_extent *curr_extent = (struct a1fs_extent *) getpointer(fs->image, curr_inode->a1fs_extent_table);
-		struct a1fs_dentry *curr_dentry;
-		for (a1fs_blk_t i = 0; i < curr_extent->count; i++) {
-			curr_dentry = (struct a1fs_dentry *) getpointer(fs->image, curr_extent->start);
-			for (int j = 0; j < fs->block_size/fs->dentry_size; j++) {
-				if (curr_dentry != NULL && strcmp(curr_dentry->name, "")) {
-					if (strcmp(curr_dentry->name, prev_ptr) == 0 && !(curr_inode->mode & S_IFREG)) {
-						curr_inode = (struct a1fs_inode*)(getpointer(fs->image, fs->inode_table)) + curr_dentry->ino;
-						parent_inode_num = curr_dentry->ino;
-					}
-				} 
-				curr_dentry++;
-			}
-			curr_extent++; 
-		}
-		strcpy(prev_ptr, ptr);
-		strcat(prev_ptr, "\0");
-		ptr = strtok(NULL,"/");
-	}
-	return parent_inode_num;
+	struct a1fs_inode *itable = (struct a1fs_inode*) getpointer(fs->image, fs->inode_table);
+	return (a1fs_ino_t)(find_inode(fs, fullpath) - itable);
 }
 
 
 
-//given a path, changed size, changed time , update those fields.
+//update the size and mtime of dir and all its ancestors, following the parent pointers up to the root.
 //positive for adding, negative for deleting.
 //link count and extent_num adding/deleting is local to the parent and will not be done here.
 //block count is calculated dynamically so we only update size.
-//is_file is 1 for files, 0 for directories.
-void update(const char *path, int size_change){
+//every directory gets the same time, read once.
+void update(struct a1fs_inode *dir, int64_t size_change){
 	fs_ctx *fs = get_fs();
-	// first get the source inode
-	struct a1fs_inode* curr_inode = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
-	char temp[A1FS_NAME_MAX];
-	strcpy(temp,path);
-	int length = strlen(temp);
-	int count = 0;
-	//count the number of iterations to go.
-	for(int i=0;i<length;i++){
-		if(temp[i]=='/')count++;
-	}
-	//then update the directories knowing file name.
-	char *name = strtok(temp,"/");
-	while(count>0){
-		//update the directory metadata and filename
-		curr_inode->size += size_change;
-		clock_gettime(CLOCK_REALTIME, &curr_inode->mtime);
-		curr_inode = getattr_helper(curr_inode,name,fs);
-		name = strtok(NULL,"/");
-		count--;
+	struct a1fs_inode *itable = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	//a path can't be deeper than there are inodes, this stops on a corrupt parent loop
+	for(int depth=0;depth<fs->inode_num;depth++){
+		dir->size += size_change;
+		dir->mtime = now;
+		//the root is its own parent
+		if(dir==itable) break;
+		dir = itable+dir->parent;
 	}
 }
 
-//update the superblock and fsctx by checking the bitmaps.
+//the bitmaps changed, the free counts in the superblock and fsctx are recounted before they are
+//next needed. counting every bit of a multi-TiB bitmap after each operation would dominate it.
 void update_sb(){
 	fs_ctx *fs = get_fs();
+	fs->counts_stale = true;
+}
+
+//update the superblock and fsctx by checking the bitmaps.
+static void recount_free(fs_ctx *fs){
 	struct a1fs_superblock* sb = (struct a1fs_superblock*)fs->image;
 	char *bbitmap = (char*)getpointer(fs->image,fs->bbitmap);
 	char *ibitmap = (char*)getpointer(fs->image,fs->ibitmap);
 	int ifree = 0;
-	int bfree = 0;
+	uint64_t bfree = 0;
 	for(int i=0;i<sb->inode_num;i++){
 		if(readmap(ibitmap,i)==0) ifree++; 
 	}
-	for(int i=0;i<sb->block_num;i++){
-		if(readmap(bbitmap,i)==0) bfree++; 
+	//whole bytes at a time, the bits past the last block are never set
+	uint64_t used = 0;
+	for(uint64_t i=0;i<(fs->block_num+7)/8;i++){
+		used += __builtin_popcount((unsigned char)bbitmap[i]);
+	}
+	bfree = fs->block_num-used;
+	//a read-only mount only fixes its own view, the superblock is mapped read-only
+	if(!fs->read_only){
+		sb->free_inum = ifree;
+		a1fs_sb_set_free_blocks(sb,bfree);
 	}
-	sb->free_inum = ifree;
 	fs->free_inum = ifree;
-	sb->free_bnum = bfree;
 	fs->free_bnum = bfree;
+	fs->counts_stale = false;
 }
 
 /**
@@ -582,101 +1252,210 @@ void update_sb(){
  * @return      0 on success; -errno on error.
  */
 
+//the dentry in slot n of a directory (dentry n % per block of its block n / per block), NULL past its last block
+static struct a1fs_dentry *dir_slot(fs_ctx *fs, struct a1fs_inode *dir, uint32_t n){
+	uint32_t block = n >> fs->dentry_shift;
+	struct a1fs_extent *table = (struct a1fs_extent *) getpointer(fs->image, dir->a1fs_extent_table);
+	for (int i = 0; i < dir->extent_num; i++) {
+		if (block < table[i].count) {
+			return (struct a1fs_dentry *) getpointer(fs->image, table[i].start + block) + (n & ((1u << fs->dentry_shift) - 1));
+		}
+		block -= table[i].count;
+	}
+	return NULL;
+}
+
+//add one zeroed block to the end of a directory, right after its last extent when that block is free.
+//returns false if the disk or the extent table is full.
+static bool grow_dir(fs_ctx *fs, struct a1fs_inode *dir){
+	struct a1fs_extent *table = (struct a1fs_extent *) getpointer(fs->image, dir->a1fs_extent_table);
+	struct a1fs_extent *last_extent = table + dir->extent_num - 1;
+	uint64_t next = (uint64_t)last_extent->start + last_extent->count;
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	// if the block after the last one is free, simply extend the extent
+	if (next < fs->block_num && !readmap(bbitmap, next)) {
+		writemap(&bbitmap, next);
+		zero_blocks(fs, next, 1);
+		last_extent->count++;
+		return true;
+	}
+	// otherwise a new extent, as close after the last one as the allocator can find
+	int status = allocate_blocks(1, table, dir->extent_num);
+	if (status <= dir->extent_num) return false;
+	dir->extent_num = status;
+	return true;
+}
+
 // Writes a dentry to a parent_inode, returns the parent inode
+// The parent's free_slot hint says where the first free slot can be, so a run of inserts
+// doesn't rescan the full blocks every time.
 static int write_dentry(fs_ctx *fs, a1fs_ino_t free_inode_num, const char *path)
 {	
 	a1fs_ino_t parent_inode_num = get_parent_inode(fs, path);
 	printf("the parent inode is:%d\n\n",((int)parent_inode_num));
 	struct a1fs_inode *parent_inode = (struct a1fs_inode*)getpointer(fs->image, fs->inode_table) + parent_inode_num;
-	struct a1fs_extent *parent_extent = (struct a1fs_extent *) getpointer(fs->image, parent_inode->a1fs_extent_table);
 	struct a1fs_dentry *curr_dentry;
-	// if there is space in the current data block
-	for (int extent = 0; extent < parent_inode->extent_num; extent++) {
-		curr_dentry = (struct a1fs_dentry *) getpointer(fs->image, parent_extent->start);
-		for(a1fs_blk_t i = 0; i < parent_extent->count; i++) {
-			for (int j = 0; j < fs->block_size / fs->dentry_size; j++) {
-				// find first empty directory entry 
-				printf("a1fs_mkdir: Viewing dentry (%s|%d)\n", curr_dentry->name, curr_dentry->ino);
-				if (strcmp(curr_dentry->name, "") == 0) {
-					printf("a1fs_mkdir: Creating dentry at location %d\n", j);
-					curr_dentry->ino = free_inode_num;
-					strcpy(curr_dentry->name, strrchr(path, '/') + 1);
-					return (int) parent_inode_num;
-				}
-				curr_dentry++;
-			}
-		}
-		parent_extent++;
+	uint32_t slot = parent_inode->free_slot;
+	// find the first empty directory entry from the hint
+	while ((curr_dentry = dir_slot(fs, parent_inode, slot)) != NULL) {
+		if (strcmp(curr_dentry->name, "") == 0) break;
+		slot++;
 	}
-	
-	// allocate another data block
-	struct a1fs_extent *last_extent = parent_extent + parent_inode->extent_num - 1;
-	int last_block = last_extent->start + last_extent->count - 1;
-	// find a free block, if we can't then return -1 so the outside function throws an error
-	int free_bit = get_free_block_bit(fs, -1);
-	if (free_bit == -1) return -1;  
-	// if we are one after the last block, simply extend the extent, otherwise we need a new extent
-	if (free_bit == last_block + 1) {
-		last_extent->count++;
-	} else {
-		// is it even possible to add a new extent?
-		printf("a1fs_mkdir: Checking that number of extents isn't greater than or equal to %d\n", fs->block_size / fs->extent_size);
-		if (parent_inode->extent_num >= fs->block_size / fs->extent_size) return -1;
-		printf("a1fs_mkdir: It isn't!\n");
-		// move the extent forward since we know there is space in front of it.
-		last_extent++;
-		last_extent->start = free_bit;
-		last_extent->count = 1;
-		// update the parent to make sure it knows a new extent exists
-		parent_inode->extent_num++;
+	// every block is full, allocate another data block
+	if (curr_dentry == NULL) {
+		if (!grow_dir(fs, parent_inode)) return -1;
+		update(parent_inode, fs->block_size);
+		curr_dentry = dir_slot(fs, parent_inode, slot);
 	}
-	
-	
-	// initialize the first dentry and rest of its block
-	// this is an exception for a1fs_dentries, since we don't want to read garbage data
 	curr_dentry->ino = free_inode_num;
 	strcpy(curr_dentry->name, strrchr(path, '/') + 1);
-	for (int i = 1; i < fs->block_size / fs->dentry_size; i++) {
-		curr_dentry++;
-		strcpy(curr_dentry->name, "\0");
-	}
-	// create the new dentry
-	struct a1fs_dentry *new_dentry = (struct a1fs_dentry *)getpointer(fs->image, free_bit);
-	new_dentry->ino = free_inode_num;
-	strcpy(new_dentry->name, strrchr(path, '/') + 1);
-	// write the data block that was added into bitmap, and add its size to parent
-	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
-	writemap(&bbitmap, free_bit);
-	parent_inode->size+= fs->block_size;
-	update(path,fs->block_size);
-	return parent_inode_num;
+	parent_inode->free_slot = slot + 1;
+	return (int) parent_inode_num;
 }
 
-bool check_space(int inode, int block){
-	//creating a file/directory requires 1 inode
-	//creating a directory requires 1 block
-	//for writing,
-	fs_ctx *fs = get_fs();
-	if(fs->free_inum<inode||fs->free_bnum>block) return false;
-	return true;
+//a directory of more than one block is compacted once at most 1 in this many of its slots is live
+#define DIR_COMPACT_RATIO 4
+
+/** A directory with open listings, see a1fs_opendir(). */
+struct a1fs_listing {
+	a1fs_ino_t ino;
+	/** Listings of it not released yet. */
+	uint32_t open;
+};
+
+//the open listings of directory ino, NULL if there are none
+static struct a1fs_listing *dir_listing(fs_ctx *fs, a1fs_ino_t ino){
+	for (size_t i = 0; i < fs->listings_n; i++) {
+		if (fs->listings[i].ino == ino) return fs->listings + i;
+	}
+	return NULL;
 }
 
-static int a1fs_mkdir(const char *path, mode_t mode)
-{
-	mode = mode | S_IFDIR;
-	fs_ctx *fs = get_fs();
-	//TODO: create a directory at given path with given mode
-	int free_inode_num = get_free_inode_bit(fs, -1);
-	if (free_inode_num == -1) return -ENOSPC;
-	fprintf(stderr, "a1fs_mkdir: Creating a new directory at inode number: %d\n", free_inode_num);
+//number of blocks in a directory
+static uint32_t dir_blocks(fs_ctx *fs, struct a1fs_inode *dir){
+	struct a1fs_extent *table = (struct a1fs_extent *) getpointer(fs->image, dir->a1fs_extent_table);
+	uint32_t blocks = 0;
+	for (int i = 0; i < dir->extent_num; i++) blocks += table[i].count;
+	return blocks;
+}
+
+//number of live dentries in a directory, "." and ".." included
+static uint32_t dir_live(fs_ctx *fs, struct a1fs_inode *dir){
+	struct a1fs_dentry *curr_dentry;
+	uint32_t live = 0;
+	for (uint32_t slot = 0; (curr_dentry = dir_slot(fs, dir, slot)) != NULL; slot++) {
+		if (strcmp(curr_dentry->name, "") != 0) live++;
+	}
+	return live;
+}
+
+//give the empty blocks at the end of a directory back to the bitmap, keeping at least one
+static void trim_dir(fs_ctx *fs, struct a1fs_inode *dir){
+	uint32_t per_block = 1u << fs->dentry_shift;
+	uint32_t blocks = dir_blocks(fs, dir);
+	uint32_t keep = blocks;
+	while (keep > 1) {
+		struct a1fs_dentry *first = dir_slot(fs, dir, (keep - 1) * per_block);
+		uint32_t j = 0;
+		while (j < per_block && strcmp(first[j].name, "") == 0) j++;
+		if (j < per_block) break;
+		keep--;
+	}
+	if (keep == blocks) return;
+	int freed = blocks - keep;
+	struct a1fs_extent *table = (struct a1fs_extent *) getpointer(fs->image, dir->a1fs_extent_table);
+	while (blocks > keep) {
+		struct a1fs_extent *last_extent = table + dir->extent_num - 1;
+		uint32_t take = blocks - keep;
+		if (take > last_extent->count) take = last_extent->count;
+		free_blocks(fs, last_extent->start + last_extent->count - take, take);
+		last_extent->count -= take;
+		blocks -= take;
+		if (last_extent->count == 0) {
+			memset(last_extent, 0, fs->extent_size);
+			dir->extent_num--;
+		}
+	}
+	if (dir->free_slot > keep * per_block) dir->free_slot = keep * per_block;
+	fs->free_bnum += freed;
+	update_sb();
+	update(dir, -freed * fs->block_size);
+}
+
+//move the live dentries of a directory to its first slots, in order, and give the blocks that
+//are left empty at the end back to the bitmap. readdir offsets are slot numbers, so this only
+//runs while no listing of the directory is open: one that goes on while entries are removed
+//(rm -rf) must still see every entry that is left exactly once
+static void compact_dir(fs_ctx *fs, struct a1fs_inode *dir){
+	struct a1fs_dentry *curr_dentry;
+	uint32_t live = 0;
+	for (uint32_t slot = 0; (curr_dentry = dir_slot(fs, dir, slot)) != NULL; slot++) {
+		if (strcmp(curr_dentry->name, "") == 0) continue;
+		if (slot != live) {
+			struct a1fs_dentry *to = dir_slot(fs, dir, live);
+			memcpy(to, curr_dentry, sizeof(*to));
+			memset(curr_dentry, 0, sizeof(*curr_dentry));
+		}
+		live++;
+	}
+	dir->free_slot = live;
+	trim_dir(fs, dir);
+}
+
+//a directory is compacted once it has become sparse enough, unless a listing of it is open
+static bool compact_due(fs_ctx *fs, struct a1fs_inode *dir){
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	uint32_t blocks = dir_blocks(fs, dir);
+	if (blocks <= 1 || dir_listing(fs, dir - itable)) return false;
+	return dir_live(fs, dir) * DIR_COMPACT_RATIO <= blocks << fs->dentry_shift;
+}
+
+//clear the dentry of inode ino in dir, and let the free slot hint know about the hole.
+//a directory that has become sparse enough is compacted; while it can't be, emptying its
+//last block still gives back the empty blocks at its end
+static void remove_dentry(fs_ctx *fs, struct a1fs_inode *dir, a1fs_ino_t ino){
+	struct a1fs_dentry *curr_dentry;
+	uint32_t slot = 0;
+	for (; (curr_dentry = dir_slot(fs, dir, slot)) != NULL; slot++) {
+		if (curr_dentry->ino != ino || strcmp(curr_dentry->name, "") == 0) continue;
+		if (strcmp(curr_dentry->name, ".") == 0 || strcmp(curr_dentry->name, "..") == 0) continue;
+		strcpy(curr_dentry->name, "");
+		curr_dentry->ino = 0;
+		if (slot < dir->free_slot) dir->free_slot = slot;
+		break;
+	}
+	if (!curr_dentry) return;
+	uint32_t blocks = dir_blocks(fs, dir);
+	if (compact_due(fs, dir)) compact_dir(fs, dir);
+	else if (blocks > 1 && slot >> fs->dentry_shift == blocks - 1) trim_dir(fs, dir);
+}
+
+bool check_space(int inode, int block){
+	//creating a file/directory requires 1 inode
+	//creating a directory requires 1 block
+	//for writing,
+	fs_ctx *fs = get_fs();
+	if(fs->free_inum<inode||fs->free_bnum>(uint64_t)block) return false;
+	return true;
+}
+
+static int a1fs_mkdir(const char *path, mode_t mode)
+{
+	mode = mode | S_IFDIR;
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
+	//TODO: create a directory at given path with given mode
+	int free_inode_num = get_inode_near(fs, get_parent_inode(fs, path), true);
+	if (free_inode_num == -1) return -ENOSPC;
+	fprintf(stderr, "a1fs_mkdir: Creating a new directory at inode number: %d\n", free_inode_num);
 	// create a new directory entry in the parent inode
 	int parent_inode_num = write_dentry(fs, free_inode_num, path);
 	if (parent_inode_num == -1) return -ENOSPC;
 	// create the directory, and record a new inode for it
-	int free_block_num_1 = get_free_block_bit(fs, -1);
-	int free_block_num_2 = get_free_block_bit(fs, free_block_num_1);
-	fprintf(stderr, "a1fs_mkdir: Creating an extent table for directory at block number: %d\n", free_block_num_1);
-	fprintf(stderr, "a1fs_mkdir: Assigning a data block for directory at block number: %d\n", free_block_num_2);
+	int64_t free_block_num_1 = get_free_block_bit(fs, -1);
+	int64_t free_block_num_2 = get_free_block_bit(fs, free_block_num_1);
+	fprintf(stderr, "a1fs_mkdir: Creating an extent table for directory at block number: %ld\n", (long)free_block_num_1);
+	fprintf(stderr, "a1fs_mkdir: Assigning a data block for directory at block number: %ld\n", (long)free_block_num_2);
 	if (free_block_num_1 == -1 || free_block_num_2 == -1) return -ENOSPC;
 	struct a1fs_inode *free_inode = (struct a1fs_inode *)(((void *) getpointer(fs->image, fs->inode_table)) + (free_inode_num * fs->inode_size));
 	fprintf(stderr, "a1fs_mkdir: Creating a free inode: %p\n", free_inode);
@@ -688,11 +1467,17 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 
 	free_inode->a1fs_extent_table = free_block_num_1;
 	free_inode->extent_num = 1;
+	free_inode->parent = parent_inode_num;
+	free_inode->free_slot = 2;
+	//compression is passed on to the subdirectories
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	free_inode->flags = itable[parent_inode_num].flags & A1FS_INODE_COMPRESS;
 	struct a1fs_extent *free_extent = (struct a1fs_extent *)getpointer(fs->image, free_inode->a1fs_extent_table);
 	free_extent->start = (a1fs_blk_t) free_block_num_2;
 	free_extent->count = (a1fs_blk_t) 1;
 	
-	//add two dentries into the first free extent
+	//add two dentries into the first free extent, a block freed by a file still holds its data
+	zero_blocks(fs, free_block_num_2, 1);
 	struct a1fs_dentry* this = (struct a1fs_dentry *)getpointer(fs->image,free_extent->start);
 	this->ino = (a1fs_ino_t)free_inode_num;
 	strncpy(this->name,".",252);
@@ -713,7 +1498,7 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 	writemap(&ibitmap, free_inode_num);
 
 	//in the end, update the superblock,size and time.
-	update(path, fs->block_size);
+	update(parent_inode, fs->block_size);
 	update_sb();
 	return 0;
 }
@@ -734,7 +1519,8 @@ static int a1fs_mkdir(const char *path, mode_t mode)
  */
 static int a1fs_rmdir(const char *path)
 {
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
 	
 	//TODO: remove the directory at given path (only if it's empty)
 	char fullpath[A1FS_PATH_MAX];
@@ -749,44 +1535,30 @@ static int a1fs_rmdir(const char *path)
 		}
 		for (int extent = 0; extent < prev_inode->extent_num; extent++) {
 			struct a1fs_extent *prev_extent = (struct a1fs_extent *) getpointer(fs->image, prev_inode->a1fs_extent_table) + extent;
-			struct a1fs_dentry *prev_dentry = (struct a1fs_dentry *) getpointer(fs->image, prev_extent->start);
 			for (a1fs_blk_t i = 0; i < prev_extent->count; i++) {
-				for (int j = 0; j < fs->block_size/fs->dentry_size; j++) {
+				struct a1fs_dentry *prev_dentry = (struct a1fs_dentry *) getpointer(fs->image, prev_extent->start + i);
+				for (int j = 0; j < 1<<fs->dentry_shift; j++) {
 					if (prev_dentry != NULL && !strcmp(prev_dentry->name, ptr)) {
 						curr_inode = (struct a1fs_inode *)(getpointer(fs->image, fs->inode_table)) + prev_dentry->ino;
 						curr_inode_num = (int)prev_dentry->ino;
 					} 
 					prev_dentry++;
 				}
-				prev_extent++; 
 			}
 		}
 		ptr = strtok(NULL, "/");
 	}
 
 	if (curr_inode == NULL) return -1;
-	if (curr_inode->extent_num > 1){
+	//anything but "." and ".." left
+	if (dir_live(fs, curr_inode) > 2){
 		printf("current extent number:%d\n\n\n",curr_inode->extent_num);
 		return -ENOTEMPTY;
 	}
-	int extent_table = curr_inode->a1fs_extent_table;
-	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	uint64_t extent_table = curr_inode->a1fs_extent_table;
 	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
 	// get rid of dentry in parent
-	struct a1fs_extent *prev_extent = (struct a1fs_extent *) getpointer(fs->image, prev_inode->a1fs_extent_table);
-	struct a1fs_dentry *prev_dentry;
-	for (int i = 0; i < prev_inode->extent_num; i++) {
-		prev_dentry = (struct a1fs_dentry *) getpointer(fs->image, prev_extent->start);
-		for(int j = 0; j < fs->block_size / fs->dentry_size; j++) {
-			if (prev_dentry != NULL && (int)prev_dentry->ino == curr_inode_num) {
-				printf("a1fs_rmdir: Set dentry of %s in parent to empty string.\n", prev_dentry->name);
-				strcpy(prev_dentry->name, "\0");
-				prev_dentry->ino = 0;
-			}
-			prev_dentry++;
-		}
-		prev_extent++; 
-	}
+	remove_dentry(fs, prev_inode, curr_inode_num);
 	
 
 	// clear parent link and decrease its size by one directory entry
@@ -795,21 +1567,20 @@ static int a1fs_rmdir(const char *path)
 	// clear data blocks
 	struct a1fs_extent *curr_extent = (struct a1fs_extent *) getpointer(fs->image, extent_table);
 	for (int i = 0; i < curr_inode->extent_num; i++) {
-		for (a1fs_blk_t j = curr_extent->start; j < curr_extent->start + curr_extent->count; j++) {
-			printf("a1fs_rmdir: Unwriting data block number: %d\n", j);
-			erasemap(&bbitmap, j);
-		}
+		printf("a1fs_rmdir: Unwriting data blocks %u to %u\n", curr_extent->start,
+		       curr_extent->start + curr_extent->count - 1);
+		free_blocks(fs, curr_extent->start, curr_extent->count);
 		curr_extent++;
 	}
 
 	// clear extent table
-	printf("a1fs_rmdir: Removed extent table at block number: %d\n", extent_table);
-	erasemap(&bbitmap, extent_table);
+	printf("a1fs_rmdir: Removed extent table at block number: %lu\n", (unsigned long)extent_table);
+	free_blocks(fs, extent_table, 1);
 	printf("a1fs_rmdir: Removed directory at inode number: %d\n", curr_inode_num);
 	erasemap(&ibitmap, curr_inode_num);
 
 	//update the superblock
-	update(path,-(fs->block_size));
+	update(prev_inode,-curr_inode->size);
 	update_sb();
 	return 0;
 }
@@ -830,7 +1601,7 @@ static int a1fs_rmdir(const char *path)
  *
  * @param path  path to the file to create.
  * @param mode  file mode bits.
- * @param fi    unused.
+ * @param fi    receives the open file state in fi->fh; may be NULL.
  * @return      0 on success; -errno on error.
  */
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
@@ -839,9 +1610,9 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	//data block(parent) to indicate that there is a new dentry
 	//if the data from the parent block is full, allocate a new block
 	//do not modify block bitmap nor random data blocks
-	(void)fi;// unused
 	assert(S_ISREG(mode));
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
 	//TODO: create a file at given path with given mode
 	//first use the getattr_helper to find the directory
 	struct a1fs_inode* root = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
@@ -865,7 +1636,7 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	//printf("%s%d\n",filename,curr_inode->a1fs_extent_table);
 
 	char *ibitmap =(char *)getpointer(fs->image,fs->ibitmap);
-	int bit = get_free_inode_bit(fs,-1);
+	int bit = get_inode_near(fs,get_parent_inode(fs,path),false);
 	if (bit==-1) return -ENOSPC;
 	writemap(&ibitmap,bit);
 	//printmap(ibitmap,4);
@@ -879,32 +1650,165 @@ static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 	new_inode->a1fs_blocks = 0;
 	new_inode->a1fs_extent_table = 0;
 	new_inode->extent_num = 0;
+	new_inode->free_slot = 0;
 	clock_gettime(CLOCK_REALTIME, &new_inode->mtime);
 	
 	//if we need to,allocate a new block,else the new entry is at the end of the old dentrys.
-	write_dentry(fs,(a1fs_ino_t)bit,path);
+	int parent_num = write_dentry(fs,(a1fs_ino_t)bit,path);
+	if(parent_num==-1){
+		erasemap(&ibitmap,bit);
+		return -ENOSPC;
+	}
+	new_inode->parent = parent_num;
+	new_inode->flags = root[parent_num].flags & A1FS_INODE_COMPRESS;
 
 	//parent's link count need to increase
 	curr_inode->links++;
 
 	//iterate back up to change the size and mtime of all ancestors. use a helper.
-	update(path,0);
+	update(root+parent_num,0);
 	update_sb();
+	
+	//the file is open now, give it the same state as a1fs_open does
+	if(fi){
+		a1fs_file *file = calloc(1,sizeof(*file));
+		if(!file) return -ENOMEM;
+		file->ino = bit;
+		fi->fh = (uintptr_t)file;
+	}
 	return 0;
 }
 
 //free the blocks on bitmap, and clear the extent
 void clear_extent(struct a1fs_extent* table, int num){
 	fs_ctx *fs = get_fs();
-	char *bbitmap = (char *)getpointer(fs->image,fs->bbitmap);
 	struct a1fs_extent* target = table+num;
-	for(unsigned int i=target->start;i<(target->start+target->count);i++){
-		erasemap(&bbitmap,i);
-	}
+	free_blocks(fs, target->start, a1fs_extent_used(target));
 	memset(target,0,fs->extent_size);
 }
 
 
+//blocks held by the extents of an inode
+static uint64_t inode_blocks(fs_ctx *fs, struct a1fs_inode *inode){
+	if (inode->extent_num == 0) return 0;
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	uint64_t blocks = 0;
+	for (int i = 0; i < inode->extent_num; i++) blocks += a1fs_extent_used(table + i);
+	return blocks;
+}
+
+//put an unlinked inode on the orphan list, its blocks and then the inode itself are freed by
+//orphan_step(). links 0 tells it apart from the live inodes
+static void orphan_add(fs_ctx *fs, a1fs_ino_t ino){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	struct a1fs_inode *inode = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table) + ino;
+	inode->links = 0;
+	inode->parent = sb->s_orphan_head;
+	sb->s_orphan_head = ino;
+	sb->s_orphan_num++;
+	sb->orphan_blocks += inode_blocks(fs, inode) + (inode->a1fs_extent_table ? 1 : 0);
+}
+
+/**
+ * Free up to budget blocks of the inodes on the orphan list.
+ *
+ * Runs at the start of an operation, so deleting a huge file costs its
+ * caller no more than a small one, and the blocks come back a step at a
+ * time. An orphan loses its blocks from the end of its last extent; the
+ * extent count goes down before the bits are cleared, so a crash in between
+ * leaks blocks instead of freeing them twice. An orphan without blocks left
+ * gives back its extent table and inode and leaves the list.
+ */
+static void orphan_step(fs_ctx *fs, uint64_t budget){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	while (budget > 0 && sb->s_orphan_head != 0) {
+		a1fs_ino_t ino = sb->s_orphan_head;
+		struct a1fs_inode *inode = itable + ino;
+		struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+		while (budget > 0 && inode->extent_num > 0) {
+			struct a1fs_extent *last = table + inode->extent_num - 1;
+			uint64_t used = a1fs_extent_used(last);
+			//a compressed cluster goes in one piece
+			uint64_t take = used < budget || a1fs_extent_compressed(last) ? used : budget;
+			uint64_t start = last->start + used - take;
+			if (take == used) {
+				memset(last, 0, fs->extent_size);
+				inode->extent_num--;
+			}
+			else last->count -= take;
+			free_blocks(fs, start, take);
+			budget -= take < budget ? take : budget;
+			sb->orphan_blocks -= take;
+		}
+		if (inode->extent_num > 0) break;
+		sb->s_orphan_head = inode->parent;
+		sb->s_orphan_num--;
+		if (inode->a1fs_extent_table != 0) {
+			uint32_t table_block = inode->a1fs_extent_table;
+			inode->a1fs_extent_table = 0;
+			free_blocks(fs, table_block, 1);
+			sb->orphan_blocks--;
+		}
+		erasemap(&ibitmap, ino);
+	}
+	update_sb();
+}
+
+//free the blocks, extent table and inode of a file that is no longer linked anywhere. a large
+//file goes on the orphan list instead
+static void release_inode(fs_ctx *fs, a1fs_ino_t ino){
+	struct a1fs_inode *inode = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table) + ino;
+	if (inode_blocks(fs, inode) > ORPHAN_MIN_BLOCKS) {
+		orphan_add(fs, ino);
+		return;
+	}
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	for (int i = 0; i < inode->extent_num; i++) clear_extent(table, i);
+	inode->extent_num = 0;
+	if (inode->a1fs_extent_table != 0) {
+		printf("a1fs_rm: Removed extent table at block number: %u\n", inode->a1fs_extent_table);
+		free_blocks(fs, inode->a1fs_extent_table, 1);
+		inode->a1fs_extent_table = 0;
+	}
+	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	erasemap(&ibitmap, ino);
+}
+
+//truncate a file to 0 in place. the blocks of a large file are handed to a new inode that goes
+//on the orphan list, so the caller doesn't wait for them to be freed
+static void truncate_to_zero(fs_ctx *fs, struct a1fs_inode *inode){
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	if (inode_blocks(fs, inode) > ORPHAN_MIN_BLOCKS) {
+		int ino = get_inode_near(fs, inode->parent, false);
+		if (ino > 0) {
+			char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+			writemap(&ibitmap, ino);
+			struct a1fs_inode *orphan = itable + ino;
+			memset(orphan, 0, sizeof(*orphan));
+			orphan->mode = inode->mode;
+			orphan->a1fs_extent_table = inode->a1fs_extent_table;
+			orphan->extent_num = inode->extent_num;
+			inode->a1fs_extent_table = 0;
+			inode->extent_num = 0;
+			orphan_add(fs, ino);
+		}
+	}
+	//no inode to hand the blocks to, or a small file: free them now
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	for (int i = 0; i < inode->extent_num; i++) clear_extent(table, i);
+	inode->extent_num = 0;
+	if (inode->a1fs_extent_table != 0) {
+		free_blocks(fs, inode->a1fs_extent_table, 1);
+		inode->a1fs_extent_table = 0;
+	}
+	update(itable + inode->parent, -(int64_t)inode->size);
+	inode->size = 0;
+	clock_gettime(CLOCK_REALTIME, &inode->mtime);
+	update_sb();
+}
+
 /**
  * Remove a file.
  *
@@ -922,14 +1826,13 @@ void clear_extent(struct a1fs_extent* table, int num){
 
 static int a1fs_unlink(const char *path)
 {
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
 
 	//TODO: remove the file at given path
 
-	//what to do: get the file inode, delete each of its extents(clear bbitmap), delete the dentry, clear ibitmap, clear inode table, 		
-	//change parent inode, and change all ancestors
-	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
-	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	//what to do: get the file inode, delete the dentry, change parent inode and all ancestors, then free
+	//its extents, extent table and inode
 	void *inode_table = getpointer(fs->image, fs->inode_table);
 	//first get the inode	
 	struct a1fs_inode* root = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
@@ -937,62 +1840,159 @@ static int a1fs_unlink(const char *path)
 	strcpy(temp,path);
 	char *name = strtok(temp,"/");
 	
-	int count = 0;
 	struct a1fs_inode* curr_inode = root;
 	while(name!=NULL){
 		curr_inode = getattr_helper(curr_inode,name,fs);
-		count++;
 		name = strtok(NULL,"/");
 	}
 	
 	//get parent inode
-	strcpy(temp,path);
-	name = strtok(temp,"/");
-	
-	struct a1fs_inode* prev_inode = root;
-	while(name!=NULL){
-		count--;
-		if(count==0) break;
-		prev_inode = getattr_helper(prev_inode,name,fs);
-		name = strtok(NULL,"/");
-	}
+	struct a1fs_inode* prev_inode = root+curr_inode->parent;
 	
 	int curr_inode_num = ((void*)curr_inode - inode_table)/fs->inode_size;
-	struct a1fs_extent* table = getpointer(fs->image,curr_inode->a1fs_extent_table);
 
-	//clear the extent table and free the bbitmap
-	for(int i=0;i<curr_inode->extent_num;i++){
-		clear_extent(table,i);	
-	}
-	
 	//remove the dentry from parent
-	struct a1fs_extent *parent_table = (struct a1fs_extent *) getpointer(fs->image, prev_inode->a1fs_extent_table);
-	struct a1fs_dentry *curr_dentry = (struct a1fs_dentry *) getpointer(fs->image, parent_table->start);
-	int removed = 0;
-	while(removed ==0){
-		if((int)(curr_dentry->ino)==curr_inode_num){
-			strcpy(curr_dentry->name,"");
-			curr_dentry->ino = (a1fs_ino_t)0;
-			removed = 1;
-			printf("a1fs_rm:file dentry removal successful!\n");	
-		}
-		curr_dentry++;
+	remove_dentry(fs,prev_inode,curr_inode_num);
+
+	//iterate back up to change the size and mtime of all ancestors. use a helper.
+	update(prev_inode,-curr_inode->size);
+
+	//free the extents, the extent table and the inode, or leave that to orphan_step() for a large file
+	printf("a1fs_rm: Removed file at inode number: %d\n", curr_inode_num);
+	release_inode(fs, curr_inode_num);
+	update_sb();
+	return 0;
+}
+
+
+//the dentry called name in dir, NULL if there is none
+static struct a1fs_dentry *find_dentry(fs_ctx *fs, struct a1fs_inode *dir, const char *name){
+	struct a1fs_dentry *curr_dentry;
+	for (uint32_t slot = 0; (curr_dentry = dir_slot(fs, dir, slot)) != NULL; slot++) {
+		if (curr_dentry->name[0] != '\0' && strcmp(curr_dentry->name, name) == 0) return curr_dentry;
 	}
-	
+	return NULL;
+}
 
-	// clear extent table, that is if the file has one
-	if(curr_inode->a1fs_extent_table!=0){	
-		printf("a1fs_rm: Removed extent table at block number: %d\n", curr_inode->a1fs_extent_table);
-		erasemap(&bbitmap, curr_inode->a1fs_extent_table);
+//true if path is below dir in the tree, e.g. /a/b/c below /a
+static bool path_below(const char *path, const char *dir){
+	size_t n = strlen(dir);
+	return strncmp(path, dir, n) == 0 && path[n] == '/';
+}
+
+//inode ino moved from directory from to directory to: its parent pointer, the ".." of a directory and
+//the link counts follow, and the size it adds to its ancestors moves over
+static void move_inode(fs_ctx *fs, a1fs_ino_t ino, a1fs_ino_t from, a1fs_ino_t to){
+	if (from == to) return;
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	struct a1fs_inode *inode = itable + ino;
+	inode->parent = to;
+	if (S_ISDIR(inode->mode)) {
+		struct a1fs_dentry *dotdot = dir_slot(fs, inode, 1);
+		if (dotdot) dotdot->ino = to;
+		itable[from].links--;
+		itable[to].links++;
 	}
-	printf("a1fs_rm: Removed file at inode number: %d\n", curr_inode_num);
-	erasemap(&ibitmap, curr_inode_num);
-	//iterate back up to change the size and mtime of all ancestors. use a helper.
-	update(path,-curr_inode->size);
+	update(itable + from, -(int64_t)inode->size);
+	update(itable + to, inode->size);
+}
+
+/**
+ * Rename a file or directory, with the flags of renameat2().
+ *
+ * Only dentries change, so moving a large file or a directory tree costs one
+ * dentry insert and one remove: a rename inside a directory rewrites the name
+ * in place, a move to another directory writes a dentry there before the old
+ * one is cleared. A target that exists is removed the way unlink and rmdir
+ * remove it. RENAME_EXCHANGE swaps the inode numbers of the two dentries.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "from" exists, and the parent directory of "to" exists and is a directory.
+ *
+ * Errors:
+ *   EINVAL        unknown flags, or a directory would move below itself.
+ *   EEXIST        RENAME_NOREPLACE and "to" exists.
+ *   ENOENT        RENAME_EXCHANGE and "to" doesn't exist.
+ *   ENOTDIR       "from" is a directory and "to" is not.
+ *   EISDIR        "to" is a directory and "from" is not.
+ *   ENOTEMPTY     "to" is a non-empty directory.
+ *   ENAMETOOLONG  the new name doesn't fit in a dentry.
+ *   ENOSPC        no room for the new dentry.
+ *
+ * @param from   path to the file or directory to rename.
+ * @param to     its new path.
+ * @param flags  0, RENAME_NOREPLACE or RENAME_EXCHANGE.
+ * @return       0 on success; -errno on error.
+ */
+int a1fs_rename2(const char *from, const char *to, unsigned int flags)
+{
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
+	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) return -EINVAL;
+	if ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE)) return -EINVAL;
+	if (strlen(from) >= A1FS_PATH_MAX || strlen(to) >= A1FS_PATH_MAX) return -ENAMETOOLONG;
+	const char *to_name = strrchr(to, '/') + 1;
+	if (strlen(to_name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
+	if (strcmp(from, to) == 0) return 0;
+	if (path_below(to, from)) return -EINVAL;
+
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	a1fs_ino_t from_dir = get_parent_inode(fs, from), to_dir = get_parent_inode(fs, to);
+	struct a1fs_dentry *src = find_dentry(fs, itable + from_dir, strrchr(from, '/') + 1);
+	if (!src) return -ENOENT;
+	a1fs_ino_t ino = src->ino;
+	struct a1fs_dentry *dst = find_dentry(fs, itable + to_dir, to_name);
+
+	if (flags & RENAME_EXCHANGE) {
+		if (!dst) return -ENOENT;
+		if (path_below(from, to)) return -EINVAL;
+		a1fs_ino_t other = dst->ino;
+		src->ino = other;
+		dst->ino = ino;
+		move_inode(fs, ino, from_dir, to_dir);
+		move_inode(fs, other, to_dir, from_dir);
+		update(itable + from_dir, 0);
+		update(itable + to_dir, 0);
+		return 0;
+	}
+	if (dst) {
+		if (flags & RENAME_NOREPLACE) return -EEXIST;
+		if (dst->ino == ino) return 0;
+		struct a1fs_inode *victim = itable + dst->ino;
+		if (S_ISDIR(itable[ino].mode) && !S_ISDIR(victim->mode)) return -ENOTDIR;
+		if (!S_ISDIR(itable[ino].mode) && S_ISDIR(victim->mode)) return -EISDIR;
+		if (S_ISDIR(victim->mode) && dir_live(fs, victim) > 2) return -ENOTEMPTY;
+		//the inodes of the two dentries are swapped, then the old name goes like an unlink would
+		a1fs_ino_t victim_ino = dst->ino;
+		dst->ino = ino;
+		src->ino = victim_ino;
+		remove_dentry(fs, itable + from_dir, victim_ino);
+		move_inode(fs, ino, from_dir, to_dir);
+		if (S_ISDIR(victim->mode)) itable[to_dir].links--;
+		update(itable + to_dir, -(int64_t)victim->size);
+		release_inode(fs, victim_ino);
+		update_sb();
+		return 0;
+	}
+
+	if (from_dir == to_dir) {
+		//a new name in the same directory is written over the old one
+		strcpy(src->name, to_name);
+		update(itable + from_dir, 0);
+		return 0;
+	}
+	if (write_dentry(fs, ino, to) == -1) return -ENOSPC;
+	remove_dentry(fs, itable + from_dir, ino);
+	move_inode(fs, ino, from_dir, to_dir);
 	update_sb();
 	return 0;
 }
 
+//rename() as FUSE 2 passes it, without flags
+static int a1fs_rename(const char *from, const char *to)
+{
+	return a1fs_rename2(from, to, 0);
+}
 
 /**
  * Change the modification time of a file or directory.
@@ -1012,7 +2012,8 @@ static int a1fs_unlink(const char *path)
  */
 static int a1fs_utimens(const char *path, const struct timespec times[2])
 {
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
 
 	//TODO: update the modification timestamp (mtime) in the inode for given
 	// path with either the time passed as argument or the current time,
@@ -1063,7 +2064,8 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
 //ENOMEM AND ENOSPC not yet implemented
 static int a1fs_truncate(const char *path, off_t size)
 {
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
 
 	//TODO: set new file size, possibly "zeroing out" the uninitialized range
 	//first get the inode	
@@ -1079,40 +2081,53 @@ static int a1fs_truncate(const char *path, off_t size)
 		name = strtok(NULL,"/");
 	}
 	
-	int blocks_needed = (int)size/fs->block_size;
-	if(size%fs->block_size!=0) blocks_needed++;
-	int blocks_actual = curr_inode->size/fs->block_size;
-	if(curr_inode->size%fs->block_size!=0) blocks_actual++;
+	//truncating to 0 keeps the inode, only the blocks go
+	if(size==0){
+		if(curr_inode->size!=0) truncate_to_zero(fs,curr_inode);
+		return 0;
+	}
 	
+	int64_t blocks_needed = ((uint64_t)size+fs->block_mask)>>fs->block_shift;
+	int64_t blocks_actual = (curr_inode->size+fs->block_mask)>>fs->block_shift;
+	
+	//a compressed cluster is stored whole: the one holding the new last block of a shrinking file,
+	//or the old last block that growing zeroes the rest of, goes back to plain blocks first
+	if(compressed_fs(fs) && curr_inode->size>0 && ((uint64_t)size<curr_inode->size || (curr_inode->size&fs->block_mask))){
+		uint64_t last_byte = ((uint64_t)size<curr_inode->size ? (uint64_t)size : curr_inode->size)-1;
+		int ret = uncompress_block(fs,curr_inode,last_byte>>fs->block_shift);
+		if(ret<0) return ret;
+	}
 	
 	//if the current file size is 0, then there is no extent table.. initialize one
 	if(curr_inode->size==0){
-		curr_inode->a1fs_extent_table = get_free_block_bit(fs,-1);
+		int64_t table_block = get_free_block_bit(fs,-1);
+		if(table_block==-1) return -ENOSPC;
+		curr_inode->a1fs_extent_table = table_block;
 		writemap(&bbitmap,curr_inode->a1fs_extent_table);
 	}
 	
+	//growing zeroes the rest of the last block, which must not be shared with a clone
+	if((uint64_t)size>curr_inode->size && (curr_inode->size&fs->block_mask)!=0 && refs_shared(fs)){
+		int ret = unshare_block(fs,curr_inode,(curr_inode->size-1)>>fs->block_shift);
+		if(ret<0) return ret;
+	}
+	
 	//if there is one already, get it.
 	struct a1fs_extent* table = getpointer(fs->image,curr_inode->a1fs_extent_table);
 	
 	//find the last extent
 	struct a1fs_extent* last = table+curr_inode->extent_num-1;
 	
-	//find last block
-	void *last_block = getpointer(fs->image,last->start+last->count-1);
-	
-	//if size is 0, delete the file and create the same file..
-	if(size==0){
-		int mode = curr_inode->mode;
-		a1fs_unlink(path);
-		a1fs_create(path,mode,NULL);
-	}
+	//find last block, if the file has one
+	void *last_block = NULL;
+	if(curr_inode->extent_num>0) last_block = getpointer(fs->image,last->start+a1fs_extent_used(last)-1);
 	
 	
 	if(blocks_needed == blocks_actual){
 		//extend the current block
-		if((unsigned int)size>curr_inode->size){
-			void *data_start = last_block+curr_inode->size%fs->block_size;
-			memset(data_start,0,(int)size-curr_inode->size);
+		if((uint64_t)size>curr_inode->size){
+			void *data_start = last_block+(curr_inode->size&fs->block_mask);
+			memset(data_start,0,size-curr_inode->size);
 		}
 		//if smaller then do nothing but change size
 	}
@@ -1122,22 +2137,19 @@ static int a1fs_truncate(const char *path, off_t size)
 		//starting from last extent, going back, deallocate entire extents, and remove the extents from table and change bbitmap
 		//extent_num-- for each deleted
 		//if it becomes 0, then the extent block itself can be removed
-		int deallocate_num = blocks_actual-blocks_needed;
-		for(int i = curr_inode->extent_num-1;i>=0;i--){
+		int64_t deallocate_num = blocks_actual-blocks_needed;
+		for(int i = curr_inode->extent_num-1;i>=0 && deallocate_num>0;i--){
 			struct a1fs_extent* extent = table+i;
-			int count = extent->count;
-			if(count>=deallocate_num){
-				extent->count = deallocate_num;
-				//erase the bitmaps for these blocks
-				for(int i=deallocate_num;i>0;i--){
-					erasemap(&bbitmap,extent->start+i-1);
-				}
+			int64_t count = a1fs_extent_len(extent);
+			if(count>deallocate_num){
+				//erase the bitmaps for the blocks at the end of this extent
+				free_blocks(fs, extent->start+count-deallocate_num, deallocate_num);
+				extent->count = count-deallocate_num;
 				deallocate_num = 0;
-				break;
 			}
 			else{
+				deallocate_num-=count;
 				clear_extent(table,i);
-				deallocate_num-=extent->count;
 				curr_inode->extent_num--;
 			}
 		}
@@ -1145,6 +2157,17 @@ static int a1fs_truncate(const char *path, off_t size)
 	
 	//allocate more blocks, reset them
 	else if(blocks_needed > blocks_actual){
+		//the rest of the old last block becomes part of the file, zero it here since reads never touch the image
+		if(curr_inode->extent_num>0 && (curr_inode->size&fs->block_mask)!=0){
+			void *data_start = last_block+(curr_inode->size&fs->block_mask);
+			memset(data_start,0,fs->block_size-(curr_inode->size&fs->block_mask));
+		}
+		if(blocks_needed-blocks_actual>INT_MAX) return -EFBIG;
+		//the blocks of orphans are counted as free, so get them back before running out
+		if(((struct a1fs_superblock *)fs->image)->s_orphan_head){
+			if(fs->counts_stale) recount_free(fs);
+			if(fs->free_bnum<(uint64_t)(blocks_needed-blocks_actual)) orphan_step(fs,UINT64_MAX);
+		}
 		int status = allocate_blocks(blocks_needed - blocks_actual,table,curr_inode->extent_num);
 		
 		//printf("bbitmap after allocation:\n");
@@ -1156,13 +2179,132 @@ static int a1fs_truncate(const char *path, off_t size)
 	}
 	
 	//update parent directories for the size change, and update size of file.
-	update(path,size-curr_inode->size);
+	update(root+curr_inode->parent,size-curr_inode->size);
 	curr_inode->size=size;
 	update_sb();
 	return 0;
 }
 
 
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. Sets up the per open file state (see
+ * a1fs_file) in fi->fh.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    receives the open file state in fi->fh.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = begin_op();
+	a1fs_file *file = calloc(1, sizeof(*file));
+	if (!file) return -ENOMEM;
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	file->ino = find_inode(fs, path) - itable;
+	fi->fh = (uintptr_t)file;
+	return 0;
+}
+
+/**
+ * Release an open file.
+ *
+ * Called when the last descriptor of an open file is closed. Frees the state
+ * set up by a1fs_open() or a1fs_create().
+ *
+ * @param path  path to the file.
+ * @param fi    the open file.
+ * @return      0.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	a1fs_file *file = get_file(fi);
+	//a file in a compressed directory is compressed once the writer is done with it
+	if (file && file->written) {
+		fs_ctx *fs = begin_op();
+		struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+		char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+		if (!fs->read_only && file->ino > 0 && readmap(ibitmap, file->ino)) {
+			struct a1fs_inode *inode = itable + file->ino;
+			if (inode->links > 0 && S_ISREG(inode->mode) && (inode->flags & A1FS_INODE_COMPRESS)) compress_inode(fs, inode);
+		}
+	}
+	if (file) free(file->zcache.data);
+	free(file);
+	fi->fh = 0;
+	return 0;
+}
+
+/**
+ * Open a directory.
+ *
+ * Implements the opendir() system call. readdir() offsets are slot numbers,
+ * so the directory is not compacted (see compact_dir()) while it has open
+ * listings; they are counted in fs->listings.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the directory to open.
+ * @param fi    receives the inode number of the directory in fi->fh.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = begin_op();
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	a1fs_ino_t ino = find_inode(fs, path) - itable;
+	struct a1fs_listing *listing = dir_listing(fs, ino);
+	if (!listing) {
+		struct a1fs_listing *listings = realloc(fs->listings, (fs->listings_n + 1) * sizeof(*listings));
+		if (!listings) return -ENOMEM;
+		fs->listings = listings;
+		listing = listings + fs->listings_n++;
+		listing->ino = ino;
+		listing->open = 0;
+	}
+	listing->open++;
+	fi->fh = ino;
+	return 0;
+}
+
+/**
+ * Release an open directory.
+ *
+ * Called when the last descriptor of an open directory is closed. Once no
+ * listing of the directory is left, the compaction put off while it was
+ * listed is done.
+ *
+ * @param path  path to the directory.
+ * @param fi    the open directory.
+ * @return      0.
+ */
+static int a1fs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	(void)path;// unused
+	fs_ctx *fs = begin_op();
+	struct a1fs_listing *listing = dir_listing(fs, fi->fh);
+	if (!listing || --listing->open > 0) return 0;
+	*listing = fs->listings[--fs->listings_n];
+
+	//the directory may have been removed while it was listed
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	struct a1fs_inode *dir = itable + fi->fh;
+	if (!fs->read_only && readmap(ibitmap, fi->fh) && S_ISDIR(dir->mode) && compact_due(fs, dir)) {
+		compact_dir(fs, dir);
+	}
+	return 0;
+}
+
 /**
  * Read data from a file.
  *
@@ -1180,7 +2322,7 @@ static int a1fs_truncate(const char *path, off_t size)
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      open file; fi->fh holds the readahead state.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
@@ -1191,21 +2333,130 @@ static int a1fs_truncate(const char *path, off_t size)
 void print_etable(struct a1fs_extent* table){
 	printf("printing extent table:\n");
 	for(int i=0;i<10;i++){
-		if(table->count!=0)printf("start:%d, count:%d\n", table->start,table->count);
+		if(table->count!=0)printf("start:%u, count:%u\n", table->start,table->count);
 		table++;
 	}
 }
  
+//madvise [addr, addr+len) of the image. blocks smaller than a page don't start on a page
+//boundary, so a hint is widened to the pages it touches, and a drop is narrowed to the pages
+//inside the range so it never takes the neighbouring blocks with it
+static void advise_pages(void *addr, size_t len, int advice){
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t lo = (uintptr_t)addr, hi = lo+len;
+	if(advice==MADV_DONTNEED){
+		lo = (lo+page-1)&~(page-1);
+		hi &= ~(page-1);
+		if(lo>=hi) return;
+	}
+	else{
+		lo &= ~(page-1);
+		hi = (hi+page-1)&~(page-1);
+	}
+	madvise((void *)lo,hi-lo,advice);
+}
+
+//madvise the blocks backing the file range [from, to), an extent at a time
+static void advise_range(fs_ctx *fs, struct a1fs_inode *inode, struct a1fs_extent *table,
+                         off_t from, off_t to, int advice){
+	if(to>(off_t)inode->size) to = inode->size;
+	if(from>=to) return;
+	unsigned int first = from/fs->block_size;
+	unsigned int last = (to+fs->block_size-1)/fs->block_size;
+	//logical block number of the start of the current extent
+	unsigned int base = 0;
+	for(int i=0;i<inode->extent_num && base<last;i++){
+		struct a1fs_extent *extent = table+i;
+		unsigned int len = a1fs_extent_len(extent);
+		unsigned int lo = first>base ? first : base;
+		unsigned int hi = last<base+len ? last : base+len;
+		base += len;
+		//a compressed cluster is read whole into the file's cache, its few blocks need no advice
+		if(lo>=hi || a1fs_extent_compressed(extent)) continue;
+		unsigned int start = extent->start+(lo-(base-len));
+		unsigned int count = hi-lo;
+		//in windowed mode don't map a range just to advise it, and stay within one window
+		while(count>0){
+			unsigned int n = count;
+			if(fs->windows){
+				if(advice==MADV_DONTNEED) break;
+				unsigned int wb = fs->windows->window_blocks;
+				if(n>wb-start%wb) n = wb-start%wb;
+			}
+			advise_pages(getpointer(fs->image,start),(size_t)n*fs->block_size,advice);
+			start += n;
+			count -= n;
+		}
+	}
+}
+
+//readahead for a read of [offset, offset+size) of an open file.
+//the window starts at 4 times the request once reads are sequential and doubles on each
+//sequential read up to fs->ra_max, like the kernel's readahead. the next window is issued
+//when the reader gets within half a window of the end of the last one. once the window
+//is at its largest the file is streaming: its extents are advised MADV_SEQUENTIAL and the
+//pages more than a window behind the reader are dropped from the mapping.
+static void file_readahead(fs_ctx *fs, a1fs_file *file, struct a1fs_inode *inode,
+                           struct a1fs_extent *table, off_t offset, size_t size){
+	off_t end = offset+size;
+	if(offset==file->next){
+		if(file->ra_window==0) file->ra_window = size*4;
+		else file->ra_window *= 2;
+		if(file->ra_window>fs->ra_max) file->ra_window = fs->ra_max;
+	}
+	else{
+		//random access, start over
+		if(file->sequential) advise_range(fs,inode,table,0,inode->size,MADV_NORMAL);
+		file->ra_window = 0;
+		file->ra_end = 0;
+		file->drop_end = 0;
+		file->sequential = false;
+	}
+	file->next = end;
+	if(file->ra_window==0) return;
+
+	if(file->ra_end<end) file->ra_end = end;
+	if(file->ra_end-end<=(off_t)file->ra_window/2 && file->ra_end<(off_t)inode->size){
+		advise_range(fs,inode,table,file->ra_end,end+file->ra_window,MADV_WILLNEED);
+		file->ra_end = end+file->ra_window;
+	}
+
+	if(file->ra_window<fs->ra_max) return;
+	if(!file->sequential){
+		advise_range(fs,inode,table,0,inode->size,MADV_SEQUENTIAL);
+		file->sequential = true;
+	}
+	//keep one window behind the reader in case it steps back, and drop half a window at a time
+	off_t behind = (offset-(off_t)fs->ra_max)/fs->block_size*fs->block_size;
+	if(behind-file->drop_end>=(off_t)fs->ra_max/2){
+		advise_range(fs,inode,table,file->drop_end,behind,MADV_DONTNEED);
+		file->drop_end = behind;
+	}
+}
+
 //given extent table and the n-th block within, return the block number of the n-th block
 //if it is past the last extent return -1.
-int get_block(struct a1fs_extent *table,unsigned int n, int extent_num){
+int64_t get_block(struct a1fs_extent *table,uint64_t n, int extent_num){
 	for(int i=0;i<extent_num;i++){
 		struct a1fs_extent *curr_extent = table+i;
-		if(curr_extent->count>=n){
-			printf("block found,returning %d \n",curr_extent->start+n-1);
+		if(a1fs_extent_len(curr_extent)>=n){
 			return curr_extent->start+n-1;
 		}
-		else n -= curr_extent->count; 
+		else n -= a1fs_extent_len(curr_extent); 
+	}
+	return -1;
+}
+
+//the extent holding logical block n of a file (counted from 0), -1 past the last one.
+//off receives the place of the block in the extent
+static int find_extent(struct a1fs_extent *table, int extent_num, uint64_t n, uint64_t *off){
+	for(int i=0;i<extent_num;i++){
+		uint32_t len = a1fs_extent_len(table+i);
+		if(n<len){
+			*off = n;
+			return i;
+		}
+		n -= len;
 	}
 	return -1;
 }
@@ -1213,13 +2464,11 @@ int get_block(struct a1fs_extent *table,unsigned int n, int extent_num){
 static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
-	(void)fi;// unused
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
 	
-	//before everything, first see what buf,size,offset is for this particular read
-	printf("read start: buf = %s, size = %ld, offset = %ld\n", buf,size,offset);
+	//before everything, first see what size,offset is for this particular read
+	printf("read start: size = %ld, offset = %ld\n", size,offset);
 
-	//TODO: read data from the file at given offset into the buffer
 	//first get the inode	
 	struct a1fs_inode* root = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
 	char temp[A1FS_NAME_MAX];
@@ -1232,35 +2481,92 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
 		name = strtok(NULL,"/");
 	}
 	
+	if(offset>=(off_t)curr_inode->size) return 0;
 	struct a1fs_extent* table = (struct a1fs_extent*)getpointer(fs->image,curr_inode->a1fs_extent_table);
 	
-	int bytes = size;
-	int total_size = offset+size;
-	int blocks_needed = total_size/fs->block_size;
-	if(total_size%fs->block_size!=0) blocks_needed++;
-	if(offset%fs->block_size!=0) blocks_needed++;	
-	if(offset>(int)curr_inode->size) return 0;
-	printf("blocks_needed:%d,extent_num:%d\n",blocks_needed,curr_inode->extent_num);
-	int data_start = get_block(table,blocks_needed,curr_inode->extent_num);
-	print_etable(table);
-	if(data_start == -1) return 0;
+	//never read past the end of the file
+	size_t bytes = size;
+	if(offset+size>curr_inode->size) bytes = curr_inode->size-offset;
 	
-	//now we have the start of the data block,get the pointer pointing to data we need.
-	void* data = getpointer(fs->image,data_start) + (offset%fs->block_size);
-	//if size+offset is bigger than the remainder of the block
-	if((size+offset)%fs->block_size>curr_inode->size%fs->block_size){
-		void* toclear = getpointer(fs->image,data_start) + (curr_inode->size%fs->block_size);
-		//reset the remainder of the block
-		memset(toclear,0,fs->block_size-(curr_inode->size%fs->block_size));
-		//how many bits we have actually read
-		bytes = (curr_inode->size%fs->block_size)- (offset%fs->block_size);
-	}
+	a1fs_file *file = get_file(fi);
+	if(file && fs->ra_max>0) file_readahead(fs,file,curr_inode,table,offset,bytes);
 	
-	//copy the data
-	memcpy(buf,data,size);
+	//copy block by block. the image is only ever read here, anything that is not
+	//backed by a block (or is past EOF) is zeroed in the caller's buffer instead.
+	size_t done = 0;
+	while(done<bytes){
+		off_t pos = offset+done;
+		size_t in_block = pos&fs->block_mask;
+		size_t chunk = fs->block_size-in_block;
+		if(chunk>bytes-done) chunk = bytes-done;
+		uint64_t off;
+		int e = find_extent(table,curr_inode->extent_num,pos>>fs->block_shift,&off);
+		if(e == -1) memset(buf+done,0,chunk);
+		else if(a1fs_extent_compressed(table+e)){
+			//a compressed cluster is decompressed once for all the reads of its blocks
+			const char *data = cluster_block(fs,file,table+e,off);
+			if(!data) return done>0 ? (int)done : -EIO;
+			memcpy(buf+done,data+in_block,chunk);
+		}
+		else memcpy(buf+done,getpointer(fs->image,table[e].start+off)+in_block,chunk);
+		done += chunk;
+	}
+	memset(buf+bytes,0,size-bytes);
 	return bytes;
 }
 
+//the append fast path: write size bytes at the end of a file whose last extent can take them.
+//the data goes into the rest of the tail block and then into the blocks right after the
+//last extent, which grows in place. returns false without changing anything if the file
+//has no tail block yet or the blocks after it are not free, the caller then goes through
+//truncate and the general allocator.
+static bool append_in_place(fs_ctx *fs, struct a1fs_inode *inode, const char *buf, size_t size){
+	if(inode->extent_num==0 || inode->size==0) return false;
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image,inode->a1fs_extent_table);
+	struct a1fs_extent *last = table+inode->extent_num-1;
+	//a compressed tail cluster is full, the new data goes into an extent of its own
+	if(a1fs_extent_compressed(last)) return false;
+	unsigned int tail = last->start+last->count-1;
+	
+	//free bytes in the tail block, and the new blocks needed for the rest
+	size_t used = inode->size&fs->block_mask;
+	//a shared tail block has to be copied first, that is up to the write path
+	if(used && refs_shared(fs) && (!fs->refs_loaded || refs_count(fs,tail)>1)) return false;
+	size_t room = used ? fs->block_size-used : 0;
+	size_t rest = size>room ? size-room : 0;
+	unsigned int n = (rest+fs->block_mask)>>fs->block_shift;
+	
+	char *bbitmap = (char *)getpointer(fs->image,fs->bbitmap);
+	if(tail+n>=(unsigned int)fs->block_num) return false;
+	for(unsigned int i=1;i<=n;i++){
+		if(readmap(bbitmap,tail+i)) return false;
+	}
+	for(unsigned int i=1;i<=n;i++){
+		writemap(&bbitmap,tail+i);
+	}
+	last->count += n;
+	
+	//copy a block at a time, zeroing the end of the new tail block
+	size_t done = size<room ? size : room;
+	if(done>0) memcpy(getpointer(fs->image,tail)+used,buf,done);
+	for(unsigned int i=1;i<=n;i++){
+		size_t chunk = size-done<(size_t)fs->block_size ? size-done : (size_t)fs->block_size;
+		void *block = getpointer(fs->image,tail+i);
+		memcpy(block,buf+done,chunk);
+		if(chunk<(size_t)fs->block_size) memset(block+chunk,0,fs->block_size-chunk);
+		done += chunk;
+	}
+	
+	//only the blocks taken here changed
+	fs->free_bnum -= n;
+	update_sb();
+	inode->size += size;
+	clock_gettime(CLOCK_REALTIME, &inode->mtime);
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image,fs->inode_table);
+	update(itable+inode->parent,size);
+	return true;
+}
+
 /**
  * Write data to a file.
  *
@@ -1281,90 +2587,1017 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      open file; fi->fh caches the inode number.
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
-	(void)fi;// unused
-	fs_ctx *fs = get_fs();
+	fs_ctx *fs = begin_op();
 
-	//before everything, first see what buf,size,offset is for this particular write
-	printf("write start: buf = %s, size = %ld, offset = %ld\n", buf,size,offset);
+	if (fs->read_only) return -EROFS;
 
 	//TODO: write data from the buffer into the file at given offset, possibly
 	// "zeroing out" the uninitialized range
-	//first get the inode	
+	//first get the inode, an open file already knows it
 	struct a1fs_inode* root = (struct a1fs_inode*) getpointer(fs->image,fs->inode_table);
-	char temp[A1FS_NAME_MAX];
-	strcpy(temp,path);
-	char *name = strtok(temp,"/");	
-
-	struct a1fs_inode* curr_inode = root;
-	while(name!=NULL){
-		curr_inode = getattr_helper(curr_inode,name,fs);
-		name = strtok(NULL,"/");
-	}
+	char *ibitmap = (char *)getpointer(fs->image,fs->ibitmap);
+	a1fs_file *file = get_file(fi);
+	struct a1fs_inode* curr_inode;
+	if(file && file->ino>0 && readmap(ibitmap,file->ino)) curr_inode = root+file->ino;
+	else curr_inode = find_inode(fs,path);
+	if(file) file->written = true;
 	
-	//note that it is 1 even if we can fit in 0 and dont need to allocate a new block.
-	int total_size = offset+size;
+	//appends that fit in the tail block or in the blocks right after it skip truncate
+	if((uint64_t)offset==curr_inode->size && append_in_place(fs,curr_inode,buf,size)) return size;
 	
-	int blocks_needed = total_size/fs->block_size;
-	if(total_size%fs->block_size!=0) blocks_needed++;
-	int blocks_actual = curr_inode->size/fs->block_size;
-	if(curr_inode->size%fs->block_size!=0) blocks_actual++;
+	off_t total_size = offset+size;
 	
 	//extend the file, fill in in-between values with 0.
 	//truncate the thing so that its size is exactly what we need
-	int status = a1fs_truncate(path,offset+size);
-	//this covers both ENOMEM and ENOSPC if truncate is written properly.
-	if(status<0) return -status;
+	//only when writing past the end: an overwrite must not shrink the file
+	if((uint64_t)total_size > curr_inode->size){
+		int status = a1fs_truncate(path,offset+size);
+		//this covers both ENOMEM and ENOSPC if truncate is written properly.
+		if(status<0) return status;
+	}
 	
 	struct a1fs_extent* table = (struct a1fs_extent*)getpointer(fs->image,curr_inode->a1fs_extent_table);
 	//now that the file is exactly the size we need, start writing to it.
-	//get the last block
-	//the block will not pass the extent,else there is fatal error
-	printf("blocks_needed:%d,extent_num:%d\n",blocks_needed,curr_inode->extent_num);
-	int data_start = get_block(table,blocks_needed,curr_inode->extent_num);
-	print_etable(table);
-	if(data_start==-1) printf("a1fs_write:(fatal error) truncate/write failed\n\n");
-	void *last_block = getpointer(fs->image,data_start);
-	
-	//now add offset%blocksize to it, so that we can start writing
-	void *write_start = last_block+(offset%fs->block_size);
-	//write!
-	memcpy(write_start,buf,size);	
+	//the blocks will not pass the extent,else there is fatal error
+	//write block by block, an append that fell back here can span the old tail and a new extent
+	size_t done = 0;
+	while(done<size){
+		off_t pos = offset+done;
+		size_t in_block = pos&fs->block_mask;
+		size_t chunk = fs->block_size-in_block;
+		if(chunk>size-done) chunk = size-done;
+		//a compressed cluster goes back to plain blocks before one of them is written
+		if(compressed_fs(fs)){
+			int ret = uncompress_block(fs,curr_inode,pos>>fs->block_shift);
+			if(ret<0) return done>0 ? (int)done : ret;
+		}
+		//a block shared with a clone is copied before it is written
+		if(refs_shared(fs)){
+			int ret = unshare_block(fs,curr_inode,pos>>fs->block_shift);
+			if(ret<0) return done>0 ? (int)done : ret;
+		}
+		int64_t data_start = get_block(table,(pos>>fs->block_shift)+1,curr_inode->extent_num);
+		if(data_start==-1){
+			fprintf(stderr, "a1fs_write:(fatal error) truncate/write failed\n");
+			return -EIO;
+		}
+		memcpy(getpointer(fs->image,data_start)+in_block,buf+done,chunk);
+		done += chunk;
+	}
 	return size;
 }
 
 
-static struct fuse_operations a1fs_ops = {
+//find a run of n free data blocks, from goal to the end of the image and then from the first data
+//block. returns the first block of the run, or -1 if there is none
+static int64_t find_free_run(fs_ctx *fs, uint64_t n, uint64_t goal){
+	unsigned char *bbitmap = (unsigned char *)getpointer(fs->image, fs->bbitmap);
+	if (goal < fs->first_data_block || goal >= fs->block_num) goal = fs->first_data_block;
+	for (int pass = 0; pass < 2; pass++) {
+		uint64_t i = pass ? fs->first_data_block : goal;
+		//the second pass also finds a run that crosses the goal
+		uint64_t end = pass ? goal + n - 1 : fs->block_num;
+		if (end > fs->block_num) end = fs->block_num;
+		uint64_t run = 0;
+		while (i < end) {
+			//whole bytes of used blocks at a time
+			if ((i & 7) == 0 && i + 8 <= end && bbitmap[i >> 3] == 0xff) {
+				run = 0;
+				i += 8;
+				continue;
+			}
+			if (readmap((char *)bbitmap, i)) run = 0;
+			else if (++run == n) return i + 1 - n;
+			i++;
+		}
+	}
+	return -1;
+}
+
+//blocks of file data in a cluster of a compressed file
+static uint64_t cluster_blocks(fs_ctx *fs){
+	return A1FS_CLUSTER_SIZE >> fs->block_shift;
+}
+
+//decompress the cluster in extent e into out, which has room for a cluster
+static int cluster_load(fs_ctx *fs, struct a1fs_extent *e, char *out){
+	uint64_t used = a1fs_extent_used(e), len = a1fs_extent_len(e);
+	if (used == 0 || len > cluster_blocks(fs) || e->start + used > fs->block_num) {
+		fprintf(stderr, "cluster_load: bad compressed extent at block %u\n", e->start);
+		return -EIO;
+	}
+	//the compressed blocks are contiguous in the image, unless it is mapped in windows
+	char *src = getpointer(fs->image, e->start);
+	char *gathered = NULL;
+	if (fs->windows && used > 1) {
+		gathered = malloc(used << fs->block_shift);
+		if (!gathered) return -ENOMEM;
+		for (uint64_t b = 0; b < used; b++) {
+			memcpy(gathered + (b << fs->block_shift), getpointer(fs->image, e->start + b), fs->block_size);
+		}
+		src = gathered;
+	}
+	uint32_t bytes;
+	memcpy(&bytes, src, sizeof(bytes));
+	long n = -1;
+	if (bytes <= (used << fs->block_shift) - sizeof(bytes)) {
+		n = lz_decompress(src + sizeof(bytes), bytes, out, len << fs->block_shift);
+	}
+	free(gathered);
+	if (n != (long)(len << fs->block_shift)) {
+		fprintf(stderr, "cluster_load: corrupt cluster at block %u\n", e->start);
+		return -EIO;
+	}
+	return 0;
+}
+
+//block off of the compressed cluster in extent e. the cluster is decompressed into the cache of
+//the open file (of the file system without one) unless it is there already. NULL on error
+static const char *cluster_block(fs_ctx *fs, a1fs_file *file, struct a1fs_extent *e, uint64_t off){
+	a1fs_zcache *z = file ? &file->zcache : &fs->zcache;
+	if (!z->data || z->start != e->start || z->gen != fs->zgen) {
+		if (!z->data && !(z->data = malloc(cluster_blocks(fs) << fs->block_shift))) return NULL;
+		z->start = 0;
+		if (cluster_load(fs, e, z->data) < 0) return NULL;
+		z->start = e->start;
+		z->gen = fs->zgen;
+	}
+	return z->data + (off << fs->block_shift);
+}
+
+/**
+ * Store the compressed cluster in extent i of a file as plain blocks again.
+ *
+ * Called before a block of the cluster is written or the file is cut inside
+ * it. The extent stays one extent, so the data goes into a run of free blocks
+ * near the compressed ones, which are then freed (a clone sharing them keeps
+ * them).
+ *
+ * @return  0 on success; -ENOSPC if there is no run of free blocks long
+ *          enough; -ENOMEM; -EIO if the cluster is corrupt.
+ */
+static int uncompress_extent(fs_ctx *fs, struct a1fs_inode *inode, int i){
+	struct a1fs_extent *e = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table) + i;
+	uint64_t len = a1fs_extent_len(e), used = a1fs_extent_used(e);
+	char *data = malloc(len << fs->block_shift);
+	if (!data) return -ENOMEM;
+	int ret = cluster_load(fs, e, data);
+	int64_t run = -1;
+	if (ret == 0 && (run = find_free_run(fs, len, e->start)) < 0) ret = -ENOSPC;
+	if (ret < 0) {
+		free(data);
+		return ret;
+	}
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	for (uint64_t b = 0; b < len; b++) {
+		writemap(&bbitmap, run + b);
+		memcpy(getpointer(fs->image, run + b), data + (b << fs->block_shift), fs->block_size);
+	}
+	free(data);
+	uint64_t old = e->start;
+	e->start = run;
+	e->count = len;
+	free_blocks(fs, old, used);
+	update_sb();
+	return 0;
+}
+
+//uncompress the cluster holding logical block n of a file, if it is compressed
+static int uncompress_block(fs_ctx *fs, struct a1fs_inode *inode, uint64_t n){
+	if (inode->extent_num == 0) return 0;
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	uint64_t off;
+	int i = find_extent(table, inode->extent_num, n, &off);
+	if (i < 0 || !a1fs_extent_compressed(table + i)) return 0;
+	return uncompress_extent(fs, inode, i);
+}
+
+/**
+ * Compress the data of a file, a cluster at a time.
+ *
+ * Called when a file with A1FS_INODE_COMPRESS is closed after a write. Every
+ * whole cluster that isn't compressed yet is compressed into a run of free
+ * blocks near it. If that saves at least a block, the extents holding the
+ * cluster are cut around it and replaced by one compressed extent, and only
+ * then are their blocks freed. A cluster that doesn't compress stays plain.
+ * The part of the last cluster that isn't whole stays plain too, so appends
+ * to a log don't uncompress anything.
+ *
+ * Every cluster takes an extent of its own, so this stops when the extent
+ * table is nearly full: only the first 512 clusters of a large file can be
+ * compressed with 4 KiB blocks.
+ */
+static void compress_inode(fs_ctx *fs, struct a1fs_inode *inode){
+	uint64_t cb = cluster_blocks(fs);
+	uint64_t clusters = (inode->size >> fs->block_shift) / cb;
+	int max_extents = fs->block_size / fs->extent_size;
+	if (clusters == 0 || inode->extent_num == 0) return;
+	size_t cluster_bytes = cb << fs->block_shift;
+	char *plain = malloc(cluster_bytes), *packed = malloc(cluster_bytes);
+	struct a1fs_extent *old = malloc(cb * sizeof(*old));
+	if (!plain || !packed || !old) {
+		free(plain);
+		free(packed);
+		free(old);
+		return;
+	}
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	uint64_t done = 0, saved = 0;
+
+	for (uint64_t c = 0; c < clusters; c++) {
+		uint64_t off;
+		int i = find_extent(table, inode->extent_num, c * cb, &off);
+		if (i < 0) break;
+		if (a1fs_extent_compressed(table + i)) continue;
+		//cutting the extents at both ends of the cluster takes up to two more entries
+		if (inode->extent_num + 2 > max_extents) break;
+
+		//gather the cluster, it can span extents. j ends as the extent holding its last
+		//block, with jend blocks of that extent in the cluster
+		int j = i;
+		uint64_t jend = off;
+		bool plain_only = true;
+		for (uint64_t b = 0; b < cb && plain_only; b++) {
+			if (jend == a1fs_extent_len(table + j)) {
+				j++;
+				jend = 0;
+			}
+			if (j >= inode->extent_num || a1fs_extent_compressed(table + j)) plain_only = false;
+			else memcpy(plain + (b << fs->block_shift), getpointer(fs->image, table[j].start + jend++), fs->block_size);
+		}
+		if (!plain_only) continue;
+
+		//at least one block has to be saved
+		uint32_t bytes = lz_compress(plain, cluster_bytes, packed + sizeof(bytes), cluster_bytes - fs->block_size - sizeof(bytes));
+		if (bytes == 0) continue;
+		memcpy(packed, &bytes, sizeof(bytes));
+		uint64_t used = (sizeof(bytes) + bytes + fs->block_mask) >> fs->block_shift;
+		memset(packed + sizeof(bytes) + bytes, 0, (used << fs->block_shift) - sizeof(bytes) - bytes);
+		int64_t run = find_free_run(fs, used, table[i].start + off);
+		if (run < 0) break;
+		sb->features |= A1FS_FEATURE_COMPRESS;
+		for (uint64_t b = 0; b < used; b++) {
+			writemap(&bbitmap, run + b);
+			memcpy(getpointer(fs->image, run + b), packed + (b << fs->block_shift), fs->block_size);
+		}
+
+		//extents i to j become the part of i before the cluster, the cluster and the part of j after it
+		int n_old = j - i + 1;
+		memcpy(old, table + i, n_old * sizeof(*old));
+		struct a1fs_extent pieces[3];
+		int m = 0;
+		if (off > 0) pieces[m++] = (struct a1fs_extent){old[0].start, off};
+		pieces[m++] = (struct a1fs_extent){run, A1FS_EXTENT_COMPRESSED | used << A1FS_EXTENT_USED_SHIFT | cb};
+		if (jend < old[n_old - 1].count) pieces[m++] = (struct a1fs_extent){old[n_old - 1].start + jend, old[n_old - 1].count - jend};
+		memmove(table + i + m, table + j + 1, (size_t)(inode->extent_num - j - 1) * sizeof(*table));
+		memcpy(table + i, pieces, m * sizeof(*table));
+		if (m < n_old) memset(table + inode->extent_num + m - n_old, 0, (size_t)(n_old - m) * sizeof(*table));
+		inode->extent_num += m - n_old;
+
+		for (int k = 0; k < n_old; k++) {
+			uint64_t from = k == 0 ? off : 0;
+			uint64_t to = k == n_old - 1 ? jend : old[k].count;
+			free_blocks(fs, old[k].start + from, to - from);
+		}
+		done++;
+		saved += cb - used;
+	}
+	free(plain);
+	free(packed);
+	free(old);
+	if (done == 0) return;
+	//the freed blocks may be reused for other clusters, a cached copy of them is stale
+	fs->zgen++;
+	fs->compressed_clusters += done;
+	fs->compressed_saved += saved;
+	update_sb();
+}
+
+int a1fs_set_compress(const char *path, bool on)
+{
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
+	struct stat st;
+	int ret = a1fs_getattr(path, &st);
+	if (ret < 0) return ret;
+	struct a1fs_inode *inode = find_inode(fs, path);
+	if (on) inode->flags |= A1FS_INODE_COMPRESS;
+	else inode->flags &= ~A1FS_INODE_COMPRESS;
+	return 0;
+}
+
+//add a defragmented file to the totals reported at unmount
+static void defrag_account(fs_ctx *fs, const struct a1fs_defrag *res){
+	if (res->extents_after == res->extents_before) return;
+	fs->defrag_files++;
+	fs->defrag_before += res->extents_before;
+	fs->defrag_after += res->extents_after;
+}
+
+/**
+ * Defragment a file or directory.
+ *
+ * Extents that follow each other on disk are merged in place. If more than one
+ * is left, the blocks are copied in order into one run of free blocks and a new
+ * extent table describing that run is written to a block of its own. The inode
+ * is switched over to the new table in one step, and only then are the old
+ * blocks and the old table freed, so the inode always points at a complete
+ * copy of the data.
+ *
+ * @param fs     the file system.
+ * @param inode  inode to defragment.
+ * @param res    receives the extent counts before and after.
+ * @return       0 on success, also when there was nothing to do;
+ *               -ENOSPC if there is no run of free blocks long enough.
+ */
+static int defrag_inode(fs_ctx *fs, struct a1fs_inode *inode, struct a1fs_defrag *res){
+	res->extents_before = inode->extent_num;
+	res->extents_after = inode->extent_num;
+	res->blocks_moved = 0;
+	if (inode->extent_num <= 1) return 0;
+
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	//every compressed cluster is an extent of its own, there is nothing to merge
+	for (int i = 0; i < inode->extent_num; i++) {
+		if (a1fs_extent_compressed(table + i)) return 0;
+	}
+	int n = 0;
+	uint64_t total = 0;
+	for (int i = 0; i < inode->extent_num; i++) {
+		total += table[i].count;
+		if (n > 0 && table[n - 1].start + table[n - 1].count == table[i].start) table[n - 1].count += table[i].count;
+		else table[n++] = table[i];
+	}
+	memset(table + n, 0, (size_t)(inode->extent_num - n) * fs->extent_size);
+	inode->extent_num = n;
+	res->extents_after = n;
+	if (n == 1) {
+		defrag_account(fs, res);
+		return 0;
+	}
+	//moving shared blocks would give the file copies of its own, the space a clone saves is kept
+	if (refs_shared(fs)) {
+		for (int i = 0; i < n; i++) {
+			if (!fs->refs_loaded || refs_overlap(fs, table[i].start, table[i].count)) {
+				defrag_account(fs, res);
+				return 0;
+			}
+		}
+	}
+
+	//the destination run and a block for the new table
+	int64_t dest = find_free_run(fs, total, table[0].start);
+	if (dest < 0) {
+		defrag_account(fs, res);
+		return -ENOSPC;
+	}
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	for (uint64_t b = dest; b < dest + total; b++) writemap(&bbitmap, b);
+	int64_t new_table = get_free_block_bit(fs, -1);
+	if (new_table < 0) {
+		for (uint64_t b = dest; b < dest + total; b++) erasemap(&bbitmap, b);
+		defrag_account(fs, res);
+		return -ENOSPC;
+	}
+	writemap(&bbitmap, new_table);
+
+	//copy a block at a time, a windowed image maps the two sides separately
+	uint64_t to = dest;
+	for (int i = 0; i < n; i++) {
+		for (uint32_t b = 0; b < table[i].count; b++) {
+			memcpy(getpointer(fs->image, to++), getpointer(fs->image, table[i].start + b), fs->block_size);
+		}
+	}
+	struct a1fs_extent *moved = (struct a1fs_extent *)getpointer(fs->image, new_table);
+	memset(moved, 0, fs->block_size);
+	moved->start = dest;
+	moved->count = total;
+
+	uint32_t old_table = inode->a1fs_extent_table;
+	inode->a1fs_extent_table = new_table;
+	inode->extent_num = 1;
+	for (int i = 0; i < n; i++) free_blocks(fs, table[i].start, table[i].count);
+	free_blocks(fs, old_table, 1);
+	update_sb();
+
+	res->extents_after = 1;
+	res->blocks_moved = total;
+	defrag_account(fs, res);
+	return 0;
+}
+
+/** Files with fewer extents are left alone by the defrag pass. */
+#define DEFRAG_MIN_EXTENTS 4
+/** Files larger than this (in blocks) are left to the ioctl, so one step stays short. */
+#define DEFRAG_MAX_BLOCKS 1024
+/** Inodes looked at per step. */
+#define DEFRAG_SCAN 1024
+
+/**
+ * One step of the defrag pass (-o defrag=SEC).
+ *
+ * The operations are not thread safe (the daemon runs them one at a time), so
+ * instead of a thread of its own the pass takes a step every SEC seconds at
+ * the start of an operation. A step looks at up to DEFRAG_SCAN inodes from
+ * where the last one stopped and defragments the first fragmented file or
+ * directory of at most DEFRAG_MAX_BLOCKS blocks, so it costs at most a few
+ * MiB of copying.
+ */
+static void defrag_due(fs_ctx *fs){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	if ((unsigned long)(now.tv_sec - fs->defrag_last) < fs->defrag_secs || fs->read_only) return;
+	fs->defrag_last = now.tv_sec;
+
+	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	for (int k = 0; k < DEFRAG_SCAN && k < fs->inode_num; k++) {
+		int i = fs->defrag_next;
+		fs->defrag_next = (i + 1) % fs->inode_num;
+		if (!readmap(ibitmap, i) || itable[i].extent_num < DEFRAG_MIN_EXTENTS || itable[i].links == 0) continue;
+		if (itable[i].size > ((uint64_t)DEFRAG_MAX_BLOCKS << fs->block_shift)) continue;
+		struct a1fs_defrag res;
+		defrag_inode(fs, itable + i, &res);
+		return;
+	}
+}
+
+/**
+ * Write the reference count table to the image.
+ *
+ * The table lives in a run of blocks of its own. When it outgrows the run it is
+ * written to a new run of twice the size, and the superblock is switched over
+ * before the old run is freed. An empty table gives its run back and clears
+ * A1FS_FEATURE_REFLINK.
+ *
+ * @return  0 on success; -ENOSPC if there is no run of free blocks for the
+ *          larger table, the image keeps the old table then.
+ */
+static int refs_sync(fs_ctx *fs){
+	struct a1fs_superblock *sb = (struct a1fs_superblock *)fs->image;
+	uint64_t per_block = fs->block_size / sizeof(a1fs_ref);
+	uint64_t need = (fs->refs_n + per_block - 1) / per_block;
+	uint64_t table = sb->s_refcount_table, blocks = sb->s_refcount_blocks;
+	if (need == 0) {
+		table = 0;
+		blocks = 0;
+	}
+	else if (need > blocks) {
+		blocks = need * 2;
+		int64_t run = find_free_run(fs, blocks, sb->s_refcount_table + sb->s_refcount_blocks);
+		if (run < 0) {
+			blocks = need;
+			run = find_free_run(fs, blocks, fs->first_data_block);
+		}
+		if (run < 0) {
+			fprintf(stderr, "refs_sync: no room for %lu reference counts\n", (unsigned long)fs->refs_n);
+			return -ENOSPC;
+		}
+		char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+		for (uint64_t b = run; b < run + blocks; b++) writemap(&bbitmap, b);
+		table = run;
+	}
+	for (uint64_t i = 0; i < need; i++) {
+		char *block = getpointer(fs->image, table + i);
+		uint64_t first = i * per_block;
+		uint64_t n = fs->refs_n - first < per_block ? fs->refs_n - first : per_block;
+		memcpy(block, fs->refs + first, n * sizeof(a1fs_ref));
+		memset(block + n * sizeof(a1fs_ref), 0, (per_block - n) * sizeof(a1fs_ref));
+	}
+
+	uint64_t old = sb->s_refcount_table, old_blocks = sb->s_refcount_blocks;
+	sb->s_refcount_table = table;
+	sb->s_refcount_blocks = blocks;
+	sb->refcount_num = fs->refs_n;
+	if (fs->refs_n) sb->features |= A1FS_FEATURE_REFLINK;
+	else sb->features &= ~A1FS_FEATURE_REFLINK;
+	if (old_blocks && (table != old || blocks == 0)) release_blocks(fs, old, old_blocks);
+	update_sb();
+	return 0;
+}
+
+/**
+ * Give logical block n of a file a copy of its own if the block is shared.
+ *
+ * Called before a block is written. The copy goes into a free block near the
+ * old one and the extent holding the block is split around it. A copy that
+ * lands right after the previous extent or right before the next one joins
+ * that extent instead, so a file overwritten from start to end keeps few
+ * extents.
+ *
+ * @return  0 on success, also if the block wasn't shared; -ENOSPC if there
+ *          is no free block or no room in the extent table.
+ */
+static int unshare_block(fs_ctx *fs, struct a1fs_inode *inode, uint64_t n){
+	struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+	int k = 0;
+	uint64_t base = 0;
+	while (k < inode->extent_num && base + a1fs_extent_len(table + k) <= n) base += a1fs_extent_len(table + k++);
+	if (k == inode->extent_num) return 0;
+	//uncompressing a cluster gives the file blocks of its own
+	if (a1fs_extent_compressed(table + k)) return uncompress_extent(fs, inode, k);
+	if (!fs->refs_loaded) return -ENOMEM;
+	uint64_t off = n - base, old = table[k].start + off;
+	if (refs_count(fs, old) < 2) return 0;
+
+	uint64_t goal = old;
+	if (off == 0 && k > 0) goal = table[k - 1].start + a1fs_extent_used(table + k - 1);
+	int64_t blk = find_free_run(fs, 1, goal);
+	if (blk < 0) return -ENOSPC;
+
+	//the extent becomes up to three pieces, the copy in the middle
+	struct a1fs_extent pieces[3];
+	int m = 0;
+	if (off > 0) pieces[m++] = (struct a1fs_extent){table[k].start, off};
+	pieces[m++] = (struct a1fs_extent){blk, 1};
+	if (off + 1 < table[k].count) pieces[m++] = (struct a1fs_extent){old + 1, table[k].count - off - 1};
+	int first = 0, last = m;
+	bool join_prev = off == 0 && k > 0 && !a1fs_extent_compressed(table + k - 1) &&
+	                 (uint64_t)table[k - 1].start + table[k - 1].count == (uint64_t)blk;
+	bool join_next = !join_prev && off + 1 == table[k].count && k + 1 < inode->extent_num &&
+	                 !a1fs_extent_compressed(table + k + 1) && table[k + 1].start == (uint64_t)blk + 1;
+	if (join_prev) first = 1;
+	if (join_next) last = m - 1;
+	int add = last - first;
+	if (inode->extent_num - 1 + add > (int)(fs->block_size / fs->extent_size)) return -ENOSPC;
+
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	writemap(&bbitmap, blk);
+	memcpy(getpointer(fs->image, blk), getpointer(fs->image, old), fs->block_size);
+	if (join_prev) table[k - 1].count++;
+	if (join_next) {
+		table[k + 1].start = blk;
+		table[k + 1].count++;
+	}
+	memmove(table + k + add, table + k + 1, (size_t)(inode->extent_num - k - 1) * sizeof(*table));
+	memcpy(table + k, pieces + first, (size_t)add * sizeof(*table));
+	if (add == 0) memset(table + inode->extent_num - 1, 0, sizeof(*table));
+	inode->extent_num += add - 1;
+
+	//a failed update only leaves the old block with a reference too many, it is leaked, not lost
+	if (refs_adjust(fs, old, 1, -1) == 0) refs_sync(fs);
+	update_sb();
+	return 0;
+}
+
+/**
+ * Make dst a clone of src (A1FS_IOC_CLONE).
+ *
+ * Every block of src gets one more reference and dst gets a copy of the
+ * extent table, so no data is copied. The old blocks of dst are freed.
+ *
+ * Errors:
+ *   EINVAL  src or dst is not a regular file.
+ *   ENOMEM  not enough memory for the reference counts.
+ *   ENOSPC  no free block for dst's extent table or the reference counts.
+ *
+ * @return  0 on success; -errno on error, dst is unchanged then.
+ */
+static int clone_inode(fs_ctx *fs, struct a1fs_inode *src, struct a1fs_inode *dst){
+	if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) return -EINVAL;
+	if (src == dst) return 0;
+	if (!refs_load(fs)) return -ENOMEM;
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+
+	//an empty file has no extent table
+	bool new_table = false;
+	if (src->extent_num > 0 && dst->a1fs_extent_table == 0) {
+		int64_t table_block = get_free_block_bit(fs, -1);
+		if (table_block < 0) return -ENOSPC;
+		writemap(&bbitmap, table_block);
+		dst->a1fs_extent_table = table_block;
+		new_table = true;
+	}
+
+	//take the references first, so that a failure leaves dst as it was
+	a1fs_ref *saved = NULL;
+	if (fs->refs_n) {
+		saved = malloc(fs->refs_n * sizeof(*saved));
+		if (!saved) {
+			if (new_table) {
+				erasemap(&bbitmap, dst->a1fs_extent_table);
+				dst->a1fs_extent_table = 0;
+			}
+			return -ENOMEM;
+		}
+		memcpy(saved, fs->refs, fs->refs_n * sizeof(*saved));
+	}
+	size_t saved_n = fs->refs_n;
+	struct a1fs_extent *src_table = (struct a1fs_extent *)getpointer(fs->image, src->a1fs_extent_table);
+	int ret = 0;
+	for (int i = 0; i < src->extent_num && ret == 0; i++) {
+		ret = refs_adjust(fs, src_table[i].start, a1fs_extent_used(src_table + i), 1);
+	}
+	if (ret == 0) ret = refs_sync(fs);
+	if (ret < 0) {
+		free(fs->refs);
+		fs->refs = saved;
+		fs->refs_n = saved_n;
+		if (new_table) {
+			erasemap(&bbitmap, dst->a1fs_extent_table);
+			dst->a1fs_extent_table = 0;
+		}
+		return ret;
+	}
+	free(saved);
+
+	//drop the old contents, then share the source's
+	struct a1fs_extent *dst_table = (struct a1fs_extent *)getpointer(fs->image, dst->a1fs_extent_table);
+	for (int i = 0; i < dst->extent_num; i++) clear_extent(dst_table, i);
+	if (src->extent_num == 0 && dst->a1fs_extent_table != 0) {
+		free_blocks(fs, dst->a1fs_extent_table, 1);
+		dst->a1fs_extent_table = 0;
+	}
+	else if (src->extent_num > 0) {
+		memcpy(dst_table, src_table, fs->block_size);
+	}
+	dst->extent_num = src->extent_num;
+	update(itable + dst->parent, (int64_t)src->size - (int64_t)dst->size);
+	dst->size = src->size;
+	clock_gettime(CLOCK_REALTIME, &dst->mtime);
+	update_sb();
+	return 0;
+}
+
+//the inode of an open file, from the inode number it cached or from its path
+static struct a1fs_inode *file_inode(fs_ctx *fs, const char *path, struct fuse_file_info *fi){
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	char *ibitmap = (char *)getpointer(fs->image, fs->ibitmap);
+	a1fs_file *file = get_file(fi);
+	if (file && file->ino > 0 && readmap(ibitmap, file->ino)) return itable + file->ino;
+	return find_inode(fs, path);
+}
+
+//the block holding logical block n of a file, -1 past its last extent. left receives the
+//blocks from there to the end of the extent
+static int64_t extent_run(struct a1fs_extent *table, int extent_num, uint64_t n, uint64_t *left){
+	uint64_t off;
+	int i = find_extent(table, extent_num, n, &off);
+	if (i < 0) return -1;
+	*left = a1fs_extent_len(table + i) - off;
+	return table[i].start + off;
+}
+
+//grow a file to end bytes for a copy that writes everything from the current size on. the new
+//blocks are taken as one run after the last extent when there is one, and only the part of the
+//last block past end is zeroed; otherwise truncate allocates (and zeroes) them as usual
+static int copy_grow(fs_ctx *fs, const char *path, struct a1fs_inode *inode, uint64_t end){
+	uint64_t have = (inode->size + fs->block_mask) >> fs->block_shift;
+	uint64_t need = (end + fs->block_mask) >> fs->block_shift;
+	uint64_t n = need - have;
+	if (n > UINT32_MAX) return a1fs_truncate(path, end);
+	char *bbitmap = (char *)getpointer(fs->image, fs->bbitmap);
+	if (n > 0) {
+		//an empty file has no extent table yet
+		if (inode->extent_num == 0) return a1fs_truncate(path, end);
+		struct a1fs_extent *table = (struct a1fs_extent *)getpointer(fs->image, inode->a1fs_extent_table);
+		struct a1fs_extent *last = table + inode->extent_num - 1;
+		int64_t run = find_free_run(fs, n, last->start + a1fs_extent_used(last));
+		if (run < 0) return a1fs_truncate(path, end);
+		bool joins = !a1fs_extent_compressed(last) && (uint64_t)last->start + last->count == (uint64_t)run &&
+		             (uint64_t)last->count + n < A1FS_EXTENT_COMPRESSED;
+		if (!joins && inode->extent_num >= (int)(fs->block_size / fs->extent_size)) return a1fs_truncate(path, end);
+		for (uint64_t b = run; b < run + n; b++) writemap(&bbitmap, b);
+		if (joins) last->count += n;
+		else {
+			table[inode->extent_num].start = run;
+			table[inode->extent_num].count = n;
+			inode->extent_num++;
+		}
+		if (end & fs->block_mask) {
+			memset(getpointer(fs->image, run + n - 1) + (end & fs->block_mask), 0, fs->block_size - (end & fs->block_mask));
+		}
+		update_sb();
+	}
+	struct a1fs_inode *itable = (struct a1fs_inode *)getpointer(fs->image, fs->inode_table);
+	update(itable + inode->parent, end - inode->size);
+	inode->size = end;
+	return 0;
+}
+
+/**
+ * Copy a range of one file into another inside the image.
+ *
+ * The copy_file_range operation of the FUSE 3 API, which FUSE 2 doesn't have;
+ * A1FS_IOC_COPY_RANGE calls it. Both inodes are resolved once, the
+ * destination is grown in one allocation, and the data is copied from extent
+ * to extent with one memcpy() for every stretch that is contiguous on both
+ * sides (a block at a time on a windowed image). Blocks of the destination
+ * that are shared with a clone are copied first.
+ *
+ * Errors:
+ *   EROFS   the file system is mounted read-only.
+ *   EINVAL  flags is not 0, a file is not a regular file, or the two ranges
+ *           overlap in the same file.
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path_in   path to the source file.
+ * @param fi_in     open source file, may be NULL.
+ * @param off_in    where to copy from.
+ * @param path_out  path to the destination file.
+ * @param fi_out    open destination file, may be NULL.
+ * @param off_out   where to copy to.
+ * @param len       bytes to copy.
+ * @param flags     must be 0.
+ * @return          bytes copied, fewer than len at the end of the source;
+ *                  -errno on error.
+ */
+static ssize_t a1fs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t off_in,
+                                    const char *path_out, struct fuse_file_info *fi_out, off_t off_out,
+                                    size_t len, int flags)
+{
+	fs_ctx *fs = begin_op();
+	if (fs->read_only) return -EROFS;
+	if (flags != 0 || off_in < 0 || off_out < 0) return -EINVAL;
+	struct a1fs_inode *src = file_inode(fs, path_in, fi_in);
+	struct a1fs_inode *dst = file_inode(fs, path_out, fi_out);
+	if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) return -EINVAL;
+	if ((uint64_t)off_in >= src->size) return 0;
+	if (len > src->size - off_in) len = src->size - off_in;
+	if (len > SSIZE_MAX) len = SSIZE_MAX;
+	if (src == dst && (uint64_t)off_in < off_out + len && (uint64_t)off_out < off_in + len) return -EINVAL;
+
+	//a gap between the end of the destination and off_out is zeroed by truncate, the copy writes the rest
+	int ret;
+	if ((uint64_t)off_out > dst->size && (ret = a1fs_truncate(path_out, off_out)) < 0) return ret;
+	if (off_out + len > dst->size && (ret = copy_grow(fs, path_out, dst, off_out + len)) < 0) return ret;
+	if (compressed_fs(fs)) {
+		for (uint64_t b = off_out >> fs->block_shift; b <= (off_out + len - 1) >> fs->block_shift; b++) {
+			if ((ret = uncompress_block(fs, dst, b)) < 0) return ret;
+		}
+	}
+	if (refs_shared(fs)) {
+		for (uint64_t b = off_out >> fs->block_shift; b <= (off_out + len - 1) >> fs->block_shift; b++) {
+			if ((ret = unshare_block(fs, dst, b)) < 0) return ret;
+		}
+	}
+
+	struct a1fs_extent *src_table = (struct a1fs_extent *)getpointer(fs->image, src->a1fs_extent_table);
+	struct a1fs_extent *dst_table = (struct a1fs_extent *)getpointer(fs->image, dst->a1fs_extent_table);
+	size_t done = 0;
+	while (done < len) {
+		uint64_t pin = off_in + done, pout = off_out + done;
+		uint64_t left_in, left_out;
+		//a compressed source is copied from its decompressed clusters, a block at a time
+		uint64_t off;
+		int e = find_extent(src_table, src->extent_num, pin >> fs->block_shift, &off);
+		if (e >= 0 && a1fs_extent_compressed(src_table + e)) {
+			const char *data = cluster_block(fs, get_file(fi_in), src_table + e, off);
+			int64_t bout = extent_run(dst_table, dst->extent_num, pout >> fs->block_shift, &left_out);
+			if (!data || bout < 0) return done > 0 ? (ssize_t)done : -EIO;
+			uint64_t chunk = fs->block_size - (pin & fs->block_mask);
+			if (chunk > fs->block_size - (pout & fs->block_mask)) chunk = fs->block_size - (pout & fs->block_mask);
+			if (chunk > len - done) chunk = len - done;
+			memcpy(getpointer(fs->image, bout) + (pout & fs->block_mask), data + (pin & fs->block_mask), chunk);
+			done += chunk;
+			continue;
+		}
+		int64_t bin = extent_run(src_table, src->extent_num, pin >> fs->block_shift, &left_in);
+		int64_t bout = extent_run(dst_table, dst->extent_num, pout >> fs->block_shift, &left_out);
+		if (bin < 0 || bout < 0) {
+			fprintf(stderr, "a1fs_copy_file_range:(fatal error) block missing at %lu/%lu\n", (unsigned long)pin, (unsigned long)pout);
+			return done > 0 ? (ssize_t)done : -EIO;
+		}
+		if (fs->windows) left_in = left_out = 1;
+		uint64_t chunk = (left_in << fs->block_shift) - (pin & fs->block_mask);
+		uint64_t chunk_out = (left_out << fs->block_shift) - (pout & fs->block_mask);
+		if (chunk > chunk_out) chunk = chunk_out;
+		if (chunk > len - done) chunk = len - done;
+		memmove(getpointer(fs->image, bout) + (pout & fs->block_mask), getpointer(fs->image, bin) + (pin & fs->block_mask), chunk);
+		done += chunk;
+	}
+	clock_gettime(CLOCK_REALTIME, &dst->mtime);
+	return done;
+}
+
+/**
+ * Make a range of dst share the blocks of the same data in src
+ * (A1FS_IOC_DEDUPE_RANGE).
+ *
+ * The whole range is compared first, so nothing changes if any of it differs.
+ * Then every stretch that is contiguous in both files is spliced into dst's
+ * extent table in place of dst's own blocks, the way unshare_block() splices
+ * in a copy: the extent is cut around the stretch, or the stretch joins the
+ * extent before or after it when they line up on disk, so a file that turns
+ * out to be a copy ends up with the source's extents. The source's blocks get
+ * a reference more, and dst's blocks are freed (a clone sharing them only
+ * loses a reference). Stretches that already share their blocks are skipped.
+ *
+ * Errors:
+ *   EINVAL  a file is not a regular file, an offset is not a multiple of the
+ *           block size or past the end of its file, the two ranges overlap in
+ *           the same file, or the range has a compressed extent.
+ *   EBADE   the data differs.
+ *   ENOMEM  not enough memory for the reference counts.
+ *   ENOSPC  dst's extent table is full, or there is no room for the reference
+ *           counts; the stretches before that were shared.
+ *
+ * @param deduped  receives the bytes of the range that share src's blocks.
+ * @return         0 on success; -errno on error.
+ */
+static int dedupe_range(fs_ctx *fs, struct a1fs_inode *src, uint64_t src_off,
+                        struct a1fs_inode *dst, uint64_t dst_off, uint64_t len, uint64_t *deduped){
+	*deduped = 0;
+	if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) return -EINVAL;
+	if (((src_off | dst_off) & fs->block_mask) || src_off >= src->size || dst_off >= dst->size) return -EINVAL;
+	if (len > src->size - src_off) len = src->size - src_off;
+	if (len > dst->size - dst_off) len = dst->size - dst_off;
+	//a part of a block only at the end of both files, there are no bytes past the end to compare
+	if ((len & fs->block_mask) && (src_off + len != src->size || dst_off + len != dst->size)) {
+		len &= ~(uint64_t)fs->block_mask;
+	}
+	if (len == 0) return 0;
+	uint64_t nblocks = (len + fs->block_mask) >> fs->block_shift;
+	uint64_t sfirst = src_off >> fs->block_shift, dfirst = dst_off >> fs->block_shift;
+	if (src == dst && sfirst < dfirst + nblocks && dfirst < sfirst + nblocks) return -EINVAL;
+	if (!refs_load(fs)) return -ENOMEM;
+
+	struct a1fs_extent *src_table = (struct a1fs_extent *)getpointer(fs->image, src->a1fs_extent_table);
+	struct a1fs_extent *dst_table = (struct a1fs_extent *)getpointer(fs->image, dst->a1fs_extent_table);
+	uint64_t so, doff;
+	for (uint64_t b = 0; b < nblocks; b++) {
+		int i = find_extent(src_table, src->extent_num, sfirst + b, &so);
+		int k = find_extent(dst_table, dst->extent_num, dfirst + b, &doff);
+		if (i < 0 || k < 0 || a1fs_extent_compressed(src_table + i) || a1fs_extent_compressed(dst_table + k)) {
+			return -EINVAL;
+		}
+		size_t n = (b + 1 < nblocks || !(len & fs->block_mask)) ? (size_t)fs->block_size : (len & fs->block_mask);
+		if (memcmp(getpointer(fs->image, src_table[i].start + so), getpointer(fs->image, dst_table[k].start + doff), n)) {
+			return -EBADE;
+		}
+	}
+
+	int max_extents = fs->block_size / fs->extent_size;
+	uint64_t done = 0;
+	int ret = 0;
+	while (done < nblocks) {
+		int i = find_extent(src_table, src->extent_num, sfirst + done, &so);
+		int k = find_extent(dst_table, dst->extent_num, dfirst + done, &doff);
+		uint64_t s = src_table[i].start + so, d = dst_table[k].start + doff;
+		uint64_t n = nblocks - done;
+		if (n > src_table[i].count - so) n = src_table[i].count - so;
+		if (n > dst_table[k].count - doff) n = dst_table[k].count - doff;
+		if (s == d) {
+			done += n;
+			continue;
+		}
+
+		//dst's extent becomes up to three pieces, the source's blocks in the middle
+		struct a1fs_extent pieces[3];
+		int m = 0;
+		if (doff > 0) pieces[m++] = (struct a1fs_extent){dst_table[k].start, doff};
+		pieces[m++] = (struct a1fs_extent){s, n};
+		if (doff + n < dst_table[k].count) pieces[m++] = (struct a1fs_extent){d + n, dst_table[k].count - doff - n};
+		int first = 0, last = m;
+		bool join_prev = doff == 0 && k > 0 && !a1fs_extent_compressed(dst_table + k - 1) &&
+		                 (uint64_t)dst_table[k - 1].start + dst_table[k - 1].count == s &&
+		                 (uint64_t)dst_table[k - 1].count + n < A1FS_EXTENT_COMPRESSED;
+		bool join_next = !join_prev && doff + n == dst_table[k].count && k + 1 < dst->extent_num &&
+		                 !a1fs_extent_compressed(dst_table + k + 1) && dst_table[k + 1].start == s + n &&
+		                 (uint64_t)dst_table[k + 1].count + n < A1FS_EXTENT_COMPRESSED;
+		if (join_prev) first = 1;
+		if (join_next) last = m - 1;
+		int add = last - first;
+		if (dst->extent_num - 1 + add > max_extents) {
+			ret = -ENOSPC;
+			break;
+		}
+		if ((ret = refs_adjust(fs, s, n, 1)) < 0) break;
+
+		if (join_prev) dst_table[k - 1].count += n;
+		if (join_next) {
+			dst_table[k + 1].start = s;
+			dst_table[k + 1].count += n;
+		}
+		memmove(dst_table + k + add, dst_table + k + 1, (size_t)(dst->extent_num - k - 1) * sizeof(*dst_table));
+		memcpy(dst_table + k, pieces + first, (size_t)add * sizeof(*dst_table));
+		if (add == 0) memset(dst_table + dst->extent_num - 1, 0, sizeof(*dst_table));
+		dst->extent_num += add - 1;
+		free_blocks(fs, d, n);
+		done += n;
+	}
+	//the references taken are in memory until the table is written
+	int synced = refs_sync(fs);
+	if (ret == 0) ret = synced;
+	update_sb();
+	*deduped = done << fs->block_shift < len ? done << fs->block_shift : len;
+	return ret;
+}
+
+/**
+ * Control an open file.
+ *
+ * The requests are A1FS_IOC_DEFRAG, A1FS_IOC_CLONE, A1FS_IOC_COPY_RANGE and
+ * A1FS_IOC_DEDUPE_RANGE, see a1fs_ioctl.h.
+ *
+ * Errors:
+ *   ENOTTY  unknown request.
+ *   EROFS   the file system is mounted read-only.
+ *   ENOSPC  no run of free blocks is long enough to hold the file (defrag);
+ *           no room for the reference counts (clone).
+ *   ENOENT  the source of a clone, copy or dedup doesn't exist.
+ *   EINVAL  the source or the open file of a clone, copy or dedup is not a
+ *           regular file; the ranges of a copy overlap.
+ *   EBADE   the ranges of a dedup hold different data.
+ *
+ * @param path   path to the file.
+ * @param cmd    the request.
+ * @param arg    the argument as passed to ioctl(); unused.
+ * @param fi     open file; fi->fh caches the inode number.
+ * @param flags  FUSE_IOCTL_* flags; unused.
+ * @param data   buffer for the request's argument, a struct a1fs_defrag, a1fs_clone,
+ *               a1fs_copy_range or a1fs_dedupe_range.
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                      unsigned int flags, void *data)
+{
+	(void)arg;
+	(void)flags;
+	fs_ctx *fs = begin_op();
+	unsigned int req = cmd;
+	if (req != A1FS_IOC_DEFRAG && req != A1FS_IOC_CLONE && req != A1FS_IOC_COPY_RANGE &&
+	    req != A1FS_IOC_DEDUPE_RANGE) {
+		return -ENOTTY;
+	}
+	if (fs->read_only) return -EROFS;
+
+	if (req == A1FS_IOC_COPY_RANGE) {
+		struct a1fs_copy_range *copy = data;
+		if (!copy) return -EINVAL;
+		copy->src[A1FS_PATH_MAX - 1] = '\0';
+		struct stat st;
+		if (copy->src[0] != '/') return -EINVAL;
+		int ret = a1fs_getattr(copy->src, &st);
+		if (ret < 0) return ret;
+		if (copy->src_offset > INT64_MAX || copy->dst_offset > INT64_MAX) return -EINVAL;
+		size_t len = copy->length > SSIZE_MAX ? SSIZE_MAX : copy->length;
+		ssize_t n = a1fs_copy_file_range(copy->src, NULL, copy->src_offset, path, fi, copy->dst_offset, len, 0);
+		if (n < 0) return n;
+		copy->copied = n;
+		return 0;
+	}
+	struct a1fs_inode *inode = file_inode(fs, path, fi);
+
+	if (req == A1FS_IOC_CLONE) {
+		struct a1fs_clone *clone = data;
+		if (!clone) return -EINVAL;
+		clone->src[A1FS_PATH_MAX - 1] = '\0';
+		struct stat st;
+		if (clone->src[0] != '/') return -EINVAL;
+		int ret = a1fs_getattr(clone->src, &st);
+		if (ret < 0) return ret;
+		ret = clone_inode(fs, find_inode(fs, clone->src), inode);
+		return ret;
+	}
+
+	if (req == A1FS_IOC_DEDUPE_RANGE) {
+		struct a1fs_dedupe_range *range = data;
+		if (!range) return -EINVAL;
+		range->src[A1FS_PATH_MAX - 1] = '\0';
+		struct stat st;
+		if (range->src[0] != '/') return -EINVAL;
+		int ret = a1fs_getattr(range->src, &st);
+		if (ret < 0) return ret;
+		ret = dedupe_range(fs, find_inode(fs, range->src), range->src_offset, inode, range->dst_offset,
+		                   range->length, &range->deduped);
+		return ret;
+	}
+
+	struct a1fs_defrag res;
+	int ret = defrag_inode(fs, inode, &res);
+	if (data) memcpy(data, &res, sizeof(res));
+	return ret;
+}
+
+
+struct fuse_operations a1fs_ops = {
+	.init     = a1fs_fuse_init,
 	.destroy  = a1fs_destroy,
 	.statfs   = a1fs_statfs,
 	.getattr  = a1fs_getattr,
+	.opendir  = a1fs_opendir,
 	.readdir  = a1fs_readdir,
+	.releasedir = a1fs_releasedir,
 	.mkdir    = a1fs_mkdir,
 	.rmdir    = a1fs_rmdir,
 	.create   = a1fs_create,
 	.unlink   = a1fs_unlink,
+	.rename   = a1fs_rename,
 	.utimens  = a1fs_utimens,
 	.truncate = a1fs_truncate,
+	.open     = a1fs_open,
+	.release  = a1fs_release,
 	.read     = a1fs_read,
 	.write    = a1fs_write,
+	.ioctl    = a1fs_ioctl,
 };
-
-int main(int argc, char *argv[])
-{
-	a1fs_opts opts = {0};// defaults are all 0
-	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-	if (!a1fs_opt_parse(&args, &opts)) return 1;
-
-	fs_ctx fs = {0};
-	if (!a1fs_init(&fs, &opts)) {
-		fprintf(stderr, "Failed to mount the file system\n");
-		return 1;
-	}
-
-	return fuse_main(args.argc, args.argv, &a1fs_ops, &fs);
-}
@@ -1,6 +1,11 @@
 
+/** Default block size, and the block size of images made before it could be chosen. */
 #define A1FS_BLOCK_SIZE 4096
 
+/** mkfs takes any power of two block size from A1FS_MIN_BLOCK_SIZE to A1FS_MAX_BLOCK_SIZE. */
+#define A1FS_MIN_BLOCK_SIZE 1024
+#define A1FS_MAX_BLOCK_SIZE 65536
+
 /** Block number (block pointer) type. */
 typedef uint32_t a1fs_blk_t;
 
@@ -11,6 +16,34 @@ typedef uint32_t a1fs_ino_t;
 /** Magic value that can be used to identify an a1fs image. */
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
+/**
+ * Superblock feature flags.
+ *
+ * A1FS_FEATURE_64BIT: the block count and free block count are kept in the
+ * 64-bit fields at the end of the superblock (the int fields are unused).
+ * mkfs sets it when the image has more blocks than an int can count.
+ *
+ * A1FS_FEATURE_LAZY_ITABLE: only the first itable_zeroed blocks of the inode
+ * table have been zeroed. mkfs -F leaves the rest to the daemon, which zeroes
+ * it in the background after mount and clears the flag once it is done.
+ *
+ * A1FS_FEATURE_REFLINK: some data blocks are shared by more than one file
+ * (clones), and s_refcount_table holds their reference counts. A version that
+ * doesn't know this would free a shared block when the first file lets go.
+ *
+ * A1FS_FEATURE_COMPRESS: some extents hold compressed data (see
+ * A1FS_EXTENT_COMPRESSED), which a version that doesn't know them would
+ * read as garbage.
+ */
+#define A1FS_FEATURE_64BIT 0x1u
+#define A1FS_FEATURE_LAZY_ITABLE 0x2u
+#define A1FS_FEATURE_REFLINK 0x4u
+#define A1FS_FEATURE_COMPRESS 0x8u
+
+/** Features this version understands, an image with any other bit is not mounted. */
+#define A1FS_FEATURES_KNOWN (A1FS_FEATURE_64BIT | A1FS_FEATURE_LAZY_ITABLE | A1FS_FEATURE_REFLINK | \
+                             A1FS_FEATURE_COMPRESS)
+
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
 	/** Must match A1FS_MAGIC. */
@@ -33,7 +66,7 @@ typedef struct a1fs_superblock {
 	int block_num;
 	// free block number
 	int free_bnum;
-	// block size (A1FS_BLOCK_SIZE)
+	// block size, a power of two in [A1FS_MIN_BLOCK_SIZE, A1FS_MAX_BLOCK_SIZE]
 	int block_size;
 	// inode size
 	int inode_size;
@@ -45,10 +78,53 @@ typedef struct a1fs_superblock {
 	bool help;
 	bool force;
 	bool zero;
+	/** A1FS_FEATURE_* flags, 0 on images made before there were any. */
+	uint32_t features;
+	/** Number of blocks, on A1FS_FEATURE_64BIT images. */
+	uint64_t block_num64;
+	/** Free block number, on A1FS_FEATURE_64BIT images. */
+	uint64_t free_bnum64;
+	/** Inode table blocks zeroed so far, on A1FS_FEATURE_LAZY_ITABLE images. */
+	uint64_t itable_zeroed;
+	/**
+	 * Reference count table (A1FS_FEATURE_REFLINK): refcount_num a1fs_ref
+	 * entries in the s_refcount_blocks blocks from s_refcount_table on.
+	 */
+	uint32_t s_refcount_table;
+	uint32_t s_refcount_blocks;
+	uint64_t refcount_num;
+	/**
+	 * Orphan list: unlinked inodes whose blocks are still being freed, linked
+	 * through their parent field from s_orphan_head (0 when the list is
+	 * empty, the root is never on it). orphan_blocks counts the blocks they
+	 * still hold. A version that doesn't know the list only leaks them.
+	 */
+	uint32_t s_orphan_head;
+	uint32_t s_orphan_num;
+	uint64_t orphan_blocks;
 } a1fs_superblock;
 
+/** Number of blocks in the image. */
+static inline uint64_t a1fs_sb_blocks(const a1fs_superblock *sb)
+{
+	return (sb->features & A1FS_FEATURE_64BIT) ? sb->block_num64 : (uint64_t)sb->block_num;
+}
+
+/** Number of free blocks in the image. */
+static inline uint64_t a1fs_sb_free_blocks(const a1fs_superblock *sb)
+{
+	return (sb->features & A1FS_FEATURE_64BIT) ? sb->free_bnum64 : (uint64_t)sb->free_bnum;
+}
+
+/** Record the number of free blocks in the superblock. */
+static inline void a1fs_sb_set_free_blocks(a1fs_superblock *sb, uint64_t n)
+{
+	if (sb->features & A1FS_FEATURE_64BIT) sb->free_bnum64 = n;
+	else sb->free_bnum = (int)n;
+}
+
 // Superblock must fit into a single block
-static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
+static_assert(sizeof(a1fs_superblock) <= A1FS_MIN_BLOCK_SIZE,
               "superblock is too large");
 
 
@@ -61,6 +137,53 @@ typedef struct a1fs_extent {
 
 } a1fs_extent;
 
+/**
+ * Compressed extents.
+ *
+ * An extent with A1FS_EXTENT_COMPRESSED set in count holds one cluster of a
+ * file: the low 16 bits of count are the blocks of file data in it, bits 16
+ * to 30 the blocks it takes from start on. The first of those begins with the
+ * length in bytes (uint32_t) of the compressed data (see lz.h) that follows.
+ * A cluster is A1FS_CLUSTER_SIZE bytes of the file and starts at a multiple
+ * of that; the part of the file after the last whole cluster stays plain.
+ */
+#define A1FS_EXTENT_COMPRESSED 0x80000000u
+#define A1FS_EXTENT_USED_SHIFT 16
+#define A1FS_EXTENT_LEN_MASK 0xffffu
+#define A1FS_CLUSTER_SIZE (128 * 1024)
+
+/** Whether the extent holds a compressed cluster. */
+static inline bool a1fs_extent_compressed(const a1fs_extent *e)
+{
+	return (e->count & A1FS_EXTENT_COMPRESSED) != 0;
+}
+
+/** Blocks of file data in the extent. */
+static inline uint32_t a1fs_extent_len(const a1fs_extent *e)
+{
+	return a1fs_extent_compressed(e) ? e->count & A1FS_EXTENT_LEN_MASK : e->count;
+}
+
+/** Blocks the extent takes up in the image, from start on. */
+static inline uint32_t a1fs_extent_used(const a1fs_extent *e)
+{
+	return a1fs_extent_compressed(e) ? (e->count & ~A1FS_EXTENT_COMPRESSED) >> A1FS_EXTENT_USED_SHIFT : e->count;
+}
+
+/**
+ * Reference count table entry.
+ *
+ * Blocks [start, start + count) are used by refs extents, at least two. A
+ * block that is in no entry is used once. Entries are sorted by start and
+ * don't overlap.
+ */
+typedef struct a1fs_ref {
+	a1fs_blk_t start;
+	uint32_t count;
+	uint32_t refs;
+	uint32_t pad;
+} a1fs_ref;
+
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -100,13 +223,35 @@ typedef struct a1fs_inode {
 	//the number of extents
 	int extent_num;
 
+	/** Inode number of the parent directory. The root is its own parent. */
+	a1fs_ino_t parent;
+
+	/**
+	 * Directories: no dentry slot before this one is free, so inserts start
+	 * looking here. Slot n is dentry n % k of the directory's block n / k, with
+	 * k dentries in a block.
+	 */
+	uint32_t free_slot;
+
+	/** A1FS_INODE_* flags. */
+	uint16_t flags;
+
 	/**  char array padding */
-	char pad[18];
+	char pad[8];
 
 } a1fs_inode;
 
+/**
+ * Inode flags.
+ *
+ * A1FS_INODE_COMPRESS: the file's data is compressed when it is closed after
+ * a write. A directory passes it on to the files and directories created in
+ * it (mkfs -C sets it on the root, -o compress=DIR on a directory).
+ */
+#define A1FS_INODE_COMPRESS 0x1u
+
 // A single block must fit an integral number of inodes
-static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
+static_assert(A1FS_MIN_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
 /** Maximum file name (path component) length. Includes the null terminator. */
 #define A1FS_NAME_MAX 252
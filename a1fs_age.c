@@ -0,0 +1,390 @@
+/**
+ * a1fs aging and fragmentation benchmark.
+ *
+ * Replays a synthetic long-term churn of creates, appends, truncates and
+ * deletes against an image through the operations in a1fs.c (no FUSE mount)
+ * and periodically takes a snapshot of the layout quality:
+ *
+ *   - extents per file (mean, p90 and max over all regular files),
+ *   - the run-length distribution of free space in the block bitmap,
+ *   - sequential read throughput over all live files,
+ *   - inode locality: how many inodes share an inode table block with their
+ *     parent directory, and the mean distance between the two.
+ *
+ * Every snapshot is printed as one JSON object, so runs with different
+ * allocators can be compared round by round.
+ *
+ * Usage: a1fs_age [-i image] [-s size_mb] [-n inodes] [-b block_size] [-r ops] [-k interval]
+ *                 [-u utilization] [-S seed] [-D] [-o out]
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs_ioctl.h"
+#include "map.h"
+#include "mkfs.h"
+#include "ops.h"
+
+
+/** Directories the files are spread over, and files per directory. */
+#define AGE_DIRS 10
+#define AGE_FILES_PER_DIR 12
+#define AGE_SLOTS (AGE_DIRS * AGE_FILES_PER_DIR)
+
+/** Free run lengths are bucketed by powers of two up to 2^(AGE_RUN_BUCKETS-1). */
+#define AGE_RUN_BUCKETS 16
+
+/** State of the aging run. */
+typedef struct age_ctx {
+	const char *img_path;
+	size_t size;
+	size_t n_inodes;
+	/** Block size of the image. */
+	size_t block_size;
+	/** Number of churn operations to replay. */
+	long ops;
+	/** Operations between snapshots. */
+	long interval;
+	/** Fraction of the data blocks the churn tries to keep in use. */
+	double utilization;
+	FILE *out;
+	void *image;
+	fs_ctx fs;
+	/** Size in blocks of the file in every slot, -1 if the slot is empty. */
+	long blocks[AGE_SLOTS];
+	/** Blocks currently in use by the files. */
+	long used;
+	/** Churn operations that failed (e.g. out of space or extents). */
+	long failed;
+	/** Defragment every file after the churn (-D). */
+	bool defrag;
+	char *buf;
+} age_ctx;
+
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void slot_path(char *path, size_t len, int slot)
+{
+	snprintf(path, len, "/a%d/f%d", slot / AGE_FILES_PER_DIR, slot % AGE_FILES_PER_DIR);
+}
+
+static bool map_image(age_ctx *a)
+{
+	if (!a->img_path) {
+		a->image = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+		                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (a->image == MAP_FAILED) {
+			perror("mmap");
+			return false;
+		}
+		return true;
+	}
+
+	int fd = open(a->img_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, a->size) < 0) {
+		perror(a->img_path);
+		if (fd >= 0) close(fd);
+		return false;
+	}
+	close(fd);
+	a->image = map_file(a->img_path, A1FS_MIN_BLOCK_SIZE, &a->size);
+	return a->image != NULL;
+}
+
+static bool format_image(age_ctx *a)
+{
+	memset(a->image, 0, a->size);
+	if (!a1fs_format_bs(a->image, a->size, a->n_inodes, a->block_size)) {
+		fprintf(stderr, "a1fs_age: failed to format the image\n");
+		return false;
+	}
+	if (!fs_ctx_init(&a->fs, a->image, a->size)) return false;
+	a1fs_attach(&a->fs);
+
+	char path[32];
+	for (int d = 0; d < AGE_DIRS; d++) {
+		snprintf(path, sizeof(path), "/a%d", d);
+		if (a1fs_ops.mkdir(path, S_IFDIR | 0755) < 0) return false;
+	}
+	for (int i = 0; i < AGE_SLOTS; i++) a->blocks[i] = -1;
+	return true;
+}
+
+
+/** Append n blocks to the file in slot with block sized writes. */
+static void churn_append(age_ctx *a, int slot, long n)
+{
+	char path[32];
+	slot_path(path, sizeof(path), slot);
+	for (long i = 0; i < n; i++) {
+		off_t off = (off_t)a->blocks[slot] * a->block_size;
+		if (a1fs_ops.write(path, a->buf, a->block_size, off, NULL) < 0) {
+			a->failed++;
+			return;
+		}
+		a->blocks[slot]++;
+		a->used++;
+	}
+}
+
+/** One random churn operation, biased towards the target utilization. */
+static void churn_step(age_ctx *a)
+{
+	char path[32];
+	long capacity = a->fs.block_num - a->fs.first_data_block;
+	bool grow = a->used < (long)(a->utilization * capacity);
+	int slot = random() % AGE_SLOTS;
+	slot_path(path, sizeof(path), slot);
+
+	if (a->blocks[slot] < 0) {
+		//empty slot: create a file, only when below the target
+		if (!grow) return;
+		if (a1fs_ops.create(path, S_IFREG | 0644, NULL) < 0) {
+			a->failed++;
+			return;
+		}
+		a->blocks[slot] = 0;
+		churn_append(a, slot, 1 + random() % 16);
+		return;
+	}
+
+	int dice = random() % 100;
+	if (grow ? dice < 70 : dice < 20) {
+		//log-style growth
+		churn_append(a, slot, 1 + random() % 8);
+	} else if (dice < 85 && a->blocks[slot] > 1) {
+		//cut the file down to a random shorter length
+		long keep = 1 + random() % a->blocks[slot];
+		if (a1fs_ops.truncate(path, (off_t)keep * a->block_size) < 0) {
+			a->failed++;
+			return;
+		}
+		a->used -= a->blocks[slot] - keep;
+		a->blocks[slot] = keep;
+	} else {
+		if (a1fs_ops.unlink(path) < 0) {
+			a->failed++;
+			return;
+		}
+		a->used -= a->blocks[slot];
+		a->blocks[slot] = -1;
+	}
+}
+
+
+static int cmp_int(const void *x, const void *y)
+{
+	return *(const int *)x - *(const int *)y;
+}
+
+/** Print the layout quality of the image after round ops. */
+static void snapshot(age_ctx *a, long round)
+{
+	fs_ctx *fs = &a->fs;
+	const unsigned char *ibitmap = (const unsigned char *)a->image + (size_t)fs->ibitmap * fs->block_size;
+	const unsigned char *bbitmap = (const unsigned char *)a->image + (size_t)fs->bbitmap * fs->block_size;
+	struct a1fs_inode *itable = (struct a1fs_inode *)((char *)a->image + (size_t)fs->inode_table * fs->block_size);
+
+	//extents per regular file
+	int extents[AGE_SLOTS + 1];
+	int nfiles = 0;
+	long total_extents = 0;
+	for (int i = 0; i < fs->inode_num && nfiles < AGE_SLOTS; i++) {
+		//orphans waiting to be freed have no links
+		if (!(ibitmap[i / 8] & (1 << (i % 8))) || itable[i].links == 0) continue;
+		if (!S_ISREG(itable[i].mode) || itable[i].size == 0) continue;
+		extents[nfiles++] = itable[i].extent_num;
+		total_extents += itable[i].extent_num;
+	}
+	qsort(extents, nfiles, sizeof(int), cmp_int);
+
+	//inode table locality of everything but the root
+	int per_block = fs->block_size / sizeof(struct a1fs_inode);
+	long ninodes = 0, near_parent = 0, distance = 0;
+	for (int i = 1; i < fs->inode_num; i++) {
+		if (!(ibitmap[i / 8] & (1 << (i % 8))) || itable[i].links == 0) continue;
+		int parent = itable[i].parent;
+		ninodes++;
+		if (i / per_block == parent / per_block) near_parent++;
+		distance += i > parent ? i - parent : parent - i;
+	}
+
+	//free space runs in the data area
+	long runs[AGE_RUN_BUCKETS] = {0};
+	long nruns = 0, free_blocks = 0, largest = 0, run = 0;
+	for (uint64_t i = fs->first_data_block; i <= fs->block_num; i++) {
+		if (i < fs->block_num && !(bbitmap[i / 8] & (1 << (i % 8)))) {
+			run++;
+			continue;
+		}
+		if (run == 0) continue;
+		int bucket = 0;
+		while (bucket < AGE_RUN_BUCKETS - 1 && (2L << bucket) <= run) bucket++;
+		runs[bucket]++;
+		nruns++;
+		free_blocks += run;
+		if (run > largest) largest = run;
+		run = 0;
+	}
+
+	//sequential read of every live file
+	char path[32];
+	size_t bytes = 0;
+	long start = now_ns();
+	for (int slot = 0; slot < AGE_SLOTS; slot++) {
+		if (a->blocks[slot] <= 0) continue;
+		slot_path(path, sizeof(path), slot);
+		for (long b = 0; b < a->blocks[slot]; b++) {
+			int ret = a1fs_ops.read(path, a->buf, a->block_size, (off_t)b * a->block_size, NULL);
+			if (ret > 0) bytes += ret;
+		}
+	}
+	double secs = (now_ns() - start) / 1e9;
+
+	fprintf(a->out, "{\"round\":%ld,\"files\":%d,\"used_blocks\":%ld,\"failed_ops\":%ld,"
+	        "\"extents_mean\":%.2f,\"extents_p90\":%d,\"extents_max\":%d,"
+	        "\"free_blocks\":%ld,\"free_runs\":%ld,\"free_run_mean\":%.1f,\"free_run_max\":%ld,"
+	        "\"read_mb_per_sec\":%.1f,\"inode_near_parent\":%.3f,\"inode_dist_mean\":%.1f,"
+	        "\"free_run_hist\":[",
+	        round, nfiles, a->used, a->failed,
+	        nfiles ? (double)total_extents / nfiles : 0.0,
+	        nfiles ? extents[(nfiles - 1) * 9 / 10] : 0, nfiles ? extents[nfiles - 1] : 0,
+	        free_blocks, nruns, nruns ? (double)free_blocks / nruns : 0.0, largest,
+	        secs > 0 ? bytes / secs / (1 << 20) : 0.0,
+	        ninodes ? (double)near_parent / ninodes : 0.0,
+	        ninodes ? (double)distance / ninodes : 0.0);
+	for (int i = 0; i < AGE_RUN_BUCKETS; i++) {
+		fprintf(a->out, "%s%ld", i ? "," : "", runs[i]);
+	}
+	fprintf(a->out, "]}\n");
+	fflush(a->out);
+}
+
+
+/** Defragment every live file with A1FS_IOC_DEFRAG and print the extent counts. */
+static void defrag_all(age_ctx *a)
+{
+	char path[32];
+	long files = 0, before = 0, after = 0, moved = 0, failed = 0;
+	long start = now_ns();
+	for (int slot = 0; slot < AGE_SLOTS; slot++) {
+		if (a->blocks[slot] <= 0) continue;
+		slot_path(path, sizeof(path), slot);
+		struct a1fs_defrag d = {0};
+		if (a1fs_ops.ioctl(path, A1FS_IOC_DEFRAG, NULL, NULL, 0, &d) < 0) failed++;
+		files++;
+		before += d.extents_before;
+		after += d.extents_after;
+		moved += d.blocks_moved;
+	}
+	double secs = (now_ns() - start) / 1e9;
+	fprintf(a->out, "{\"defrag_files\":%ld,\"extents_before\":%ld,\"extents_after\":%ld,"
+	        "\"blocks_moved\":%ld,\"failed\":%ld,\"secs\":%.3f}\n",
+	        files, before, after, moved, failed, secs);
+	fflush(a->out);
+}
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-i image] [-s size_mb] [-n inodes] [-b block_size] [-r ops] [-k interval]\n"
+	        "          [-u utilization] [-S seed] [-D] [-o out]\n"
+	        "  -i  use a file-backed image (default: in memory)\n"
+	        "  -s  image size in MiB (default: 64)\n"
+	        "  -n  number of inodes (default: 1024)\n"
+	        "  -b  block size in bytes (default: 4096)\n"
+	        "  -r  churn operations to replay (default: 20000)\n"
+	        "  -k  operations between snapshots (default: 1000)\n"
+	        "  -u  target fraction of data blocks in use (default: 0.7)\n"
+	        "  -S  random seed (default: 369)\n"
+	        "  -D  defragment every file after the churn and take another snapshot\n"
+	        "  -o  write results to out (default: stdout)\n"
+	        "free_run_hist[i] counts free runs of length [2^i, 2^(i+1)).\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	age_ctx a = {0};
+	a.size = (size_t)64 << 20;
+	a.n_inodes = 1024;
+	a.block_size = A1FS_BLOCK_SIZE;
+	a.ops = 20000;
+	a.interval = 1000;
+	a.utilization = 0.7;
+	unsigned int seed = 369;
+	const char *out_path = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:s:n:b:r:k:u:S:Do:h")) != -1) {
+		switch (opt) {
+			case 'i': a.img_path = optarg; break;
+			case 's': a.size = strtoul(optarg, NULL, 10) << 20; break;
+			case 'n': a.n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'b': a.block_size = strtoul(optarg, NULL, 10); break;
+			case 'r': a.ops = atol(optarg); break;
+			case 'k': a.interval = atol(optarg); break;
+			case 'u': a.utilization = atof(optarg); break;
+			case 'S': seed = strtoul(optarg, NULL, 10); break;
+			case 'D': a.defrag = true; break;
+			case 'o': out_path = optarg; break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (a.size < (size_t)(1 << 20) || a.n_inodes <= AGE_SLOTS + AGE_DIRS ||
+	    a.ops <= 0 || a.interval <= 0 || a.utilization <= 0 || a.utilization >= 1) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	//keep the results apart from the debugging output of the operations
+	if (out_path) {
+		a.out = fopen(out_path, "w");
+	} else {
+		int fd = dup(STDOUT_FILENO);
+		a.out = fd < 0 ? NULL : fdopen(fd, "w");
+	}
+	if (!a.out || !freopen("/dev/null", "w", stdout)) {
+		perror("a1fs_age: output");
+		return 1;
+	}
+
+	a.buf = calloc(1, a.block_size);
+	if (!a.buf) {
+		perror("calloc");
+		return 1;
+	}
+	memset(a.buf, 'a', a.block_size);
+	srandom(seed);
+
+	if (!map_image(&a) || !format_image(&a)) return 1;
+
+	snapshot(&a, 0);
+	for (long i = 1; i <= a.ops; i++) {
+		churn_step(&a);
+		if (i % a.interval == 0) snapshot(&a, i);
+	}
+	if (a.defrag) {
+		defrag_all(&a);
+		snapshot(&a, a.ops);
+	}
+
+	a1fs_attach(NULL);
+	munmap(a.image, a.size);
+	free(a.buf);
+	fclose(a.out);
+	return 0;
+}
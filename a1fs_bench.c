@@ -0,0 +1,586 @@
+/**
+ * a1fs operation microbenchmarks.
+ *
+ * Formats an image with the mkfs() in mkfs.c and calls the operations in
+ * a1fs.c directly, without a FUSE mount, so the numbers contain no kernel
+ * round trips. Each benchmark runs on a freshly formatted image and prints one
+ * JSON object per line, which makes runs easy to diff and track over time.
+ *
+ * Usage: a1fs_bench [-i image] [-s size_mb] [-n inodes] [-b block_size] [-r reps] [-o out]
+ *
+ * Without -i the image lives in anonymous memory; with -i it is a file mapped
+ * like the daemon maps it (the file is created or resized as needed).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs_ioctl.h"
+#include "map.h"
+#include "mkfs.h"
+#include "ops.h"
+
+
+/** Benchmark configuration and the image under test. */
+typedef struct bench_ctx {
+	/** Image file, or NULL for an in-memory image. */
+	const char *img_path;
+	/** Image size in bytes. */
+	size_t size;
+	/** Number of inodes to format with. */
+	size_t n_inodes;
+	/** Block size to format with. */
+	size_t block_size;
+	/** Repetitions for the lookup and random I/O benchmarks. */
+	int reps;
+	/** Where results are written. */
+	FILE *out;
+	/** Mapped image. */
+	void *image;
+	/** Context the operations run against. */
+	fs_ctx fs;
+} bench_ctx;
+
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/** Print one result line. bytes is 0 for benchmarks that don't move data. */
+static void report(bench_ctx *b, const char *bench, const char *param,
+                   long ops, long ns, size_t bytes)
+{
+	double secs = ns / 1e9;
+	fprintf(b->out, "{\"bench\":\"%s\",\"param\":\"%s\",\"ops\":%ld,"
+	        "\"ns_per_op\":%.1f,\"ops_per_sec\":%.1f",
+	        bench, param, ops, ops ? (double)ns / ops : 0.0,
+	        secs > 0 ? ops / secs : 0.0);
+	if (bytes) fprintf(b->out, ",\"mb_per_sec\":%.1f", secs > 0 ? bytes / secs / (1 << 20) : 0.0);
+	fprintf(b->out, "}\n");
+	fflush(b->out);
+}
+
+/** Map the image (anonymous memory or the file given with -i). */
+static bool map_image(bench_ctx *b)
+{
+	if (!b->img_path) {
+		b->image = mmap(NULL, b->size, PROT_READ | PROT_WRITE,
+		                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b->image == MAP_FAILED) {
+			perror("mmap");
+			b->image = NULL;
+			return false;
+		}
+		return true;
+	}
+
+	int fd = open(b->img_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		perror(b->img_path);
+		return false;
+	}
+	if (ftruncate(fd, b->size) < 0) {
+		perror("ftruncate");
+		close(fd);
+		return false;
+	}
+	close(fd);
+	b->image = map_file(b->img_path, b->block_size, &b->size);
+	return b->image != NULL;
+}
+
+/** Format the image and point the operations at it. */
+static bool reset_image(bench_ctx *b)
+{
+	memset(b->image, 0, b->size);
+	if (!a1fs_format_bs(b->image, b->size, b->n_inodes, b->block_size)) {
+		fprintf(stderr, "a1fs_bench: failed to format the image\n");
+		return false;
+	}
+	memset(&b->fs, 0, sizeof(b->fs));
+	if (!fs_ctx_init(&b->fs, b->image, b->size)) return false;
+	a1fs_attach(&b->fs);
+	return true;
+}
+
+
+/** getattr() of the last entry in directories holding n files. */
+static void bench_lookup_width(bench_ctx *b)
+{
+	static const int widths[] = {4, 8, 12};
+	char path[64], param[64];
+	struct stat st;
+
+	for (size_t w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+		if (!reset_image(b)) return;
+		int n = widths[w];
+		for (int i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "/f%d", i);
+			a1fs_ops.create(path, S_IFREG | 0644, NULL);
+		}
+
+		long start = now_ns();
+		for (int r = 0; r < b->reps; r++) {
+			snprintf(path, sizeof(path), "/f%d", n - 1 - r % n);
+			a1fs_ops.getattr(path, &st);
+		}
+		snprintf(param, sizeof(param), "entries=%d", n);
+		report(b, "lookup_width", param, b->reps, now_ns() - start, 0);
+	}
+}
+
+/** getattr() of a file at the bottom of a chain of nested directories. */
+static void bench_lookup_depth(bench_ctx *b)
+{
+	static const int depths[] = {1, 4, 16, 64};
+	char path[A1FS_NAME_MAX], param[64];
+	struct stat st;
+
+	for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		if (!reset_image(b)) return;
+		path[0] = '\0';
+		for (int i = 0; i < depths[d]; i++) {
+			strcat(path, "/d");
+			a1fs_ops.mkdir(path, S_IFDIR | 0755);
+		}
+		strcat(path, "/f");
+		a1fs_ops.create(path, S_IFREG | 0644, NULL);
+
+		long start = now_ns();
+		for (int r = 0; r < b->reps; r++) a1fs_ops.getattr(path, &st);
+		snprintf(param, sizeof(param), "depth=%d", depths[d]);
+		report(b, "lookup_depth", param, b->reps, now_ns() - start, 0);
+	}
+}
+
+/**
+ * Mark every other data block as used, leaving only single block holes.
+ *
+ * The first few data blocks stay free for the extent table of the file the
+ * allocation benchmark grows.
+ */
+static void fragment_bitmap(bench_ctx *b)
+{
+	unsigned char *bbitmap = (unsigned char *)b->image + (size_t)b->fs.bbitmap * b->block_size;
+	for (uint64_t i = b->fs.first_data_block + 8; i < b->fs.block_num; i += 2) {
+		bbitmap[i / 8] |= 1 << (i % 8);
+	}
+}
+
+/**
+ * Grow a file one block at a time, on a fresh bitmap and on a bitmap where
+ * every other block is in use, so each allocation has to skip over holes.
+ */
+static void bench_alloc(bench_ctx *b)
+{
+	char param[64];
+	//stay below the extent limit of a file (512 with 4 KiB blocks) even when every block is its own extent
+	const int blocks = b->block_size / sizeof(struct a1fs_extent) / 2;
+
+	for (int fragmented = 0; fragmented <= 1; fragmented++) {
+		if (!reset_image(b)) return;
+		if (fragmented) fragment_bitmap(b);
+		a1fs_ops.create("/grow", S_IFREG | 0644, NULL);
+
+		long start = now_ns();
+		int done = 0;
+		for (; done < blocks; done++) {
+			if (a1fs_ops.truncate("/grow", (off_t)(done + 1) * b->block_size) < 0) break;
+		}
+		snprintf(param, sizeof(param), "fragmented=%d", fragmented);
+		report(b, "alloc_block", param, done, now_ns() - start, 0);
+	}
+}
+
+/** Sequential and random block reads and writes of one large file. */
+static void bench_rw(bench_ctx *b, char *buf)
+{
+	//half of the image leaves room for the metadata and the extent table
+	size_t file_size = (b->size / 2) & ~(size_t)(b->block_size - 1);
+	long nblocks = file_size / b->block_size;
+	char param[64];
+
+	if (!reset_image(b)) return;
+	snprintf(param, sizeof(param), "bs=%zu,file_mb=%zu", b->block_size, file_size >> 20);
+
+	a1fs_ops.create("/data", S_IFREG | 0644, NULL);
+	long start = now_ns();
+	long done = 0;
+	for (; done < nblocks; done++) {
+		if (a1fs_ops.write("/data", buf, b->block_size, done * b->block_size, NULL) < 0) break;
+	}
+	report(b, "seq_write", param, done, now_ns() - start, done * b->block_size);
+	if (done == 0) return;
+	nblocks = done;
+
+	start = now_ns();
+	for (long i = 0; i < nblocks; i++) {
+		a1fs_ops.read("/data", buf, b->block_size, i * b->block_size, NULL);
+	}
+	report(b, "seq_read", param, nblocks, now_ns() - start, nblocks * b->block_size);
+
+	//the same through an open file, with readahead as mounted with the default -o readahead
+	struct fuse_file_info fi = {0};
+	b->fs.ra_max = 2048 << 10;
+	if (a1fs_ops.open("/data", &fi) == 0) {
+		start = now_ns();
+		for (long i = 0; i < nblocks; i++) {
+			a1fs_ops.read("/data", buf, b->block_size, i * b->block_size, &fi);
+		}
+		report(b, "seq_read_open", param, nblocks, now_ns() - start, nblocks * b->block_size);
+		a1fs_ops.release("/data", &fi);
+	}
+
+	start = now_ns();
+	for (int r = 0; r < b->reps; r++) {
+		a1fs_ops.read("/data", buf, b->block_size, (random() % nblocks) * b->block_size, NULL);
+	}
+	report(b, "rand_read", param, b->reps, now_ns() - start, (size_t)b->reps * b->block_size);
+
+	start = now_ns();
+	for (int r = 0; r < b->reps; r++) {
+		a1fs_ops.write("/data", buf, b->block_size, (random() % nblocks) * b->block_size, NULL);
+	}
+	report(b, "rand_write", param, b->reps, now_ns() - start, (size_t)b->reps * b->block_size);
+}
+
+/** Appends of small records to a log file, through an open file. */
+static void bench_append(bench_ctx *b, char *buf)
+{
+	const size_t record = 512;
+	char param[64];
+
+	if (!reset_image(b)) return;
+	snprintf(param, sizeof(param), "record=%zu", record);
+
+	struct fuse_file_info fi = {0};
+	if (a1fs_ops.create("/log", S_IFREG | 0644, &fi) != 0) return;
+	//stay well inside one extent table worth of blocks
+	long n = (long)(b->size / 4 / record);
+	long start = now_ns();
+	long done = 0;
+	for (; done < n; done++) {
+		if (a1fs_ops.write("/log", buf, record, done * record, &fi) < 0) break;
+	}
+	report(b, "append", param, done, now_ns() - start, done * record);
+	a1fs_ops.release("/log", &fi);
+}
+
+/**
+ * Copying a file through read and write, inside the image with
+ * A1FS_IOC_COPY_RANGE and by cloning it, and the copy-on-write that follows.
+ */
+static void bench_clone(bench_ctx *b, char *buf)
+{
+	//a quarter of the image, so the source, a copy and the copied-on-write clone all fit
+	size_t file_size = (b->size / 4) & ~(size_t)(b->block_size - 1);
+	long nblocks = file_size / b->block_size;
+	char param[64];
+
+	if (!reset_image(b)) return;
+	snprintf(param, sizeof(param), "file_mb=%zu", file_size >> 20);
+	a1fs_ops.create("/src", S_IFREG | 0644, NULL);
+	long done = 0;
+	for (; done < nblocks; done++) {
+		if (a1fs_ops.write("/src", buf, b->block_size, done * b->block_size, NULL) < 0) break;
+	}
+	if (done == 0) return;
+	nblocks = done;
+
+	a1fs_ops.create("/copy", S_IFREG | 0644, NULL);
+	long start = now_ns();
+	for (long i = 0; i < nblocks; i++) {
+		a1fs_ops.read("/src", buf, b->block_size, i * b->block_size, NULL);
+		a1fs_ops.write("/copy", buf, b->block_size, i * b->block_size, NULL);
+	}
+	report(b, "copy", param, 1, now_ns() - start, nblocks * b->block_size);
+	a1fs_ops.unlink("/copy");
+
+	struct a1fs_copy_range range = {0};
+	strcpy(range.src, "/src");
+	range.length = nblocks * b->block_size;
+	a1fs_ops.create("/copy", S_IFREG | 0644, NULL);
+	start = now_ns();
+	if (a1fs_ops.ioctl("/copy", A1FS_IOC_COPY_RANGE, NULL, NULL, 0, &range) == 0) {
+		report(b, "copy_range", param, 1, now_ns() - start, range.copied);
+	}
+	a1fs_ops.unlink("/copy");
+
+	struct a1fs_clone clone = {0};
+	strcpy(clone.src, "/src");
+	a1fs_ops.create("/clone", S_IFREG | 0644, NULL);
+	start = now_ns();
+	if (a1fs_ops.ioctl("/clone", A1FS_IOC_CLONE, NULL, NULL, 0, &clone) < 0) return;
+	report(b, "clone", param, 1, now_ns() - start, nblocks * b->block_size);
+
+	//every block of the clone is shared the first time it is written
+	start = now_ns();
+	for (done = 0; done < nblocks; done++) {
+		if (a1fs_ops.write("/clone", buf, b->block_size, done * b->block_size, NULL) < 0) break;
+	}
+	report(b, "cow_write", param, done, now_ns() - start, done * b->block_size);
+}
+
+/**
+ * Unlinking a large file and truncating one to 0. Both only hand the blocks
+ * to the orphan list, the operations after them free the blocks.
+ */
+static void bench_release(bench_ctx *b, char *buf)
+{
+	size_t file_size = (b->size / 2) & ~(size_t)(b->block_size - 1);
+	long nblocks = file_size / b->block_size;
+	char param[64];
+
+	if (!reset_image(b)) return;
+	snprintf(param, sizeof(param), "file_mb=%zu", file_size >> 20);
+	const char *ops[] = {"unlink_large", "truncate_zero"};
+	for (int op = 0; op < 2; op++) {
+		a1fs_ops.create("/big", S_IFREG | 0644, NULL);
+		long done = 0;
+		for (; done < nblocks; done++) {
+			if (a1fs_ops.write("/big", buf, b->block_size, done * b->block_size, NULL) < 0) break;
+		}
+		long start = now_ns();
+		if (op == 0) a1fs_ops.unlink("/big");
+		else a1fs_ops.truncate("/big", 0);
+		report(b, ops[op], param, 1, now_ns() - start, done * b->block_size);
+		//let the orphan list drain before the next file
+		struct statvfs st;
+		for (int i = 0; i < 1000; i++) a1fs_ops.statfs("/", &st);
+		if (op == 1) a1fs_ops.unlink("/big");
+	}
+}
+
+/**
+ * Compressing a file of log lines when it is closed in a compressed
+ * directory, and reading it back through the open file.
+ */
+static void bench_compress(bench_ctx *b, char *buf)
+{
+	size_t file_size = (b->size / 4) & ~(size_t)(b->block_size - 1);
+	long nblocks = file_size / b->block_size;
+	char param[64];
+
+	if (!reset_image(b)) return;
+	a1fs_ops.mkdir("/logs", S_IFDIR | 0755);
+	if (a1fs_set_compress("/logs", true) != 0) return;
+
+	struct fuse_file_info fi = {0};
+	if (a1fs_ops.create("/logs/app.log", S_IFREG | 0644, &fi) != 0) return;
+	long line = 0, done = 0;
+	for (; done < nblocks; done++) {
+		size_t n = 0;
+		while (n < b->block_size) {
+			n += snprintf(buf + n, b->block_size - n + 1, "2024-05-01T12:%02ld:%02ld worker-%ld GET /v1/items/%ld 200 %ldms\n",
+			              line / 60 % 60, line % 60, line % 8, line * 37 % 10000, line % 300);
+			line++;
+		}
+		if (a1fs_ops.write("/logs/app.log", buf, b->block_size, done * b->block_size, &fi) < 0) break;
+	}
+	struct statvfs before, after;
+	a1fs_ops.statfs("/", &before);
+	long start = now_ns();
+	a1fs_ops.release("/logs/app.log", &fi);
+	long ns = now_ns() - start;
+	a1fs_ops.statfs("/", &after);
+	//the ratio is of the data blocks the file had to the ones it has now
+	long saved = after.f_bfree - before.f_bfree;
+	snprintf(param, sizeof(param), "file_mb=%zu,ratio=%.2f", file_size >> 20,
+	         done > saved ? (double)done / (done - saved) : 0.0);
+	report(b, "compress_release", param, 1, ns, done * b->block_size);
+
+	memset(&fi, 0, sizeof(fi));
+	if (a1fs_ops.open("/logs/app.log", &fi) != 0) return;
+	start = now_ns();
+	for (long i = 0; i < done; i++) {
+		a1fs_ops.read("/logs/app.log", buf, b->block_size, i * b->block_size, &fi);
+	}
+	report(b, "read_compressed", param, done, now_ns() - start, done * b->block_size);
+	a1fs_ops.release("/logs/app.log", &fi);
+	memset(buf, 'a', b->block_size);
+}
+
+/** Listing state: a page holds at most LIST_PAGE entries, like a fixed getdents buffer. */
+#define LIST_PAGE 64
+typedef struct list_ctx {
+	int in_page;
+	long entries;
+	off_t next;
+} list_ctx;
+
+static int list_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)name;
+	(void)st;
+	list_ctx *l = buf;
+	if (l->in_page == LIST_PAGE) return 1;
+	l->in_page++;
+	l->entries++;
+	l->next = off;
+	return 0;
+}
+
+/** Create and unlink rates for empty files in one directory. */
+static void bench_metadata(bench_ctx *b)
+{
+	char path[64];
+	const int n = 12;
+
+	if (!reset_image(b)) return;
+	long create_ns = 0, unlink_ns = 0;
+	for (int r = 0; r < b->reps / n + 1; r++) {
+		long start = now_ns();
+		for (int i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "/m%d", i);
+			a1fs_ops.create(path, S_IFREG | 0644, NULL);
+		}
+		long mid = now_ns();
+		for (int i = 0; i < n; i++) {
+			snprintf(path, sizeof(path), "/m%d", i);
+			a1fs_ops.unlink(path);
+		}
+		create_ns += mid - start;
+		unlink_ns += now_ns() - mid;
+	}
+	long ops = (long)(b->reps / n + 1) * n;
+	report(b, "create", "empty_files", ops, create_ns, 0);
+	report(b, "unlink", "empty_files", ops, unlink_ns, 0);
+
+	// a directory that grows over many blocks
+	const int big = b->n_inodes / 2;
+	a1fs_ops.mkdir("/big", S_IFDIR | 0755);
+	long start = now_ns();
+	for (int i = 0; i < big; i++) {
+		snprintf(path, sizeof(path), "/big/f%d", i);
+		a1fs_ops.create(path, S_IFREG | 0644, NULL);
+	}
+	snprintf(path, sizeof(path), "files=%d", big);
+	report(b, "create", path, big, now_ns() - start, 0);
+
+	// list it page by page, the attributes come with the entries
+	list_ctx l = {0};
+	start = now_ns();
+	for (int r = 0; r < b->reps / big + 1; r++) {
+		l.next = 0;
+		do {
+			l.in_page = 0;
+			a1fs_ops.readdir("/big", &l, list_filler, l.next, NULL);
+		} while (l.in_page > 0);
+	}
+	snprintf(path, sizeof(path), "files=%d,page=%d", big, LIST_PAGE);
+	report(b, "readdir", path, l.entries, now_ns() - start, 0);
+
+	start = now_ns();
+	for (int r = 0; r < b->reps; r++) {
+		a1fs_ops.mkdir("/dir", S_IFDIR | 0755);
+		a1fs_ops.rmdir("/dir");
+	}
+	report(b, "mkdir_rmdir", "empty_dir", b->reps, now_ns() - start, 0);
+
+	// the directory of many files moved back and forth between two parents
+	a1fs_ops.mkdir("/p0", S_IFDIR | 0755);
+	a1fs_ops.mkdir("/p1", S_IFDIR | 0755);
+	a1fs_ops.rename("/big", "/p0/big");
+	start = now_ns();
+	for (int r = 0; r < b->reps; r++) {
+		if (r % 2 == 0) a1fs_ops.rename("/p0/big", "/p1/big");
+		else a1fs_ops.rename("/p1/big", "/p0/big");
+	}
+	snprintf(path, sizeof(path), "dir_files=%d", big);
+	report(b, "rename", path, b->reps, now_ns() - start, 0);
+}
+
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-i image] [-s size_mb] [-n inodes] [-b block_size] [-r reps] [-o out]\n"
+	        "  -i image    use a file-backed image (default: in memory)\n"
+	        "  -s size_mb  image size in MiB (default: 64)\n"
+	        "  -n inodes   number of inodes (default: 1024)\n"
+	        "  -b size     block size in bytes (default: 4096)\n"
+	        "  -r reps     repetitions of lookup and random I/O (default: 10000)\n"
+	        "  -o out      write results to out (default: stdout)\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	bench_ctx b = {0};
+	b.size = (size_t)64 << 20;
+	b.n_inodes = 1024;
+	b.block_size = A1FS_BLOCK_SIZE;
+	b.reps = 10000;
+	const char *out_path = NULL;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:s:n:b:r:o:h")) != -1) {
+		switch (opt) {
+			case 'i': b.img_path = optarg; break;
+			case 's': b.size = strtoul(optarg, NULL, 10) << 20; break;
+			case 'n': b.n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'b': b.block_size = strtoul(optarg, NULL, 10); break;
+			case 'r': b.reps = atoi(optarg); break;
+			case 'o': out_path = optarg; break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (b.size < (size_t)(1 << 20) || b.n_inodes == 0 || b.reps <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	//the operations print a lot of debugging output to stdout; keep results
+	//on the original stdout (or -o) and send the rest to /dev/null
+	if (out_path) {
+		b.out = fopen(out_path, "w");
+	} else {
+		int fd = dup(STDOUT_FILENO);
+		b.out = fd < 0 ? NULL : fdopen(fd, "w");
+	}
+	if (!b.out) {
+		perror("a1fs_bench: output");
+		return 1;
+	}
+	if (!freopen("/dev/null", "w", stdout)) {
+		perror("freopen");
+		return 1;
+	}
+
+	if (!map_image(&b)) return 1;
+
+	//one spare byte for the terminator snprintf() leaves in bench_compress
+	char *buf = calloc(1, b.block_size + 1);
+	if (!buf) {
+		perror("calloc");
+		return 1;
+	}
+	memset(buf, 'a', b.block_size);
+	srandom(369);
+
+	bench_lookup_width(&b);
+	bench_lookup_depth(&b);
+	bench_alloc(&b);
+	bench_rw(&b, buf);
+	bench_append(&b, buf);
+	bench_clone(&b, buf);
+	bench_release(&b, buf);
+	bench_compress(&b, buf);
+	bench_metadata(&b);
+
+	a1fs_attach(NULL);
+	free(buf);
+	munmap(b.image, b.size);
+	fclose(b.out);
+	return 0;
+}
@@ -0,0 +1,439 @@
+/**
+ * Offline block-level deduplication for an a1fs image.
+ *
+ * Walks the directory tree of an unmounted image, reading the inodes, the
+ * directory blocks and the extent tables directly, and hashes every data
+ * block of every regular file on several threads. Blocks with the same hash
+ * are grouped and the one lowest in the image is kept. Every stretch of a
+ * file that holds copies of kept blocks is then handed to
+ * A1FS_IOC_DEDUPE_RANGE, run in-process like a1fs_age runs the operations, so
+ * it shares the kept blocks with reference counts and its own blocks are
+ * freed. The ioctl compares the data before sharing it, so a hash collision
+ * only costs the comparison. The image must not be mounted while this runs.
+ *
+ * Usage: a1fs_dedup [-j threads] [-m min_blocks] [-n] image
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs_ioctl.h"
+#include "fs_ctx.h"
+#include "map.h"
+#include "ops.h"
+
+
+/** Most threads hashing at once. */
+#define DEDUP_MAX_THREADS 64
+
+/** A regular file found in the tree. */
+typedef struct dedup_file {
+	char *path;
+	a1fs_ino_t ino;
+} dedup_file;
+
+/** A data block of a file, and the hash of what the file has in it. */
+typedef struct dedup_block {
+	uint64_t hash;
+	/** Block number in the image. */
+	uint64_t phys;
+	/** Block number in the file. */
+	uint64_t logical;
+	/** Index of the file in dedup_ctx.files. */
+	uint32_t file;
+	/** Bytes of the file in the block, less than a block only at the end of the file. */
+	uint32_t bytes;
+} dedup_block;
+
+/** A stretch of a file whose blocks are copies of another file's. */
+typedef struct dedup_range {
+	uint32_t dst, src;
+	uint64_t dst_block, src_block;
+	uint64_t blocks;
+} dedup_range;
+
+/** The image and what the scan found in it. */
+typedef struct dedup_ctx {
+	void *image;
+	fs_ctx fs;
+	dedup_file *files;
+	size_t n_files, cap_files;
+	dedup_block *blocks;
+	size_t n_blocks, cap_blocks;
+	/** Inodes and blocks that don't make sense, skipped. */
+	uint64_t bad;
+} dedup_ctx;
+
+/** One hashing thread's share of the blocks. */
+typedef struct hash_job {
+	dedup_ctx *d;
+	size_t first, end;
+	pthread_t thread;
+} hash_job;
+
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void *block_ptr(dedup_ctx *d, uint64_t b)
+{
+	return (char *)d->image + (b << d->fs.block_shift);
+}
+
+static struct a1fs_inode *inode_ptr(dedup_ctx *d, a1fs_ino_t ino)
+{
+	return (struct a1fs_inode *)block_ptr(d, d->fs.inode_table) + ino;
+}
+
+//an extent must lie in the data blocks, a bad one is skipped rather than read past the image
+static bool extent_ok(dedup_ctx *d, const struct a1fs_extent *e)
+{
+	uint64_t used = a1fs_extent_used(e);
+	return e->start >= d->fs.first_data_block && used > 0 && e->start + used <= d->fs.block_num;
+}
+
+//64-bit hash of n bytes, 8 at a time with a multiply and a shift per word
+static uint64_t block_hash(const unsigned char *p, size_t n)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ n;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for (; i < n; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+	return h ^ (h >> 32);
+}
+
+static bool add_file(dedup_ctx *d, const char *path, a1fs_ino_t ino)
+{
+	if (d->n_files == d->cap_files) {
+		size_t cap = d->cap_files ? d->cap_files * 2 : 64;
+		dedup_file *files = realloc(d->files, cap * sizeof(*files));
+		if (!files) return false;
+		d->files = files;
+		d->cap_files = cap;
+	}
+	if (!(d->files[d->n_files].path = strdup(path))) return false;
+	d->files[d->n_files].ino = ino;
+	d->n_files++;
+	return true;
+}
+
+static bool add_block(dedup_ctx *d, uint64_t phys, uint64_t logical, uint32_t bytes)
+{
+	if (d->n_blocks == d->cap_blocks) {
+		size_t cap = d->cap_blocks ? d->cap_blocks * 2 : 1024;
+		dedup_block *blocks = realloc(d->blocks, cap * sizeof(*blocks));
+		if (!blocks) return false;
+		d->blocks = blocks;
+		d->cap_blocks = cap;
+	}
+	d->blocks[d->n_blocks++] = (dedup_block){0, phys, logical, d->n_files - 1, bytes};
+	return true;
+}
+
+//the data blocks of a regular file; compressed clusters are left as they are
+static bool scan_file(dedup_ctx *d, const char *path, a1fs_ino_t ino)
+{
+	struct a1fs_inode *inode = inode_ptr(d, ino);
+	if (inode->size == 0 || inode->extent_num <= 0) return true;
+	if (inode->extent_num > d->fs.block_size / d->fs.extent_size) {
+		d->bad++;
+		return true;
+	}
+	if (!add_file(d, path, ino)) return false;
+	struct a1fs_extent *table = block_ptr(d, inode->a1fs_extent_table);
+	uint64_t nblocks = (inode->size + d->fs.block_mask) >> d->fs.block_shift;
+	uint64_t logical = 0;
+	for (int i = 0; i < inode->extent_num && logical < nblocks; i++) {
+		uint64_t len = a1fs_extent_len(table + i);
+		if (!extent_ok(d, table + i)) {
+			d->bad++;
+			return true;
+		}
+		for (uint64_t b = 0; !a1fs_extent_compressed(table + i) && b < len && logical + b < nblocks; b++) {
+			uint64_t left = inode->size - ((logical + b) << d->fs.block_shift);
+			if (left > (uint64_t)d->fs.block_size) left = d->fs.block_size;
+			if (!add_block(d, table[i].start + b, logical + b, left)) return false;
+		}
+		logical += len;
+	}
+	return true;
+}
+
+//every regular file under the directory ino. path holds its path (empty for the root) in len
+//bytes of an A1FS_PATH_MAX buffer, the names of the entries are appended to it in turn
+static bool scan_dir(dedup_ctx *d, char *path, size_t len, a1fs_ino_t ino)
+{
+	struct a1fs_inode *dir = inode_ptr(d, ino);
+	struct a1fs_extent *table = block_ptr(d, dir->a1fs_extent_table);
+	int per_block = 1 << d->fs.dentry_shift;
+	if (dir->extent_num > d->fs.block_size / d->fs.extent_size) {
+		d->bad++;
+		return true;
+	}
+	for (int i = 0; i < dir->extent_num; i++) {
+		if (!extent_ok(d, table + i)) {
+			d->bad++;
+			continue;
+		}
+		for (uint64_t b = 0; b < table[i].count; b++) {
+			struct a1fs_dentry *entries = block_ptr(d, table[i].start + b);
+			for (int j = 0; j < per_block; j++) {
+				struct a1fs_dentry *e = entries + j;
+				if (e->name[0] == '\0' || strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0) continue;
+				if (e->ino == 0 || e->ino >= (a1fs_ino_t)d->fs.inode_num) {
+					d->bad++;
+					continue;
+				}
+				//a path too long to pass to the ioctl is skipped, which also ends a loop in a corrupt tree
+				int n = snprintf(path + len, A1FS_PATH_MAX - len, "/%.*s", A1FS_NAME_MAX, e->name);
+				if (n < 0 || (size_t)n >= A1FS_PATH_MAX - len) continue;
+				struct a1fs_inode *inode = inode_ptr(d, e->ino);
+				bool ok = true;
+				if (S_ISDIR(inode->mode)) ok = scan_dir(d, path, len + n, e->ino);
+				else if (S_ISREG(inode->mode) && inode->links > 0) ok = scan_file(d, path, e->ino);
+				path[len] = '\0';
+				if (!ok) return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void *hash_main(void *arg)
+{
+	hash_job *job = arg;
+	dedup_ctx *d = job->d;
+	for (size_t i = job->first; i < job->end; i++) {
+		dedup_block *b = d->blocks + i;
+		b->hash = block_hash(block_ptr(d, b->phys), b->bytes);
+	}
+	return NULL;
+}
+
+//hash every block, split evenly between the threads
+static void hash_blocks(dedup_ctx *d, int threads)
+{
+	hash_job jobs[DEDUP_MAX_THREADS];
+	bool started[DEDUP_MAX_THREADS] = {false};
+	size_t per = (d->n_blocks + threads - 1) / threads;
+	for (int t = 0; t < threads; t++) {
+		jobs[t].d = d;
+		jobs[t].first = t * per < d->n_blocks ? t * per : d->n_blocks;
+		jobs[t].end = jobs[t].first + per < d->n_blocks ? jobs[t].first + per : d->n_blocks;
+		//the first share is hashed on this thread, and so is a share no thread could be started for
+		if (t > 0 && jobs[t].first < jobs[t].end) {
+			started[t] = pthread_create(&jobs[t].thread, NULL, hash_main, jobs + t) == 0;
+			if (!started[t]) hash_main(jobs + t);
+		}
+	}
+	hash_main(jobs);
+	for (int t = 1; t < threads; t++) {
+		if (started[t]) pthread_join(jobs[t].thread, NULL);
+	}
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+	const dedup_block *x = a, *y = b;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	if (x->phys != y->phys) return x->phys < y->phys ? -1 : 1;
+	if (x->file != y->file) return x->file < y->file ? -1 : 1;
+	return x->logical < y->logical ? -1 : x->logical > y->logical;
+}
+
+static int cmp_dst(const void *a, const void *b)
+{
+	const dedup_range *x = a, *y = b;
+	if (x->dst != y->dst) return x->dst < y->dst ? -1 : 1;
+	return x->dst_block < y->dst_block ? -1 : x->dst_block > y->dst_block;
+}
+
+/**
+ * Find the ranges to deduplicate.
+ *
+ * In every group of blocks with the same hash, the block lowest in the image
+ * is kept and each block elsewhere becomes a one-block range pointing at it.
+ * Sorted by file and block, ranges that continue each other in both files are
+ * merged.
+ *
+ * @param dup  receives the number of blocks that would be freed.
+ * @return     the ranges (*n of them), NULL if there was no memory.
+ */
+static dedup_range *find_ranges(dedup_ctx *d, size_t *n, uint64_t *dup)
+{
+	qsort(d->blocks, d->n_blocks, sizeof(*d->blocks), cmp_hash);
+	dedup_range *ranges = malloc((d->n_blocks + 1) * sizeof(*ranges));
+	if (!ranges) return NULL;
+	*n = 0;
+	*dup = 0;
+	for (size_t g = 0; g < d->n_blocks;) {
+		size_t end = g + 1;
+		while (end < d->n_blocks && d->blocks[end].hash == d->blocks[g].hash) end++;
+		dedup_block *keep = d->blocks + g;
+		for (size_t i = g + 1; i < end; i++) {
+			dedup_block *b = d->blocks + i;
+			if (b->phys == keep->phys) continue;
+			//a block shared by several files (a clone) is freed once all of them point elsewhere
+			if (b->phys != b[-1].phys) (*dup)++;
+			ranges[(*n)++] = (dedup_range){b->file, keep->file, b->logical, keep->logical, 1};
+		}
+		g = end;
+	}
+
+	qsort(ranges, *n, sizeof(*ranges), cmp_dst);
+	size_t m = 0;
+	for (size_t i = 0; i < *n; i++) {
+		dedup_range *last = m ? ranges + m - 1 : NULL;
+		if (last && last->dst == ranges[i].dst && last->src == ranges[i].src &&
+		    last->dst_block + last->blocks == ranges[i].dst_block &&
+		    last->src_block + last->blocks == ranges[i].src_block) {
+			last->blocks++;
+			continue;
+		}
+		ranges[m++] = ranges[i];
+	}
+	*n = m;
+	return ranges;
+}
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-j threads] [-m min_blocks] [-n] image\n"
+	        "  -j  threads hashing blocks (default: one per CPU)\n"
+	        "  -m  only share ranges of at least min_blocks blocks (default: 1)\n"
+	        "  -n  dry run: report the duplicate blocks without sharing them\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = cpus > 0 ? (int)cpus : 1;
+	uint64_t min_blocks = 1;
+	bool dry_run = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "j:m:nh")) != -1) {
+		switch (opt) {
+			case 'j': threads = atoi(optarg); break;
+			case 'm': min_blocks = strtoull(optarg, NULL, 10); break;
+			case 'n': dry_run = true; break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1 || threads <= 0 || min_blocks == 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (threads > DEDUP_MAX_THREADS) threads = DEDUP_MAX_THREADS;
+	const char *img_path = argv[optind];
+
+	//the operations print debugging output to stdout; keep the report on the original stdout
+	int fd = dup(STDOUT_FILENO);
+	FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		perror("a1fs_dedup: output");
+		return 1;
+	}
+
+	dedup_ctx d = {0};
+	size_t size;
+	d.image = map_file(img_path, A1FS_MIN_BLOCK_SIZE, &size);
+	if (!d.image) return 1;
+	if (!fs_ctx_init(&d.fs, d.image, size)) {
+		fprintf(stderr, "%s: not an a1fs image\n", img_path);
+		munmap(d.image, size);
+		return 1;
+	}
+
+	int ret = 1;
+	long start = now_ns();
+	char path[A1FS_PATH_MAX] = "";
+	if (!scan_dir(&d, path, 0, 0)) {
+		fprintf(stderr, "a1fs_dedup: out of memory\n");
+		goto end;
+	}
+	long scanned = now_ns();
+	hash_blocks(&d, threads);
+	long hashed = now_ns();
+	fprintf(out, "scanned %lu files, %lu blocks (%lu MiB) in %.1f ms, hashed in %.1f ms on %d threads\n",
+	        (unsigned long)d.n_files, (unsigned long)d.n_blocks,
+	        (unsigned long)((d.n_blocks << d.fs.block_shift) >> 20),
+	        (scanned - start) / 1e6, (hashed - scanned) / 1e6, threads);
+	if (d.bad) fprintf(out, "skipped %lu bad inodes, entries or extents\n", (unsigned long)d.bad);
+
+	size_t n;
+	uint64_t dup;
+	dedup_range *ranges = find_ranges(&d, &n, &dup);
+	if (!ranges) {
+		fprintf(stderr, "a1fs_dedup: out of memory\n");
+		goto end;
+	}
+	fprintf(out, "%lu duplicate blocks (%lu KiB) in %lu ranges\n", (unsigned long)dup,
+	        (unsigned long)((dup << d.fs.block_shift) >> 10), (unsigned long)n);
+
+	uint64_t shared = 0, ranges_done = 0, differ = 0, full = 0, failed = 0;
+	struct statvfs before, after;
+	if (!dry_run) {
+		a1fs_attach(&d.fs);
+		a1fs_ops.statfs("/", &before);
+		for (size_t i = 0; i < n; i++) {
+			dedup_range *r = ranges + i;
+			if (r->blocks < min_blocks) continue;
+			struct a1fs_dedupe_range arg = {0};
+			strcpy(arg.src, d.files[r->src].path);
+			arg.src_offset = r->src_block << d.fs.block_shift;
+			arg.dst_offset = r->dst_block << d.fs.block_shift;
+			arg.length = r->blocks << d.fs.block_shift;
+			int err = a1fs_ops.ioctl(d.files[r->dst].path, A1FS_IOC_DEDUPE_RANGE, NULL, NULL, 0, &arg);
+			shared += arg.deduped;
+			if (err == 0) ranges_done++;
+			else if (err == -EBADE) differ++;
+			//the extent table of the file ran out of room, the part before that is shared
+			else if (err == -ENOSPC && arg.deduped > 0) full++;
+			else failed++;
+		}
+		a1fs_ops.statfs("/", &after);
+		uint64_t freed = after.f_bfree - before.f_bfree;
+		fprintf(out, "shared %lu ranges, %lu KiB; %lu blocks (%lu KiB) reclaimed\n", (unsigned long)ranges_done,
+		        (unsigned long)(shared >> 10), (unsigned long)freed, (unsigned long)((freed << d.fs.block_shift) >> 10));
+		if (differ || full || failed) {
+			fprintf(out, "%lu ranges differed (hash collisions), %lu partly shared (extent table full), %lu failed\n",
+			        (unsigned long)differ, (unsigned long)full, (unsigned long)failed);
+		}
+		//writes the free counts back and unmaps the image
+		a1fs_ops.destroy(&d.fs);
+		a1fs_attach(NULL);
+		d.image = NULL;
+	}
+	free(ranges);
+	ret = failed ? 1 : 0;
+end:
+	for (size_t i = 0; i < d.n_files; i++) free(d.files[i].path);
+	free(d.files);
+	free(d.blocks);
+	if (d.image) {
+		fs_ctx_destroy(&d.fs);
+		munmap(d.image, size);
+	}
+	fclose(out);
+	return ret;
+}
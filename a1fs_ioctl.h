@@ -0,0 +1,90 @@
+/**
+ * a1fs ioctls.
+ *
+ * Issued on an open file of a mounted a1fs, e.g.
+ *
+ *   struct a1fs_defrag d;
+ *   ioctl(fd, A1FS_IOC_DEFRAG, &d);
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#include "a1fs.h"
+
+
+/** Result of A1FS_IOC_DEFRAG. */
+struct a1fs_defrag {
+	/** Extents of the file before and after. */
+	uint32_t extents_before;
+	uint32_t extents_after;
+	/** Blocks copied to a new place, 0 if the extents only had to be merged. */
+	uint64_t blocks_moved;
+};
+
+/**
+ * Defragment a file: merge extents that follow each other on disk and move
+ * the rest of the file into one run of free blocks.
+ *
+ * Fails with ENOSPC if there is no run of free blocks long enough; the
+ * extents are still merged then.
+ */
+#define A1FS_IOC_DEFRAG _IOR('a', 1, struct a1fs_defrag)
+
+/** Argument of A1FS_IOC_CLONE. */
+struct a1fs_clone {
+	/** Path of the source file inside the file system, starting with '/'. */
+	char src[A1FS_PATH_MAX];
+};
+
+/**
+ * Make the open file a clone of another regular file of the same file system,
+ * like FICLONE (which FUSE doesn't pass on). The old contents of the file are
+ * dropped, and the two files share the source's blocks until either of them
+ * writes to a block, which then gets a copy of its own. Only the extent table
+ * and the reference counts are written, however large the file.
+ */
+#define A1FS_IOC_CLONE _IOW('a', 2, struct a1fs_clone)
+
+/** Argument of A1FS_IOC_COPY_RANGE. */
+struct a1fs_copy_range {
+	/** Path of the source file inside the file system, starting with '/'. */
+	char src[A1FS_PATH_MAX];
+	/** Where to copy from in the source and to in the open file, and how many bytes. */
+	uint64_t src_offset;
+	uint64_t dst_offset;
+	uint64_t length;
+	/** Receives the bytes copied, fewer than length at the end of the source. */
+	uint64_t copied;
+};
+
+/**
+ * Copy a range of another file into the open file inside the image, like
+ * copy_file_range(2), which FUSE 2 doesn't pass on. The destination grows as
+ * needed; its new blocks are allocated as one run when there is one.
+ */
+#define A1FS_IOC_COPY_RANGE _IOWR('a', 3, struct a1fs_copy_range)
+
+/** Argument of A1FS_IOC_DEDUPE_RANGE. */
+struct a1fs_dedupe_range {
+	/** Path of the source file inside the file system, starting with '/'. */
+	char src[A1FS_PATH_MAX];
+	/** Where the range starts in the source and in the open file, multiples of the block size. */
+	uint64_t src_offset;
+	uint64_t dst_offset;
+	/** Bytes in the range, cut to whole blocks unless it ends at the end of both files. */
+	uint64_t length;
+	/** Receives the bytes of the open file that now share the source's blocks. */
+	uint64_t deduped;
+};
+
+/**
+ * Make a range of the open file share the blocks of an identical range of
+ * another regular file, like FIDEDUPERANGE. The data is compared first and
+ * the call fails with EBADE if it differs; otherwise the blocks of the open
+ * file are freed and its extents point at the source's, whose reference
+ * counts go up. Compressed extents are not deduplicated (EINVAL).
+ */
+#define A1FS_IOC_DEDUPE_RANGE _IOWR('a', 4, struct a1fs_dedupe_range)
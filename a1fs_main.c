@@ -0,0 +1,37 @@
+/**
+ * a1fs FUSE daemon.
+ *
+ * Parses the command line, maps the image and hands the operations in a1fs.c
+ * to fuse_main().
+ */
+
+#include <stdio.h>
+
+#include "mount_opts.h"
+#include "ops.h"
+#include "trace.h"
+
+
+int main(int argc, char *argv[])
+{
+	a1fs_opts opts = {0};// defaults are all 0
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	if (!a1fs_opt_parse(&args, &opts)) return 1;
+
+	a1fs_mount_opts mopts = {0};
+	if (!a1fs_mount_opt_parse(&args, &mopts)) return 1;
+
+	fs_ctx fs = {0};
+	if (!a1fs_init(&fs, &opts, &mopts)) {
+		fprintf(stderr, "Failed to mount the file system\n");
+		return 1;
+	}
+
+	const struct fuse_operations *ops = &a1fs_ops;
+	if (mopts.trace_path) {
+		if (!trace_open(mopts.trace_path)) return 1;
+		ops = trace_wrap(ops);
+	}
+
+	return fuse_main(args.argc, args.argv, ops, &fs);
+}
@@ -0,0 +1,417 @@
+/**
+ * Replay a trace captured with -o trace=FILE against a fresh image.
+ *
+ * The recorded operations are driven through the operations in a1fs.c (no
+ * FUSE mount), either as fast as possible or at the original timing, and the
+ * latency of every operation type is compared with the latency recorded in
+ * the trace. Capturing on one build and replaying on another shows how a
+ * change affects the recorded workload.
+ *
+ * Usage: a1fs_replay [-i image] [-s size_mb] [-n inodes] [-j threads] [-t]
+ *                    [-w trace_out] [-o out] trace
+ *
+ * With -j the records are split over several threads by path, so the records
+ * of one file keep their order; the operations themselves are serialized, the
+ * same as the daemon running with -s. File data is not in the trace: writes
+ * replay with filler bytes.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "a1fs_ioctl.h"
+#include "map.h"
+#include "mkfs.h"
+#include "ops.h"
+#include "trace.h"
+
+
+/** A loaded trace with the results of its replay. */
+typedef struct replay_ctx {
+	trace_rec *recs;
+	char **paths;
+	/** Second path of every record, NULL if it has none. */
+	char **paths2;
+	size_t n;
+	/** Replay duration and result of every record. */
+	uint64_t *duration;
+	int *result;
+	/** Keep the original timing instead of replaying as fast as possible. */
+	bool timed;
+	int threads;
+	/** CLOCK_MONOTONIC at the start of the replay. */
+	uint64_t base;
+	/** Operations to replay (possibly wrapped for -w). */
+	const struct fuse_operations *ops;
+	pthread_mutex_t lock;
+} replay_ctx;
+
+/** One replay thread. */
+typedef struct replay_thread {
+	pthread_t thread;
+	int id;
+	replay_ctx *r;
+} replay_thread;
+
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static int count_filler(void *buf, const char *name, const struct stat *st, off_t off)
+{
+	(void)name;
+	(void)st;
+	(void)off;
+	(*(long *)buf)++;
+	return 0;
+}
+
+static bool load_trace(replay_ctx *r, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	trace_header hdr;
+	if (!trace_read_header(f, &hdr)) {
+		fprintf(stderr, "%s: not an a1fs trace (or a different version)\n", path);
+		fclose(f);
+		return false;
+	}
+
+	size_t cap = 0;
+	char name[A1FS_PATH_MAX], name2[A1FS_PATH_MAX];
+	trace_rec rec;
+	while (trace_next(f, &rec, name, name2)) {
+		if (r->n == cap) {
+			cap = cap ? cap * 2 : 1024;
+			r->recs = realloc(r->recs, cap * sizeof(trace_rec));
+			r->paths = realloc(r->paths, cap * sizeof(char *));
+			r->paths2 = realloc(r->paths2, cap * sizeof(char *));
+			if (!r->recs || !r->paths || !r->paths2) {
+				perror("realloc");
+				fclose(f);
+				return false;
+			}
+		}
+		r->recs[r->n] = rec;
+		r->paths[r->n] = strdup(name);
+		r->paths2[r->n] = rec.path2_len ? strdup(name2) : NULL;
+		if (!r->paths[r->n] || (rec.path2_len && !r->paths2[r->n])) {
+			perror("strdup");
+			fclose(f);
+			return false;
+		}
+		r->n++;
+	}
+	fclose(f);
+
+	r->duration = calloc(r->n ? r->n : 1, sizeof(uint64_t));
+	r->result = calloc(r->n ? r->n : 1, sizeof(int));
+	return r->duration && r->result;
+}
+
+static unsigned long hash_path(const char *path)
+{
+	unsigned long h = 5381;
+	while (*path) h = h * 33 + (unsigned char)*path++;
+	return h;
+}
+
+/** Call the operation of one record; buf holds at least rec->size bytes. */
+static int replay_one(replay_ctx *r, const trace_rec *rec, const char *path,
+                      const char *path2, char *buf)
+{
+	const struct fuse_operations *ops = r->ops;
+	struct stat st;
+	struct statvfs stv;
+	struct timespec times[2];
+	long entries = 0;
+	struct fuse_file_info fi = {0};
+	union {
+		struct a1fs_defrag defrag;
+		struct a1fs_clone clone;
+		struct a1fs_copy_range copy;
+		struct a1fs_dedupe_range dedupe;
+	} ioctl_data;
+	int ret;
+
+	switch (rec->op) {
+		case TRACE_STATFS:   return ops->statfs(path, &stv);
+		case TRACE_GETATTR:  return ops->getattr(path, &st);
+		case TRACE_READDIR:  return ops->readdir(path, &entries, count_filler, rec->offset, NULL);
+		case TRACE_MKDIR:    return ops->mkdir(path, rec->size);
+		case TRACE_RMDIR:    return ops->rmdir(path);
+		case TRACE_CREATE:   return ops->create(path, rec->size, NULL);
+		case TRACE_UNLINK:   return ops->unlink(path);
+		case TRACE_RENAME:   return ops->rename(path, path2 ? path2 : "");
+		case TRACE_TRUNCATE: return ops->truncate(path, rec->size);
+		case TRACE_READ:     return ops->read(path, buf, rec->size, rec->offset, NULL);
+		case TRACE_WRITE:    return ops->write(path, buf, rec->size, rec->offset, NULL);
+		case TRACE_OPEN:
+			// Reads are replayed without an open file, so release right away
+			fi.flags = rec->size;
+			ret = ops->open(path, &fi);
+			if (ret == 0 && ops->release) ops->release(path, &fi);
+			return ret;
+		case TRACE_RELEASE:  return 0;
+		case TRACE_IOCTL:
+			if (!ops->ioctl) return -ENOSYS;
+			memset(&ioctl_data, 0, sizeof(ioctl_data));
+			if (rec->offset == A1FS_IOC_CLONE) {
+				strcpy(ioctl_data.clone.src, path2 ? path2 : "");
+			} else if (rec->offset == A1FS_IOC_COPY_RANGE) {
+				strcpy(ioctl_data.copy.src, path2 ? path2 : "");
+				ioctl_data.copy.src_offset = rec->src_offset;
+				ioctl_data.copy.dst_offset = rec->dst_offset;
+				ioctl_data.copy.length = rec->size;
+			} else if (rec->offset == A1FS_IOC_DEDUPE_RANGE) {
+				strcpy(ioctl_data.dedupe.src, path2 ? path2 : "");
+				ioctl_data.dedupe.src_offset = rec->src_offset;
+				ioctl_data.dedupe.dst_offset = rec->dst_offset;
+				ioctl_data.dedupe.length = rec->size;
+			}
+			return ops->ioctl(path, (int)(unsigned int)rec->offset, NULL, NULL, 0, &ioctl_data);
+		case TRACE_UTIMENS:
+			if (rec->offset == UINT64_MAX) return ops->utimens(path, NULL);
+			times[0].tv_sec = times[1].tv_sec = rec->offset;
+			times[0].tv_nsec = times[1].tv_nsec = rec->size;
+			return ops->utimens(path, times);
+		default:
+			return -ENOSYS;
+	}
+}
+
+static void *replay_main(void *arg)
+{
+	replay_thread *t = arg;
+	replay_ctx *r = t->r;
+	size_t buf_size = 0;
+	char *buf = NULL;
+
+	for (size_t i = 0; i < r->n; i++) {
+		const trace_rec *rec = &r->recs[i];
+		if (r->threads > 1 && hash_path(r->paths[i]) % r->threads != (unsigned long)t->id) continue;
+
+		bool data = rec->op == TRACE_READ || rec->op == TRACE_WRITE;
+		if (data && rec->size > buf_size) {
+			free(buf);
+			buf_size = rec->size;
+			buf = malloc(buf_size);
+			if (!buf) {
+				perror("malloc");
+				return NULL;
+			}
+			memset(buf, 'r', rec->size);
+		}
+		if (r->timed) {
+			uint64_t when = r->base + rec->start, now = now_ns();
+			if (when > now) {
+				struct timespec ts = { (when - now) / 1000000000ul, (when - now) % 1000000000ul };
+				nanosleep(&ts, NULL);
+			}
+		}
+
+		pthread_mutex_lock(&r->lock);
+		uint64_t start = now_ns();
+		r->result[i] = replay_one(r, rec, r->paths[i], r->paths2[i], buf);
+		r->duration[i] = now_ns() - start;
+		pthread_mutex_unlock(&r->lock);
+	}
+	free(buf);
+	return NULL;
+}
+
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/** Print the recorded vs. replayed latency of every operation type. */
+static void report(replay_ctx *r, FILE *out, uint64_t wall)
+{
+	uint64_t *rec_lat = malloc((r->n ? r->n : 1) * sizeof(uint64_t));
+	uint64_t *rep_lat = malloc((r->n ? r->n : 1) * sizeof(uint64_t));
+	if (!rec_lat || !rep_lat) {
+		perror("malloc");
+		free(rec_lat);
+		free(rep_lat);
+		return;
+	}
+
+	long total_mismatched = 0;
+	for (int op = 1; op < TRACE_OP_MAX; op++) {
+		size_t n = 0;
+		long mismatched = 0;
+		double rec_sum = 0, rep_sum = 0;
+		for (size_t i = 0; i < r->n; i++) {
+			if (r->recs[i].op != op) continue;
+			rec_lat[n] = r->recs[i].duration;
+			rep_lat[n] = r->duration[i];
+			rec_sum += rec_lat[n];
+			rep_sum += rep_lat[n];
+			if (r->result[i] != r->recs[i].result) mismatched++;
+			n++;
+		}
+		if (n == 0) continue;
+		qsort(rec_lat, n, sizeof(uint64_t), cmp_u64);
+		qsort(rep_lat, n, sizeof(uint64_t), cmp_u64);
+		total_mismatched += mismatched;
+
+		fprintf(out, "{\"op\":\"%s\",\"count\":%zu,\"mismatched\":%ld,"
+		        "\"recorded_mean_us\":%.2f,\"replay_mean_us\":%.2f,"
+		        "\"recorded_p50_us\":%.2f,\"replay_p50_us\":%.2f,"
+		        "\"recorded_p99_us\":%.2f,\"replay_p99_us\":%.2f,\"delta_pct\":%.1f}\n",
+		        trace_op_name(op), n, mismatched,
+		        rec_sum / n / 1000, rep_sum / n / 1000,
+		        rec_lat[n / 2] / 1000.0, rep_lat[n / 2] / 1000.0,
+		        rec_lat[(n - 1) * 99 / 100] / 1000.0, rep_lat[(n - 1) * 99 / 100] / 1000.0,
+		        rec_sum > 0 ? (rep_sum - rec_sum) * 100 / rec_sum : 0.0);
+	}
+
+	uint64_t recorded_wall = r->n ? r->recs[r->n - 1].start + r->recs[r->n - 1].duration : 0;
+	fprintf(out, "{\"op\":\"total\",\"count\":%zu,\"mismatched\":%ld,"
+	        "\"recorded_wall_ms\":%.1f,\"replay_wall_ms\":%.1f,\"timed\":%s,\"threads\":%d}\n",
+	        r->n, total_mismatched, recorded_wall / 1e6, wall / 1e6,
+	        r->timed ? "true" : "false", r->threads);
+	fflush(out);
+	free(rec_lat);
+	free(rep_lat);
+}
+
+
+static void *map_image(const char *img_path, size_t *size)
+{
+	if (!img_path) {
+		void *image = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+		                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return image == MAP_FAILED ? NULL : image;
+	}
+	int fd = open(img_path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || ftruncate(fd, *size) < 0) {
+		perror(img_path);
+		if (fd >= 0) close(fd);
+		return NULL;
+	}
+	close(fd);
+	return map_file(img_path, A1FS_MIN_BLOCK_SIZE, size);
+}
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-i image] [-s size_mb] [-n inodes] [-j threads] [-t]\n"
+	        "          [-w trace_out] [-o out] trace\n"
+	        "  -i  replay onto a file-backed image (default: in memory)\n"
+	        "  -s  image size in MiB (default: 64)\n"
+	        "  -n  number of inodes (default: 1024)\n"
+	        "  -j  replay threads; records of a path stay on one thread (default: 1)\n"
+	        "  -t  keep the original timing (default: as fast as possible)\n"
+	        "  -w  record the replay to a new trace\n"
+	        "  -o  write results to out (default: stdout)\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	replay_ctx r = {0};
+	r.threads = 1;
+	const char *img_path = NULL, *out_path = NULL, *trace_out = NULL;
+	size_t size = (size_t)64 << 20, n_inodes = 1024;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "i:s:n:j:tw:o:h")) != -1) {
+		switch (opt) {
+			case 'i': img_path = optarg; break;
+			case 's': size = strtoul(optarg, NULL, 10) << 20; break;
+			case 'n': n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'j': r.threads = atoi(optarg); break;
+			case 't': r.timed = true; break;
+			case 'w': trace_out = optarg; break;
+			case 'o': out_path = optarg; break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1 || r.threads <= 0 || n_inodes == 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	if (!load_trace(&r, argv[optind])) return 1;
+
+	//keep the results apart from the debugging output of the operations
+	FILE *out;
+	if (out_path) {
+		out = fopen(out_path, "w");
+	} else {
+		int fd = dup(STDOUT_FILENO);
+		out = fd < 0 ? NULL : fdopen(fd, "w");
+	}
+	if (!out || !freopen("/dev/null", "w", stdout)) {
+		perror("a1fs_replay: output");
+		return 1;
+	}
+
+	void *image = map_image(img_path, &size);
+	if (!image) return 1;
+	fs_ctx fs = {0};
+	if (!a1fs_format(image, size, n_inodes) || !fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "a1fs_replay: failed to format the image\n");
+		return 1;
+	}
+	a1fs_attach(&fs);
+
+	r.ops = &a1fs_ops;
+	if (trace_out) {
+		if (!trace_open(trace_out)) return 1;
+		r.ops = trace_wrap(r.ops);
+	}
+	pthread_mutex_init(&r.lock, NULL);
+
+	replay_thread *threads = calloc(r.threads, sizeof(replay_thread));
+	if (!threads) {
+		perror("calloc");
+		return 1;
+	}
+	r.base = now_ns();
+	for (int t = 0; t < r.threads; t++) {
+		threads[t].id = t;
+		threads[t].r = &r;
+		if (pthread_create(&threads[t].thread, NULL, replay_main, &threads[t]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for (int t = 0; t < r.threads; t++) pthread_join(threads[t].thread, NULL);
+	report(&r, out, now_ns() - r.base);
+
+	if (trace_out) trace_close();
+	a1fs_attach(NULL);
+	munmap(image, size);
+	for (size_t i = 0; i < r.n; i++) {
+		free(r.paths[i]);
+		free(r.paths2[i]);
+	}
+	free(r.paths);
+	free(r.paths2);
+	free(r.recs);
+	free(r.duration);
+	free(r.result);
+	free(threads);
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,111 @@
+/**
+ * Offline discard for an a1fs image, like fstrim(8) for a mounted file system.
+ *
+ * Punches every run of free data blocks out of the image file, so the host
+ * gets back the space of blocks that were freed while the image was mounted
+ * without -o discard. The image must not be mounted while this runs.
+ *
+ * Usage: a1fs_trim [-m min_blocks] [-n] image
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fs_ctx.h"
+#include "image.h"
+#include "map.h"
+
+
+/** Bytes the image file takes on the host. */
+static long long allocated_bytes(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0) return -1;
+	return (long long)st.st_blocks * 512;
+}
+
+static bool block_free(const unsigned char *bitmap, uint64_t i)
+{
+	return !(bitmap[i / 8] & (1 << (i % 8)));
+}
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-m min_blocks] [-n] image\n"
+	        "  -m  only punch free runs of at least min_blocks blocks (default: 1)\n"
+	        "  -n  dry run: report the free runs without punching them\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	uint64_t min_run = 1;
+	bool dry_run = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "m:nh")) != -1) {
+		switch (opt) {
+			case 'm': min_run = strtoull(optarg, NULL, 10); break;
+			case 'n': dry_run = true; break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (optind != argc - 1 || min_run == 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	const char *img_path = argv[optind];
+
+	size_t size;
+	void *image = map_file(img_path, A1FS_MIN_BLOCK_SIZE, &size);
+	if (!image) return 1;
+	int fd = open(img_path, O_RDWR);
+	if (fd < 0) {
+		perror(img_path);
+		munmap(image, size);
+		return 1;
+	}
+	int ret = 1;
+	fs_ctx fs = {0};
+	if (!fs_ctx_init(&fs, image, size)) {
+		fprintf(stderr, "%s: not an a1fs image\n", img_path);
+		goto end;
+	}
+
+	long long before = allocated_bytes(fd);
+	const unsigned char *bbitmap = (const unsigned char *)image + ((size_t)fs.bbitmap << fs.block_shift);
+	uint64_t runs = 0, blocks = 0, failed = 0;
+	uint64_t i = fs.first_data_block;
+	while (i < fs.block_num) {
+		if (!block_free(bbitmap, i)) {
+			i++;
+			continue;
+		}
+		uint64_t start = i;
+		while (i < fs.block_num && block_free(bbitmap, i)) i++;
+		if (i - start < min_run) continue;
+		if (!dry_run && !image_punch(fd, start << fs.block_shift, (i - start) << fs.block_shift)) {
+			failed++;
+			continue;
+		}
+		runs++;
+		blocks += i - start;
+	}
+	long long after = allocated_bytes(fd);
+
+	printf("%s %lu free runs, %lu blocks (%lu KiB)%s\n", dry_run ? "would trim" : "trimmed",
+	       (unsigned long)runs, (unsigned long)blocks, (unsigned long)((blocks << fs.block_shift) >> 10),
+	       failed ? ", punching failed on some runs" : "");
+	printf("image uses %lld KiB on the host, was %lld KiB\n", after >> 10, before >> 10);
+	ret = failed ? 1 : 0;
+	fs_ctx_destroy(&fs);
+end:
+	close(fd);
+	munmap(image, size);
+	return ret;
+}
@@ -0,0 +1,480 @@
+/**
+ * Workload generator for a mounted a1fs.
+ *
+ * Drives fio-style workloads through the kernel against a directory (normally
+ * an a1fs mount point set up by bench_mount.sh) and reports throughput, IOPS
+ * and latency percentiles as one JSON object per run.
+ *
+ * Usage: a1fs_workload -w workload -D dir [-j jobs] [-q depth] [-b bs]
+ *                      [-s file_kb] [-n files] [-t secs] [-o out]
+ *
+ * Workloads:
+ *   seqread, seqwrite, randread, randwrite  block I/O on one file per job;
+ *                                           the depth workers of a job share
+ *                                           the file, giving -q requests in
+ *                                           flight per job
+ *   create   small-file create/stat/unlink storm, one directory per job
+ *   tree     lstat()/readdir() traversal of a tree built before timing
+ *   append   many writers, each appending -b sized records to its own log
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/** Command line options. */
+typedef struct wl_opts {
+	const char *workload;
+	const char *dir;
+	int jobs;
+	int depth;
+	size_t bs;
+	size_t file_size;
+	int files;
+	int secs;
+	/** Tree shape for the "tree" workload. */
+	int tree_depth;
+	int tree_fanout;
+} wl_opts;
+
+/** State of one worker thread. */
+typedef struct worker {
+	pthread_t thread;
+	int id;
+	/** Job this worker belongs to; workers of a job share its file. */
+	int job;
+	int fd;
+	/** Next sequential offset, shared by the workers of a job. */
+	size_t *seq_off;
+	unsigned int seed;
+	char *buf;
+	/** Latency of every completed operation, in nanoseconds. */
+	long *lat;
+	size_t nlat;
+	size_t cap;
+	size_t bytes;
+	int error;
+} worker;
+
+static wl_opts opts = {
+	.jobs = 1,
+	.depth = 1,
+	.bs = 4096,
+	.file_size = (size_t)16 << 20,
+	//a new a1fs directory block holds 14 entries besides "." and ".."
+	.files = 12,
+	.secs = 10,
+	.tree_depth = 4,
+	.tree_fanout = 3,
+};
+
+/** Set once the run time is over. */
+static volatile bool stop;
+
+
+static long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void record(worker *w, long start)
+{
+	if (w->nlat == w->cap) {
+		size_t cap = w->cap ? w->cap * 2 : 4096;
+		long *lat = realloc(w->lat, cap * sizeof(long));
+		if (!lat) {
+			w->error = ENOMEM;
+			stop = true;
+			return;
+		}
+		w->lat = lat;
+		w->cap = cap;
+	}
+	w->lat[w->nlat++] = now_ns() - start;
+}
+
+static void fail(worker *w, const char *what)
+{
+	if (!w->error) {
+		w->error = errno ? errno : EIO;
+		fprintf(stderr, "worker %d: %s: %s\n", w->id, what, strerror(w->error));
+	}
+	stop = true;
+}
+
+static bool is_workload(const char *name)
+{
+	return strcmp(opts.workload, name) == 0;
+}
+
+
+/** Block reads and writes on the job's file. */
+static void run_block_io(worker *w)
+{
+	bool rnd = is_workload("randread") || is_workload("randwrite");
+	bool wr = is_workload("seqwrite") || is_workload("randwrite");
+	size_t nblocks = opts.file_size / opts.bs;
+
+	while (!stop) {
+		size_t off;
+		if (rnd) {
+			off = (rand_r(&w->seed) % nblocks) * opts.bs;
+		} else {
+			off = __atomic_fetch_add(w->seq_off, opts.bs, __ATOMIC_RELAXED) % (nblocks * opts.bs);
+		}
+		long start = now_ns();
+		ssize_t ret = wr ? pwrite(w->fd, w->buf, opts.bs, off)
+		                 : pread(w->fd, w->buf, opts.bs, off);
+		if (ret < 0) {
+			fail(w, wr ? "pwrite" : "pread");
+			return;
+		}
+		record(w, start);
+		w->bytes += ret;
+	}
+}
+
+/** Create, stat and unlink small files in a private directory. */
+static void run_create(worker *w)
+{
+	char dir[PATH_MAX], path[PATH_MAX + 32];
+	struct stat st;
+	snprintf(dir, sizeof(dir), "%s/c%d", opts.dir, w->id);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		fail(w, "mkdir");
+		return;
+	}
+
+	while (!stop) {
+		for (int i = 0; i < opts.files && !stop; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", dir, i);
+			long start = now_ns();
+			int fd = open(path, O_CREAT | O_WRONLY, 0644);
+			if (fd < 0) {
+				fail(w, "create");
+				return;
+			}
+			close(fd);
+			record(w, start);
+		}
+		for (int i = 0; i < opts.files && !stop; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", dir, i);
+			long start = now_ns();
+			if (stat(path, &st) < 0) {
+				fail(w, "stat");
+				return;
+			}
+			record(w, start);
+		}
+		for (int i = 0; i < opts.files; i++) {
+			snprintf(path, sizeof(path), "%s/f%d", dir, i);
+			long start = now_ns();
+			if (unlink(path) < 0 && errno != ENOENT) {
+				fail(w, "unlink");
+				return;
+			}
+			record(w, start);
+		}
+	}
+	rmdir(dir);
+}
+
+static void build_tree(const char *dir, int depth)
+{
+	char path[PATH_MAX];
+	for (int i = 0; i < opts.tree_fanout; i++) {
+		snprintf(path, sizeof(path), "%s/%c%d", dir, depth > 1 ? 'd' : 'f', i);
+		if (depth > 1) {
+			if (mkdir(path, 0755) == 0 || errno == EEXIST) build_tree(path, depth - 1);
+		} else {
+			int fd = open(path, O_CREAT | O_WRONLY, 0644);
+			if (fd >= 0) close(fd);
+		}
+	}
+}
+
+/** lstat() every entry below dir; every lstat and readdir pass is one op. */
+static void walk_tree(worker *w, const char *dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	long start = now_ns();
+	DIR *d = opendir(dir);
+	if (!d) {
+		fail(w, "opendir");
+		return;
+	}
+	struct dirent *e;
+	char names[64][NAME_MAX + 1];
+	int n = 0;
+	while ((e = readdir(d)) != NULL && n < 64) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+		strcpy(names[n++], e->d_name);
+	}
+	closedir(d);
+	record(w, start);
+
+	for (int i = 0; i < n && !stop; i++) {
+		if (snprintf(path, sizeof(path), "%s/%s", dir, names[i]) >= (int)sizeof(path)) continue;
+		start = now_ns();
+		if (lstat(path, &st) < 0) {
+			fail(w, "lstat");
+			return;
+		}
+		record(w, start);
+		if (S_ISDIR(st.st_mode)) walk_tree(w, path);
+	}
+}
+
+static void run_tree(worker *w)
+{
+	char root[PATH_MAX];
+	snprintf(root, sizeof(root), "%s/tree", opts.dir);
+	while (!stop) walk_tree(w, root);
+}
+
+/** Append records to a private log, starting over when it reaches -s. */
+static void run_append(worker *w)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/log%d", opts.dir, w->id);
+
+	while (!stop) {
+		int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0644);
+		if (fd < 0) {
+			fail(w, "open");
+			return;
+		}
+		for (size_t size = 0; size + opts.bs <= opts.file_size && !stop; size += opts.bs) {
+			long start = now_ns();
+			if (write(fd, w->buf, opts.bs) < 0) {
+				fail(w, "write");
+				break;
+			}
+			record(w, start);
+			w->bytes += opts.bs;
+		}
+		close(fd);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	worker *w = arg;
+	if (is_workload("create")) {
+		run_create(w);
+	} else if (is_workload("tree")) {
+		run_tree(w);
+	} else if (is_workload("append")) {
+		run_append(w);
+	} else {
+		run_block_io(w);
+	}
+	return NULL;
+}
+
+
+/** Create (or fill) the file of every job before the timed part starts. */
+static int prepare_files(int *fds)
+{
+	char *buf = malloc(opts.bs);
+	if (!buf) return -1;
+	memset(buf, 'a', opts.bs);
+
+	for (int j = 0; j < opts.jobs; j++) {
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/job%d", opts.dir, j);
+		fds[j] = open(path, O_CREAT | O_RDWR, 0644);
+		if (fds[j] < 0) {
+			perror(path);
+			free(buf);
+			return -1;
+		}
+		struct stat st;
+		if (fstat(fds[j], &st) == 0 && (size_t)st.st_size >= opts.file_size) continue;
+		for (size_t off = 0; off < opts.file_size; off += opts.bs) {
+			if (pwrite(fds[j], buf, opts.bs, off) < 0) {
+				perror("pwrite");
+				free(buf);
+				return -1;
+			}
+		}
+		fsync(fds[j]);
+	}
+	free(buf);
+	return 0;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile_us(const long *lat, size_t n, double p)
+{
+	if (n == 0) return 0.0;
+	size_t i = (size_t)(p * (n - 1));
+	return lat[i] / 1000.0;
+}
+
+static void report(FILE *out, worker *workers, int nworkers, long ns)
+{
+	size_t n = 0, bytes = 0;
+	for (int i = 0; i < nworkers; i++) {
+		n += workers[i].nlat;
+		bytes += workers[i].bytes;
+	}
+	long *all = malloc((n ? n : 1) * sizeof(long));
+	if (!all) {
+		perror("malloc");
+		return;
+	}
+	size_t k = 0;
+	for (int i = 0; i < nworkers; i++) {
+		memcpy(all + k, workers[i].lat, workers[i].nlat * sizeof(long));
+		k += workers[i].nlat;
+	}
+	qsort(all, n, sizeof(long), cmp_long);
+
+	double secs = ns / 1e9;
+	fprintf(out, "{\"workload\":\"%s\",\"jobs\":%d,\"qd\":%d,\"bs\":%zu,"
+	        "\"ops\":%zu,\"secs\":%.3f,\"iops\":%.1f,\"mb_per_sec\":%.2f,"
+	        "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f}\n",
+	        opts.workload, opts.jobs, opts.depth, opts.bs, n, secs,
+	        n / secs, bytes / secs / (1 << 20),
+	        percentile_us(all, n, 0.50), percentile_us(all, n, 0.99),
+	        percentile_us(all, n, 0.999));
+	fflush(out);
+	free(all);
+}
+
+
+static void print_usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s -w workload -D dir [-j jobs] [-q depth] [-b bs]\n"
+	        "          [-s file_kb] [-n files] [-t secs] [-o out]\n"
+	        "  -w  seqread|seqwrite|randread|randwrite|create|tree|append\n"
+	        "  -D  directory to run in (the mount point)\n"
+	        "  -j  number of jobs (default: 1)\n"
+	        "  -q  requests in flight per job for block I/O (default: 1)\n"
+	        "  -b  block/record size in bytes (default: 4096)\n"
+	        "  -s  file size per job in KiB (default: 16384)\n"
+	        "  -n  files per directory for create (default: 12)\n"
+	        "  -t  run time in seconds (default: 10)\n"
+	        "  -o  append results to out (default: stdout)\n", progname);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "w:D:j:q:b:s:n:t:o:h")) != -1) {
+		switch (opt) {
+			case 'w': opts.workload = optarg; break;
+			case 'D': opts.dir = optarg; break;
+			case 'j': opts.jobs = atoi(optarg); break;
+			case 'q': opts.depth = atoi(optarg); break;
+			case 'b': opts.bs = strtoul(optarg, NULL, 10); break;
+			case 's': opts.file_size = strtoul(optarg, NULL, 10) << 10; break;
+			case 'n': opts.files = atoi(optarg); break;
+			case 't': opts.secs = atoi(optarg); break;
+			case 'o': out_path = optarg; break;
+			default:
+				print_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if (!opts.workload || !opts.dir || opts.jobs <= 0 || opts.depth <= 0 ||
+	    opts.bs == 0 || opts.file_size < opts.bs || opts.files <= 0 || opts.secs <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+	bool block_io = is_workload("seqread") || is_workload("seqwrite") ||
+	                is_workload("randread") || is_workload("randwrite");
+	if (!block_io && !is_workload("create") && !is_workload("tree") && !is_workload("append")) {
+		fprintf(stderr, "unknown workload: %s\n", opts.workload);
+		return 1;
+	}
+
+	FILE *out = out_path ? fopen(out_path, "a") : stdout;
+	if (!out) {
+		perror(out_path);
+		return 1;
+	}
+
+	int fds[opts.jobs];
+	size_t seq_off[opts.jobs];
+	memset(seq_off, 0, sizeof(seq_off));
+	if (block_io && prepare_files(fds) < 0) return 1;
+	if (is_workload("tree")) {
+		char root[PATH_MAX];
+		snprintf(root, sizeof(root), "%s/tree", opts.dir);
+		mkdir(root, 0755);
+		build_tree(root, opts.tree_depth);
+	}
+
+	//queue depth only applies to block I/O, the other workloads run one worker per job
+	int nworkers = opts.jobs * (block_io ? opts.depth : 1);
+	worker *workers = calloc(nworkers, sizeof(worker));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	long start = now_ns();
+	for (int i = 0; i < nworkers; i++) {
+		worker *w = &workers[i];
+		w->id = i;
+		w->job = block_io ? i / opts.depth : i;
+		w->fd = block_io ? fds[w->job] : -1;
+		w->seq_off = &seq_off[w->job];
+		w->seed = 369 + i;
+		w->buf = malloc(opts.bs);
+		if (!w->buf) {
+			perror("malloc");
+			return 1;
+		}
+		memset(w->buf, 'a' + i % 26, opts.bs);
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+
+	long deadline = start + opts.secs * 1000000000L;
+	while (!stop && now_ns() < deadline) usleep(10000);
+	stop = true;
+
+	int ret = 0;
+	for (int i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].error) ret = 1;
+	}
+	report(out, workers, nworkers, now_ns() - start);
+
+	for (int i = 0; i < nworkers; i++) {
+		free(workers[i].lat);
+		free(workers[i].buf);
+	}
+	free(workers);
+	if (block_io) {
+		for (int j = 0; j < opts.jobs; j++) close(fds[j]);
+	}
+	if (out != stdout) fclose(out);
+	return ret;
+}
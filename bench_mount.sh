@@ -0,0 +1,128 @@
+#!/bin/bash
+#
+# End-to-end a1fs benchmark through a FUSE mount.
+#
+# For every workload: format a scratch image with mkfs.a1fs, mount it with the
+# a1fs daemon, run a1fs_workload on the mount point and unmount. Results are
+# appended to the output file as JSON lines (one per workload).
+#
+# With -c the results are compared against a previous output file and the
+# script exits with status 2 if any workload lost more than -T percent of its
+# IOPS, so it can gate performance changes:
+#
+#   ./bench_mount.sh -o before.json
+#   (apply the change, rebuild)
+#   ./bench_mount.sh -o after.json -c before.json
+#
+# Needs a Linux box with FUSE (/dev/fuse and fusermount).
+
+set -u
+
+BIN=$(dirname "$0")
+SIZE_MB=256
+INODES=1024
+JOBS=4
+DEPTH=1
+BS=4096
+FILE_KB=8192
+SECS=10
+OUT=bench_output.txt
+BASELINE=
+TOLERANCE=5
+WORKLOADS="seqwrite seqread randread randwrite create tree append"
+SCRATCH=$(mktemp -d /tmp/a1fs_bench.XXXXXX)
+
+usage() {
+	cat <<EOF
+Usage: $0 [-s size_mb] [-i inodes] [-j jobs] [-q depth] [-b bs] [-f file_kb]
+          [-t secs] [-w "workloads"] [-o out] [-c baseline] [-T percent]
+  -s  image size in MiB (default: $SIZE_MB)
+  -i  number of inodes (default: $INODES)
+  -j  jobs, -q requests in flight per job, -b block size,
+      -f file size per job in KiB, -t seconds per workload
+  -w  workloads to run (default: "$WORKLOADS")
+  -o  output file (default: $OUT)
+  -c  baseline output to compare against
+  -T  allowed IOPS regression in percent (default: $TOLERANCE)
+EOF
+}
+
+while getopts "s:i:j:q:b:f:t:w:o:c:T:h" opt; do
+	case $opt in
+		s) SIZE_MB=$OPTARG ;;
+		i) INODES=$OPTARG ;;
+		j) JOBS=$OPTARG ;;
+		q) DEPTH=$OPTARG ;;
+		b) BS=$OPTARG ;;
+		f) FILE_KB=$OPTARG ;;
+		t) SECS=$OPTARG ;;
+		w) WORKLOADS=$OPTARG ;;
+		o) OUT=$OPTARG ;;
+		c) BASELINE=$OPTARG ;;
+		T) TOLERANCE=$OPTARG ;;
+		h) usage; exit 0 ;;
+		*) usage; exit 1 ;;
+	esac
+done
+
+IMAGE=$SCRATCH/image
+MNT=$SCRATCH/mnt
+mkdir -p "$MNT"
+
+cleanup() {
+	fusermount -u "$MNT" 2>/dev/null
+	rm -rf "$SCRATCH"
+}
+trap cleanup EXIT
+
+mount_fresh() {
+	rm -f "$IMAGE"
+	truncate -s "${SIZE_MB}M" "$IMAGE" || return 1
+	"$BIN/mkfs.a1fs" -f -i "$INODES" "$IMAGE" > /dev/null || return 1
+	# -s: the daemon serves one request at a time, the operations are not
+	# thread safe; the workload's threads still keep it busy
+	"$BIN/a1fs" "$IMAGE" "$MNT" -s > "$SCRATCH/a1fs.log" 2>&1 || return 1
+	for _ in $(seq 50); do
+		mountpoint -q "$MNT" && return 0
+		sleep 0.1
+	done
+	return 1
+}
+
+: > "$OUT"
+status=0
+for w in $WORKLOADS; do
+	if ! mount_fresh; then
+		echo "failed to mount a fresh image for $w" >&2
+		exit 1
+	fi
+	"$BIN/a1fs_workload" -w "$w" -D "$MNT" -j "$JOBS" -q "$DEPTH" -b "$BS" \
+		-s "$FILE_KB" -t "$SECS" -o "$OUT" || status=1
+	fusermount -u "$MNT"
+done
+cat "$OUT"
+
+if [ -n "$BASELINE" ]; then
+	# compare the iops of each workload with the baseline
+	awk -v tol="$TOLERANCE" '
+		function field(line, name,   m) {
+			if (match(line, "\"" name "\":[^,}]*")) {
+				m = substr(line, RSTART, RLENGTH)
+				sub("^\"" name "\":\"?", "", m)
+				sub("\"$", "", m)
+				return m
+			}
+			return ""
+		}
+		FNR == NR { base[field($0, "workload")] = field($0, "iops"); next }
+		{
+			w = field($0, "workload"); now = field($0, "iops")
+			if (!(w in base) || base[w] == 0) next
+			change = (now - base[w]) * 100 / base[w]
+			printf "%-10s %12.1f -> %12.1f iops (%+.1f%%)\n", w, base[w], now, change
+			if (change < -tol) bad = 1
+		}
+		END { exit bad ? 2 : 0 }
+	' "$BASELINE" "$OUT" || status=2
+fi
+exit $status
@@ -12,12 +12,15 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 	fs->first_data_block = sb->s_first_data_block;
 	fs->inode_num = sb->inode_num;
 	fs->free_inum = sb->free_inum;
-	fs->block_num = sb->block_num;
-	fs->free_bnum = sb->free_bnum;
+	fs->block_num = a1fs_sb_blocks(sb);
+	fs->free_bnum = a1fs_sb_free_blocks(sb);
+	//the counts in the superblock are only written at unmount, after a crash they are wrong
+	fs->counts_stale = true;
 	fs->block_size = sb->block_size;
 	fs->inode_size = sb->inode_size;
 	fs->extent_size = sb->extent_size;
 	fs->dentry_size = sb->dentry_size;
+	fs->inode_hint = 0;
 	fs->sid = sb->magic;
 	fs->help = sb->help;		
 	fs->force = sb->force;
@@ -26,10 +29,40 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 	 	printf("magic not match\n");
 		return false;
 	}
+	if(sb->features & ~A1FS_FEATURES_KNOWN){
+		printf("unknown features %x\n", sb->features & ~A1FS_FEATURES_KNOWN);
+		return false;
+	}
+	//every size is a power of two, everything after this works in shifts
+	if(fs->block_size<A1FS_MIN_BLOCK_SIZE || fs->block_size>A1FS_MAX_BLOCK_SIZE ||
+	   (fs->block_size & (fs->block_size-1)) || fs->dentry_size!=sizeof(struct a1fs_dentry)){
+		printf("bad block size %d\n", fs->block_size);
+		return false;
+	}
+	fs->block_shift = __builtin_ctz(fs->block_size);
+	fs->block_mask = fs->block_size-1;
+	fs->dentry_shift = fs->block_shift-__builtin_ctz(fs->dentry_size);
+	fs->itable_blocks = fs->first_data_block-fs->inode_table;
+	fs->itable_zeroed = fs->itable_blocks;
+	if((sb->features & A1FS_FEATURE_LAZY_ITABLE) && sb->itable_zeroed<fs->itable_blocks){
+		fs->itable_zeroed = sb->itable_zeroed;
+	}
+	fs->itable_running = false;
+	pthread_mutex_init(&fs->itable_lock, NULL);
+	fs->refs = NULL;
+	fs->listings = NULL;
+	fs->listings_n = 0;
+	fs->refs_n = 0;
+	fs->refs_loaded = false;
+	fs->zgen = 0;
+	fs->zcache.data = NULL;
+	fs->zcache.start = 0;
+	fs->compressed_clusters = 0;
+	fs->compressed_saved = 0;
 	return true;
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	(void)fs;
+	pthread_mutex_destroy(&fs->itable_lock);
 }
@@ -1,4 +1,17 @@
 
+#include <pthread.h>
+#include <time.h>
+
+/** A compressed cluster decompressed by a read, kept for the reads of the rest of it. */
+typedef struct a1fs_zcache {
+	/** The data of the cluster, NULL until the first read of a compressed cluster. */
+	char *data;
+	/** First block of the cluster's extent in the image, 0 when nothing is cached. */
+	uint64_t start;
+	/** fs_ctx zgen when it was decompressed. */
+	uint64_t gen;
+} a1fs_zcache;
+
 typedef struct fs_ctx {
 	/** Pointer to the start of the image. */
 	void *image;
@@ -20,11 +33,18 @@ typedef struct fs_ctx {
 	// free inode number
 	int free_inum;
 	// number of blocks stored
-	int block_num;
-	// free block number
-	int free_bnum;
-	// block size (A1FS_BLOCK_SIZE)
+	uint64_t block_num;
+	// free block number, recounted from the bitmap when counts_stale is set
+	uint64_t free_bnum;
+	// an operation changed the bitmaps, free_inum and free_bnum need a recount
+	bool counts_stale;
+	// block size, from the superblock
 	int block_size;
+	// log2 of block_size and block_size - 1, so block arithmetic on the hot paths is shifts and masks
+	int block_shift;
+	uint64_t block_mask;
+	// log2 of the number of dentries in a block
+	int dentry_shift;
 	// inode size
 	int inode_size;
 	// extent size
@@ -33,6 +53,63 @@ typedef struct fs_ctx {
 	int dentry_size;
 	// magic
 	unsigned long sid;
+	// the image is mapped read-only (-o ro), every modifying operation fails
+	bool read_only;
+	// data blocks mapped on demand (-o window), NULL when the whole image is mapped
+	struct image_windows *windows;
+	// mapping tuning from the mount options, applied once the daemon runs
+	bool hugepage;
+	bool mlock_meta;
+	bool prefault;
+	// background thread that faults in the metadata and directories after mount
+	pthread_t prefault_thread;
+	bool prefault_running;
+	volatile bool prefault_stop;
+	// largest readahead window in bytes (-o readahead), 0 disables readahead
+	size_t ra_max;
+	// inode table blocks, and how many of them have been zeroed (all of them unless mkfs -F left it to us).
+	// inodes past the zeroed blocks are never in use; itable_lock guards the count
+	uint64_t itable_blocks;
+	uint64_t itable_zeroed;
+	pthread_mutex_t itable_lock;
+	// background thread that zeroes the rest of a lazily formatted inode table
+	pthread_t itable_thread;
+	bool itable_running;
+	volatile bool itable_stop;
+	// freed blocks are punched out of discard_fd (-o discard), queued when discard_batch is
+	// the number of seconds between batches (-o discard_batch)
+	bool discard;
+	int discard_fd;
+	unsigned long discard_batch;
+	struct discard_range *discard_q;
+	size_t discard_n, discard_cap;
+	// CLOCK_MONOTONIC seconds of the last batch, and blocks punched since mount
+	time_t discard_last;
+	uint64_t discarded;
+	// -o defrag=SEC: every SEC seconds an operation first defragments the next fragmented file,
+	// the scan goes on from defrag_next
+	unsigned long defrag_secs;
+	time_t defrag_last;
+	int defrag_next;
+	// files defragmented since mount, and their extents before and after
+	uint64_t defrag_files, defrag_before, defrag_after;
+	// the reference count table of shared blocks, read from the image on first use (refs_loaded)
+	struct a1fs_ref *refs;
+	size_t refs_n;
+	bool refs_loaded;
+	// -o compress=DIR: the directory gets A1FS_INODE_COMPRESS once the daemon runs
+	const char *compress_dir;
+	// bumped whenever a cluster is compressed: the blocks of a cached cluster may have been reused
+	uint64_t zgen;
+	// the cluster decompressed by the last read without an open file
+	a1fs_zcache zcache;
+	// clusters compressed since mount, and the blocks that saved
+	uint64_t compressed_clusters, compressed_saved;
+	// directories with a listing open (opendir without releasedir yet), they are not compacted
+	struct a1fs_listing *listings;
+	size_t listings_n;
+	// where the inode search continues once the parent's group is full, one past the last inode allocated
+	int inode_hint;
 	// command line options from mkfs_opts
 	bool help;
 	bool force;
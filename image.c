@@ -0,0 +1,236 @@
+/**
+ * a1fs image mapping.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+#include "image.h"
+
+
+void *map_file_ro(const char *path, size_t block_size, size_t *size)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size == 0 || st.st_size % block_size != 0) {
+		fprintf(stderr, "%s: image size is not a multiple of %zu\n", path, block_size);
+		close(fd);
+		return NULL;
+	}
+
+	void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping stays valid after the descriptor is closed
+	close(fd);
+	if (image == MAP_FAILED) {
+		perror("mmap");
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return image;
+}
+
+bool image_punch(int fd, uint64_t off, uint64_t len)
+{
+	if (len == 0) return true;
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len) == 0;
+}
+
+void image_prefault(void *addr, size_t len, volatile bool *stop)
+{
+	madvise(addr, len, MADV_WILLNEED);
+	long page = sysconf(_SC_PAGESIZE);
+	volatile const char *p = addr;
+	for (size_t i = 0; i < len; i += page) {
+		if (stop && *stop) return;
+		(void)p[i];
+	}
+}
+
+
+image_windows *image_windows_open(const char *path, bool read_only,
+                                  size_t window_size, size_t max_resident,
+                                  size_t *size)
+{
+	int fd = open(path, read_only ? O_RDONLY : O_RDWR);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	if (st.st_size < A1FS_MIN_BLOCK_SIZE || st.st_size % A1FS_MIN_BLOCK_SIZE != 0) {
+		fprintf(stderr, "%s: image size is not a multiple of %d\n", path, A1FS_MIN_BLOCK_SIZE);
+		close(fd);
+		return NULL;
+	}
+	int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+
+	// Read the superblock to find out how much of the image is metadata
+	struct a1fs_superblock sb;
+	if (pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+	if (sb.magic != A1FS_MAGIC || sb.s_first_data_block == 0 ||
+	    sb.block_size < A1FS_MIN_BLOCK_SIZE || sb.block_size > A1FS_MAX_BLOCK_SIZE ||
+	    (off_t)sb.s_first_data_block * sb.block_size > st.st_size)
+	{
+		fprintf(stderr, "%s: not an a1fs image\n", path);
+		close(fd);
+		return NULL;
+	}
+	//windows are mapped at multiples of the window size, which has to suit both mmap and the blocks
+	size_t align = sysconf(_SC_PAGESIZE) > sb.block_size ? (size_t)sysconf(_SC_PAGESIZE) : (size_t)sb.block_size;
+	if (window_size == 0 || window_size % align != 0) {
+		fprintf(stderr, "window size must be a multiple of %zu\n", align);
+		close(fd);
+		return NULL;
+	}
+
+	image_windows *w = calloc(1, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+	w->fd = fd;
+	w->prot = prot;
+	w->size = st.st_size;
+	w->block_size = sb.block_size;
+	w->meta_blocks = sb.s_first_data_block;
+	w->window_blocks = window_size / w->block_size;
+	w->n_windows = (w->size / w->block_size + w->window_blocks - 1) / w->window_blocks;
+	w->max_resident = max_resident > 0 ? max_resident : 1;
+	w->lru_head = w->lru_tail = w->last = -1;
+
+	w->table = calloc(w->n_windows, sizeof(image_window));
+	if (!w->table) {
+		perror("calloc");
+		close(fd);
+		free(w);
+		return NULL;
+	}
+	w->meta = mmap(NULL, (size_t)w->meta_blocks * w->block_size, prot, MAP_SHARED, fd, 0);
+	if (w->meta == MAP_FAILED) {
+		perror("mmap");
+		close(fd);
+		free(w->table);
+		free(w);
+		return NULL;
+	}
+
+	*size = w->size;
+	return w;
+}
+
+/** Length of window i; the last window may be shorter than the others. */
+static size_t window_len(image_windows *w, long i)
+{
+	size_t start = (size_t)i * w->window_blocks * w->block_size;
+	size_t len = w->window_blocks * w->block_size;
+	if (start + len > w->size) len = w->size - start;
+	return len;
+}
+
+/** Remove window i from the LRU list. */
+static void lru_unlink(image_windows *w, long i)
+{
+	image_window *win = &w->table[i];
+	if (win->prev >= 0) w->table[win->prev].next = win->next;
+	else w->lru_head = win->next;
+	if (win->next >= 0) w->table[win->next].prev = win->prev;
+	else w->lru_tail = win->prev;
+}
+
+/** Put window i at the head (most recently used end) of the LRU list. */
+static void lru_push(image_windows *w, long i)
+{
+	image_window *win = &w->table[i];
+	win->prev = -1;
+	win->next = w->lru_head;
+	if (w->lru_head >= 0) w->table[w->lru_head].prev = i;
+	w->lru_head = i;
+	if (w->lru_tail < 0) w->lru_tail = i;
+}
+
+/** Unmap the least recently used windows until there is room for one more. */
+static void evict(image_windows *w)
+{
+	while (w->resident >= w->max_resident && w->lru_tail >= 0) {
+		long i = w->lru_tail;
+		image_window *win = &w->table[i];
+		// The list is in order of use, so everything else is in use as well
+		if (win->last_op == w->op) break;
+		lru_unlink(w, i);
+		munmap(win->addr, window_len(w, i));
+		win->addr = NULL;
+		w->resident--;
+	}
+}
+
+void *image_window_get(image_windows *w, size_t block)
+{
+	if (block >= w->size / w->block_size) return NULL;
+	long i = block / w->window_blocks;
+	size_t offset = (block % w->window_blocks) * w->block_size;
+	image_window *win = &w->table[i];
+
+	if (i == w->last) {
+		win->last_op = w->op;
+		return win->addr + offset;
+	}
+
+	if (win->addr) {
+		lru_unlink(w, i);
+	} else {
+		evict(w);
+		off_t start = (off_t)i * w->window_blocks * w->block_size;
+		void *addr = mmap(NULL, window_len(w, i), w->prot, MAP_SHARED, w->fd, start);
+		if (addr == MAP_FAILED) {
+			perror("mmap");
+			return NULL;
+		}
+		if (w->hugepage) madvise(addr, window_len(w, i), MADV_HUGEPAGE);
+		win->addr = addr;
+		w->resident++;
+	}
+	lru_push(w, i);
+	win->last_op = w->op;
+	w->last = i;
+	return win->addr + offset;
+}
+
+void image_windows_close(image_windows *w)
+{
+	for (size_t i = 0; i < w->n_windows; i++) {
+		if (w->table[i].addr) munmap(w->table[i].addr, window_len(w, i));
+	}
+	munmap(w->meta, (size_t)w->meta_blocks * w->block_size);
+	close(w->fd);
+	free(w->table);
+	free(w);
+}
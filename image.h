@@ -0,0 +1,145 @@
+/**
+ * a1fs image mapping.
+ *
+ * map_file() in map.c maps an image read-write for the daemon and mkfs. The
+ * helpers here cover the other ways the daemon can map an image.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Map an image file read-only.
+ *
+ * The file is opened O_RDONLY and mapped PROT_READ/MAP_SHARED, so it can be a
+ * read-only file and any number of processes can map it at the same time
+ * without copying or dirtying a single page.
+ *
+ * @param path        path to the image file.
+ * @param block_size  the image size must be a multiple of this.
+ * @param size        pointer to the variable that receives the image size.
+ * @return            pointer to the mapped image; NULL on failure.
+ */
+void *map_file_ro(const char *path, size_t block_size, size_t *size);
+
+/**
+ * Give a byte range of the image file back to the host.
+ *
+ * Punches a hole with fallocate(FALLOC_FL_PUNCH_HOLE), so the range takes no
+ * space in a sparse image and reads back as zeros, also through a shared
+ * mapping of the file. Dirty pages of the range are dropped, not written back.
+ *
+ * @param fd   the image file, open for writing.
+ * @param off  start of the range in bytes.
+ * @param len  length of the range in bytes.
+ * @return     true on success; false if the file system under the image
+ *             doesn't support it.
+ */
+bool image_punch(int fd, uint64_t off, uint64_t len);
+
+/**
+ * Fault in a range of a mapping.
+ *
+ * Starts readahead with MADV_WILLNEED and then reads a byte of every page, so
+ * the range is resident once this returns.
+ *
+ * @param addr  start of the range, page aligned.
+ * @param len   length of the range in bytes.
+ * @param stop  when not NULL, give up as soon as *stop becomes true.
+ */
+void image_prefault(void *addr, size_t len, volatile bool *stop);
+
+/** One fixed-size region of the image in the window table. */
+typedef struct image_window {
+	/** Mapping of the region; NULL when it is not resident. */
+	void *addr;
+	/** Operation number of the last lookup. */
+	uint64_t last_op;
+	/** Neighbours in the LRU list of resident windows, -1 at the ends. */
+	long prev, next;
+} image_window;
+
+/**
+ * An image mapped in windows.
+ *
+ * The metadata blocks (superblock, bitmaps, inode table) are mapped once and
+ * stay pinned; the data blocks are mapped a window at a time when getpointer()
+ * first touches them. Once more than max_resident windows are mapped, the least
+ * recently used one is unmapped, except that a window used by the running
+ * operation is never unmapped (pointers into it may still be live).
+ */
+typedef struct image_windows {
+	/** The image file, kept open to map windows. */
+	int fd;
+	/** PROT_READ, or PROT_READ | PROT_WRITE. */
+	int prot;
+	/** Image size in bytes. */
+	size_t size;
+	/** Pinned mapping of blocks [0, meta_blocks). */
+	void *meta;
+	/** Block size of the image, from its superblock. */
+	size_t block_size;
+	/** Number of metadata blocks (the first data block). */
+	unsigned int meta_blocks;
+	/** Window size in blocks. */
+	size_t window_blocks;
+	/** The chunk table, one entry per window of the image. */
+	image_window *table;
+	size_t n_windows;
+	/** Number of windows currently mapped, and the bound on it. */
+	size_t resident;
+	size_t max_resident;
+	/** Most and least recently used resident windows, -1 if none. */
+	long lru_head, lru_tail;
+	/** Number of the running operation. */
+	uint64_t op;
+	/** The last window looked up (always the LRU head), -1 if none. */
+	long last;
+	/** madvise(MADV_HUGEPAGE) every window as it is mapped. */
+	bool hugepage;
+} image_windows;
+
+/**
+ * Map an image in windows.
+ *
+ * @param path          path to the image file.
+ * @param read_only     map the image PROT_READ (see map_file_ro()).
+ * @param window_size   window size in bytes; a multiple of the block size.
+ * @param max_resident  bound on the number of data windows mapped at once.
+ * @param size          pointer to the variable that receives the image size.
+ * @return              the window table (its meta field is the pinned start of
+ *                      the image); NULL on failure.
+ */
+image_windows *image_windows_open(const char *path, bool read_only,
+                                  size_t window_size, size_t max_resident,
+                                  size_t *size);
+
+/** Unmap every window and the metadata, and close the image. */
+void image_windows_close(image_windows *w);
+
+/**
+ * Get a pointer to a data block, mapping its window if needed.
+ *
+ * The pointer is valid up to the end of the block's window and until the end
+ * of the next operation (see image_windows_begin_op()).
+ *
+ * @param w      the window table.
+ * @param block  block number, at least w->meta_blocks.
+ * @return       pointer to the block; NULL if it is past the end of the image
+ *               or its window can't be mapped.
+ */
+void *image_window_get(image_windows *w, size_t block);
+
+/**
+ * Mark the start of a file system operation.
+ *
+ * Windows used before this call may be unmapped again by later lookups.
+ */
+static inline void image_windows_begin_op(image_windows *w)
+{
+	w->op++;
+}
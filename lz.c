@@ -0,0 +1,136 @@
+/**
+ * LZ77 codec for compressed extents.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+
+/** The hash table has 2^LZ_HASH_BITS positions, 16 KiB on the stack. */
+#define LZ_HASH_BITS 12
+/** Farthest a match can be, the distance is stored in two bytes. */
+#define LZ_MAX_DIST 65535
+
+static uint32_t lz_hash(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//the length bytes that follow a nibble of 15. NULL if they don't fit
+static uint8_t *lz_put_len(uint8_t *op, uint8_t *oend, size_t len)
+{
+	len -= 15;
+	while (len >= 255) {
+		if (op == oend) return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op == oend) return NULL;
+	*op++ = len;
+	return op;
+}
+
+//one sequence: nlit literals, then a match of mlen bytes dist back (none if mlen is 0)
+static uint8_t *lz_put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                                size_t dist, size_t mlen)
+{
+	if (op == oend) return NULL;
+	uint8_t *token = op++;
+	*token = (nlit < 15 ? nlit : 15) << 4;
+	if (nlit >= 15 && !(op = lz_put_len(op, oend, nlit))) return NULL;
+	if ((size_t)(oend - op) < nlit) return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+	if (mlen == 0) return op;
+
+	mlen -= LZ_MIN_MATCH;
+	*token |= mlen < 15 ? mlen : 15;
+	if (oend - op < 2) return NULL;
+	*op++ = dist & 0xff;
+	*op++ = dist >> 8;
+	if (mlen >= 15 && !(op = lz_put_len(op, oend, mlen))) return NULL;
+	return op;
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const uint8_t *in = src, *ip = in, *anchor = in, *iend = in + n;
+	uint8_t *op = dst, *oend = op + cap;
+	//positions of the last 4 bytes seen with each hash, a stale one is caught by the compare
+	uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	while (iend - ip >= LZ_MIN_MATCH) {
+		uint32_t h = lz_hash(ip);
+		const uint8_t *ref = in + table[h];
+		table[h] = ip - in;
+		if (ref >= ip || ip - ref > LZ_MAX_DIST || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+			ip++;
+			continue;
+		}
+		const uint8_t *mp = ip + LZ_MIN_MATCH, *rp = ref + LZ_MIN_MATCH;
+		while (mp < iend && *mp == *rp) {
+			mp++;
+			rp++;
+		}
+		op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref, mp - ip);
+		if (!op) return 0;
+		ip = anchor = mp;
+	}
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op) return 0;
+	return op - (uint8_t *)dst;
+}
+
+//add up the length bytes after a nibble of 15
+static bool lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+	do {
+		if (*ip == iend) return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return true;
+}
+
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *out = dst, *op = out, *oend = out + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t nlit = token >> 4;
+		if (nlit == 15 && !lz_get_len(&ip, iend, &nlit)) return -1;
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+		//the last sequence has no match
+		if (ip == iend) break;
+
+		if (iend - ip < 2) return -1;
+		size_t dist = ip[0] | (size_t)ip[1] << 8;
+		ip += 2;
+		size_t mlen = token & 15;
+		if (mlen == 15 && !lz_get_len(&ip, iend, &mlen)) return -1;
+		mlen += LZ_MIN_MATCH;
+		if (dist == 0 || dist > (size_t)(op - out) || (size_t)(oend - op) < mlen) return -1;
+
+		//a match can overlap the bytes it produces, a run of one byte repeated is the common case
+		const uint8_t *ref = op - dist;
+		if (dist >= mlen) memcpy(op, ref, mlen);
+		else if (dist == 1) memset(op, *ref, mlen);
+		else {
+			for (size_t i = 0; i < mlen; i++) op[i] = ref[i];
+		}
+		op += mlen;
+	}
+	return op - out;
+}
@@ -0,0 +1,45 @@
+/**
+ * LZ77 codec for compressed extents.
+ *
+ * The compressed data is a series of sequences, like an LZ4 block: a token
+ * byte with the length of a run of literals in the high nibble and the length
+ * of a match minus LZ_MIN_MATCH in the low nibble, the literals, the distance
+ * back to the match as two little-endian bytes. A nibble of 15 is followed by
+ * more length bytes (after the literals for the match), added up until one is
+ * less than 255. The last sequence has literals only.
+ *
+ * The compressor finds matches with a single hash table lookup per position,
+ * so it trades ratio for speed; the decompressor checks every length against
+ * both buffers, so a corrupt image can't make it write past the output.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+
+/** Shortest match the format can describe. */
+#define LZ_MIN_MATCH 4
+
+/**
+ * Compress a buffer.
+ *
+ * @param src  data to compress.
+ * @param n    bytes in src.
+ * @param dst  buffer that receives the compressed data.
+ * @param cap  bytes available in dst.
+ * @return     bytes of compressed data; 0 if they don't fit in cap.
+ */
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+/**
+ * Decompress a buffer.
+ *
+ * @param src  compressed data.
+ * @param n    bytes in src.
+ * @param dst  buffer that receives the data.
+ * @param cap  bytes available in dst.
+ * @return     bytes written to dst; -1 if src is not valid compressed data
+ *             or the data doesn't fit in cap.
+ */
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap);
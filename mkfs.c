@@ -1,3 +1,8 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+
 /** Determine if the image has already been formatted into a1fs. */
 static bool a1fs_is_present(void *image)
 {
@@ -10,12 +15,39 @@ static bool a1fs_is_present(void *image)
 	return true;
 }
 
-void *getpointer(void *image,int i){
-	return image+(A1FS_BLOCK_SIZE*i); 
+//block size of the image being formatted
+static size_t mkfs_block_size = A1FS_BLOCK_SIZE;
+
+//-F: fast format. the image file is open as mkfs_fd so that ranges can be zeroed by punching holes
+//instead of writing zeros, and the inode table is left for the daemon to zero if that doesn't work
+static bool mkfs_fast = false;
+static int mkfs_fd = -1;
+
+//-C: compression is on for the root, and so for every directory created in it
+static bool mkfs_compress = false;
+
+//zero len bytes at off in the image file without writing them. returns false if it can't be done
+//(not a fast format, or the file system under the image doesn't support it), then the caller memsets
+static bool punch_range(uint64_t off, uint64_t len){
+	if(mkfs_fd<0 || len==0) return mkfs_fd>=0;
+	if(fallocate(mkfs_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, off, len)==0) return true;
+	return fallocate(mkfs_fd, FALLOC_FL_ZERO_RANGE, off, len)==0;
+}
+
+static void zero_range(void *image, uint64_t off, uint64_t len){
+	if(!punch_range(off,len)) memset(image+off, 0, len);
+}
+
+static void *getpointer(void *image,uint64_t i){
+	return image+(mkfs_block_size*i); 
 }
 
+//the bitmaps are only printed up to this many bits, a big image has millions
+#define PRINTMAP_MAX 128
+
 //some helper functions that prints stuff
-void printmap(const char* bitmap,int size){
+static void printmap(const char* bitmap,int size){
+	if(size>PRINTMAP_MAX) size = PRINTMAP_MAX;
 	int count=0;
     while(count<size){
         unsigned char x = bitmap[count/8];
@@ -34,15 +66,15 @@ void printmap(const char* bitmap,int size){
 }
 
 //write to the ith place in the bitmap, assume that this place is in the bitmap.
-void writemap(char** bitmap,int i){
-	int count = i/8;
+static void writemap(char** bitmap,uint64_t i){
+	uint64_t count = i/8;
 	int count2 = i%8;
 	//printf("writing to the %d location of %d number\n",count2,count);
 	(*bitmap)[count]=((*bitmap)[count]|(1<<count2));
 }
 
 //print out information about the num-th inode in the inode table
-void printnode(struct a1fs_inode *inode_table, int num){
+static void printnode(struct a1fs_inode *inode_table, int num){
 	struct a1fs_inode* node = inode_table+(num*sizeof(struct a1fs_inode));
 	char type = (node->mode == 33188)?'f':'d'; 
 	//printf("mode:%hu \n",node->i_mode);
@@ -53,7 +85,7 @@ void printnode(struct a1fs_inode *inode_table, int num){
 }
 
 //print out the superblock or the context
-void printsb(struct a1fs_superblock* sb){
+static void printsb(struct a1fs_superblock* sb){
 	void *image = (void*)sb;
 	const char *ibitmap = (const char *)getpointer(image,sb->s_inode_bitmap);
 	const char *bbitmap = (const char *)getpointer(image,sb->s_blocks_bitmap);
@@ -67,9 +99,9 @@ void printsb(struct a1fs_superblock* sb){
 }
 
 //given a pointer, return the block of this pointer. used for debugging.
-int getblock(void* pt,void* image){
-	int offset = (int)(pt-image);
-	return offset/A1FS_BLOCK_SIZE;
+static uint64_t getblock(void* pt,void* image){
+	size_t offset = (size_t)(pt-image);
+	return offset/mkfs_block_size;
 }
 
 /**
@@ -77,15 +109,21 @@ int getblock(void* pt,void* image){
  *
  * NOTE: Must update mtime of the root directory.
  *
- * @param image  pointer to the start of the image.
- * @param size   image size in bytes.
- * @param opts   command line options.
- * @return       true on success;
- *               false on error, e.g. options are invalid for given image size.
+ * @param image       pointer to the start of the image.
+ * @param size        image size in bytes.
+ * @param opts        command line options.
+ * @param block_size  block size, a power of two in [A1FS_MIN_BLOCK_SIZE, A1FS_MAX_BLOCK_SIZE].
+ * @return            true on success;
+ *                    false on error, e.g. options are invalid for given image size.
  */
-static bool mkfs(void *image, size_t size, mkfs_opts *opts)
+static bool mkfs(void *image, size_t size, mkfs_opts *opts, size_t block_size)
 {	
-	if(size<4*A1FS_BLOCK_SIZE){
+	if(block_size<A1FS_MIN_BLOCK_SIZE || block_size>A1FS_MAX_BLOCK_SIZE || (block_size&(block_size-1))){
+		fprintf(stderr,"Block size must be a power of two from %d to %d\n",A1FS_MIN_BLOCK_SIZE,A1FS_MAX_BLOCK_SIZE);
+		return false;
+	}
+	mkfs_block_size = block_size;
+	if(size<4*block_size){
 		return false;	
 	}
 	//TODO: initialize the superblock and create an empty root directory
@@ -94,20 +132,25 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	//create the superblock
 	struct a1fs_superblock* sb = ((struct a1fs_superblock *)image);
 	
-	printf("get sb:%d\n", getblock((void*)sb,image));
-
-	//calculate the metadata
+	printf("get sb:%lu\n", (unsigned long)getblock((void*)sb,image));
+
+	//calculate the metadata. everything is counted in 64 bits, block numbers in extents are
+	//32 bits wide, and more blocks than an int holds need the 64-bit superblock counters
+	uint64_t blocks_num = size/block_size;
+	if(blocks_num>UINT32_MAX || opts->n_inodes>INT_MAX){
+		fprintf(stderr,"Image too large: at most %lu blocks and %d inodes\n",(unsigned long)UINT32_MAX,INT_MAX);
+		return false;
+	}
 	int inode_num = opts->n_inodes;
-	int blocks_num = size/A1FS_BLOCK_SIZE;
-	int ibitmap_blocks = inode_num/A1FS_BLOCK_SIZE;
-	if(inode_num%A1FS_BLOCK_SIZE!=0) ibitmap_blocks++;
-	int bbitmap_blocks = blocks_num/A1FS_BLOCK_SIZE;
-	if(blocks_num%A1FS_BLOCK_SIZE!=0) bbitmap_blocks++;
-	int inode_table_blocks = (opts->n_inodes * sizeof(struct a1fs_inode))/A1FS_BLOCK_SIZE;
-	if((opts->n_inodes * sizeof(struct a1fs_inode))%A1FS_BLOCK_SIZE!=0) inode_table_blocks++;
+	uint64_t bits_per_block = (uint64_t)block_size*8;
+	uint64_t ibitmap_blocks = ((uint64_t)inode_num+bits_per_block-1)/bits_per_block;
+	uint64_t bbitmap_blocks = (blocks_num+bits_per_block-1)/bits_per_block;
+	uint64_t inode_table_blocks = ((uint64_t)inode_num*sizeof(struct a1fs_inode)+block_size-1)/block_size;
+	//superblock, bitmaps, inode table, and the root's extent table and dentry block
+	if(1+ibitmap_blocks+bbitmap_blocks+inode_table_blocks+2>blocks_num) return false;
 
 	//reset the blocks, so that sb and both bitmaps are protected
-	memset(image, 0, (ibitmap_blocks+1+bbitmap_blocks)*A1FS_BLOCK_SIZE);
+	zero_range(image, 0, (ibitmap_blocks+1+bbitmap_blocks)*block_size);
 
 	//initialize the superblock
 	sb->magic = (uint64_t) A1FS_MAGIC;
@@ -119,21 +162,35 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 
 	
 	//the place where the metadata ends, used for writing bitmap.
-	int end = sb->s_first_data_block;
+	unsigned int end = sb->s_first_data_block;
+
+	//the inode table. a fast format that can't punch it out zeroes only the root's block and
+	//leaves the rest to the daemon (A1FS_FEATURE_LAZY_ITABLE)
+	uint64_t itable_off = (uint64_t)sb->s_inode_table*block_size;
+	if(!punch_range(itable_off, inode_table_blocks*block_size)){
+		if(mkfs_fast && inode_table_blocks>1){
+			memset(image+itable_off, 0, block_size);
+			sb->features |= A1FS_FEATURE_LAZY_ITABLE;
+			sb->itable_zeroed = 1;
+		}
+		else memset(image+itable_off, 0, (size_t)inode_table_blocks*block_size);
+	}
+	//and the root's extent table and dentry block
+	zero_range(image, (uint64_t)end*block_size, 2*(uint64_t)block_size);
 
 
 	//write the bitmaps
 	char* ibitmap = (char*) getpointer(image,sb->s_inode_bitmap);
 	char* bbitmap = (char*) getpointer(image,sb->s_blocks_bitmap);
 	writemap(&ibitmap,0);
-	for(int i=0;i<end;i++) writemap(&bbitmap,i);
+	for(unsigned int i=0;i<end;i++) writemap(&bbitmap,i);
 
 	//print the bitmaps
-	printf("get ibitmap:%d\n", getblock((void*)ibitmap,image));
+	printf("get ibitmap:%lu\n", (unsigned long)getblock((void*)ibitmap,image));
 	printf("printing ibitmap:\n");
 	printmap(ibitmap,inode_num);
 
-	printf("get bbitmap:%d\n", getblock((void*)bbitmap,image));
+	printf("get bbitmap:%lu\n", (unsigned long)getblock((void*)bbitmap,image));
 	printf("\n printing bbitmap:\n");
 	printmap(bbitmap,16);
 
@@ -142,10 +199,13 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	//printf("get rootnode:%d\n", getblock((void*)rootnode,image));
 	rootnode->mode = S_IFDIR | 0777; 
 	rootnode->links=2;
-	rootnode->size = A1FS_BLOCK_SIZE;
+	rootnode->size = block_size;
 	rootnode->a1fs_blocks = 1;
 	rootnode->a1fs_extent_table = sb->s_first_data_block;
 	rootnode->extent_num = 1;
+	rootnode->parent = 0;
+	rootnode->free_slot = 2;
+	rootnode->flags = mkfs_compress ? A1FS_INODE_COMPRESS : 0;
 	clock_gettime(CLOCK_REALTIME, &rootnode->mtime);
 	//create the contents in root
 	struct a1fs_extent* firstextent = (struct a1fs_extent *)getpointer(image,rootnode->a1fs_extent_table);
@@ -174,9 +234,18 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	//initialize the superblock
 	sb-> inode_num = inode_num;
 	sb-> free_inum = inode_num-1;
-	sb-> block_num = blocks_num;
-	sb-> free_bnum = blocks_num - (ibitmap_blocks+bbitmap_blocks+inode_table_blocks+1);
-	sb-> block_size = A1FS_BLOCK_SIZE;
+	//the metadata and the root's two blocks are in use
+	uint64_t free_bnum = blocks_num - (end+2);
+	if(blocks_num>INT_MAX){
+		sb-> features |= A1FS_FEATURE_64BIT;
+		sb-> block_num64 = blocks_num;
+		sb-> free_bnum64 = free_bnum;
+	}
+	else{
+		sb-> block_num = blocks_num;
+		sb-> free_bnum = free_bnum;
+	}
+	sb-> block_size = block_size;
 	sb-> inode_size = sizeof(struct a1fs_inode);
 	//printf("%d\n", sb->inode_size);
 	sb-> extent_size = sizeof(struct a1fs_extent);
@@ -191,9 +260,12 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	printnode(rootnode,0);
 
 	//print some messages
-	printf("Image size: %ld KB\n",sb->size/1024);
+	printf("Image size: %ld KB, %lu byte blocks\n",sb->size/1024,(unsigned long)block_size);
 	printf("Inodes: %d, %d reserved\n",inode_num, sb->inode_num-sb-> free_inum);
-	printf("Blocks: %d, %d reserved\n\n", blocks_num, blocks_num-sb-> free_bnum);
+	printf("Blocks: %lu, %lu reserved%s\n", (unsigned long)blocks_num, (unsigned long)(blocks_num-free_bnum),
+	       (sb->features & A1FS_FEATURE_64BIT) ? " (64-bit counters)" : "");
+	printf("Inode table: %lu blocks%s\n\n", (unsigned long)inode_table_blocks,
+	       (sb->features & A1FS_FEATURE_LAZY_ITABLE) ? ", zeroed after mount" : "");
 
 	//printf("Inode bitmap: [0,%d) (%d blocks)\n",ibitmap_blocks,ibitmap_blocks);
 	//printf("Block bitmap: [%d,%d) (%d blocks)\n",ibitmap_blocks,ibitmap_blocks+bbitmap_blocks,bbitmap_blocks);
@@ -203,24 +275,83 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	return true;
 }
 
+bool a1fs_format_bs(void *image, size_t size, size_t n_inodes, size_t block_size)
+{
+	mkfs_opts opts = {0};
+	opts.n_inodes = n_inodes;
+	return mkfs(image, size, &opts, block_size);
+}
+
+bool a1fs_format(void *image, size_t size, size_t n_inodes)
+{
+	return a1fs_format_bs(image, size, n_inodes, A1FS_BLOCK_SIZE);
+}
+
+//-b SIZE picks the block size, -F asks for a fast format and -C turns compression on. parse_args
+//doesn't know about them, so they are taken out of argv first.
+static bool take_extra_args(int *argc, char *argv[], size_t *block_size, bool *fast, bool *compress)
+{
+	for (int i = 1; i < *argc; i++) {
+		int n = 0;
+		if (strcmp(argv[i], "-F") == 0) {
+			*fast = true;
+			n = 1;
+		}
+		else if (strcmp(argv[i], "-C") == 0) {
+			*compress = true;
+			n = 1;
+		}
+		else if (strcmp(argv[i], "-b") == 0) {
+			if (i + 1 >= *argc) return false;
+			char *end;
+			*block_size = strtoul(argv[i + 1], &end, 10);
+			if (*end != '\0') return false;
+			n = 2;
+		}
+		else continue;
+		//shift the rest down over the option, argv[argc] (NULL) included
+		memmove(&argv[i], &argv[i + n], (*argc - i - n + 1) * sizeof(char *));
+		*argc -= n;
+		i--;
+	}
+	return true;
+}
+
+static void print_extra_help(FILE *f)
+{
+	fprintf(f, "    -b size   block size, a power of two from %d to %d (default %d)\n",
+	        A1FS_MIN_BLOCK_SIZE, A1FS_MAX_BLOCK_SIZE, A1FS_BLOCK_SIZE);
+	fprintf(f, "    -F        fast format: punch holes instead of writing zeros, zero the\n"
+	           "              inode table in the background after mount if that fails\n");
+	fprintf(f, "    -C        compress the data of every file (see -o compress=DIR)\n");
+}
+
+//the benchmarks link the formatter in, so they build this file with MKFS_NO_MAIN
+//which keeps the command line code but moves it out of the way of their main()
+#ifdef MKFS_NO_MAIN
+#define main mkfs_main
+#endif
 
 int main(int argc, char *argv[])
 {
 	mkfs_opts opts = {0};// defaults are all 0
-	if (!parse_args(argc, argv, &opts)) {
+	size_t block_size = A1FS_BLOCK_SIZE;
+	if (!take_extra_args(&argc, argv, &block_size, &mkfs_fast, &mkfs_compress) || !parse_args(argc, argv, &opts)) {
 		// Invalid arguments, print help to stderr
 		print_help(stderr, argv[0]);
+		print_extra_help(stderr);
 		return 1;
 	}
 	if (opts.help) {
 		// Help requested, print it to stdout
 		print_help(stdout, argv[0]);
+		print_extra_help(stdout);
 		return 0;
 	}
 
-	// Map image file into memory
+	// Map image file into memory, the tail past the last whole block is left alone
 	size_t size;
-	void *image = map_file(opts.img_path, A1FS_BLOCK_SIZE, &size);
+	void *image = map_file(opts.img_path, A1FS_MIN_BLOCK_SIZE, &size);
 	if (image == NULL) return 1;
 
 	// Check if overwriting existing file system
@@ -230,14 +361,24 @@ int main(int argc, char *argv[])
 		goto end;
 	}
 
-	if (opts.zero) memset(image, 0, size);
-	if (!mkfs(image, size, &opts)) {
+	struct timespec start, finish;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (mkfs_fast) {
+		//the mapping is shared, holes punched through the file show up in it as zeros
+		mkfs_fd = open(opts.img_path, O_RDWR);
+		if (mkfs_fd < 0) perror(opts.img_path);
+	}
+	if (opts.zero && !punch_range(0, size)) memset(image, 0, size);
+	if (!mkfs(image, size, &opts, block_size)) {
 		fprintf(stderr, "Failed to format the image\n");
 		goto end;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &finish);
+	printf("Formatted in %.1f ms\n", (finish.tv_sec - start.tv_sec) * 1e3 + (finish.tv_nsec - start.tv_nsec) / 1e6);
 
 	ret = 0;
 end:
+	if (mkfs_fd >= 0) close(mkfs_fd);
 	munmap(image, size);
 	return ret;
 }
@@ -0,0 +1,33 @@
+/**
+ * a1fs formatter as a library.
+ *
+ * mkfs.c built with -DMKFS_NO_MAIN provides the formatter without the
+ * mkfs.a1fs command line, so tools can create images in memory.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/**
+ * Format the image into a1fs with default options.
+ *
+ * @param image     pointer to the start of the image.
+ * @param size      image size in bytes.
+ * @param n_inodes  number of inodes to create.
+ * @return          true on success; false on error (e.g. image too small).
+ */
+bool a1fs_format(void *image, size_t size, size_t n_inodes);
+
+/**
+ * Format the image into a1fs with a given block size.
+ *
+ * @param image       pointer to the start of the image.
+ * @param size        image size in bytes.
+ * @param n_inodes    number of inodes to create.
+ * @param block_size  a power of two from A1FS_MIN_BLOCK_SIZE to A1FS_MAX_BLOCK_SIZE.
+ * @return            true on success; false on error (e.g. image too small).
+ */
+bool a1fs_format_bs(void *image, size_t size, size_t n_inodes, size_t block_size);
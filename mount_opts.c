@@ -0,0 +1,34 @@
+/**
+ * a1fs mount option parsing.
+ */
+
+#include <stddef.h>
+
+#include "mount_opts.h"
+
+
+#define A1FS_MOUNT_OPT(templ, field) { templ, offsetof(a1fs_mount_opts, field), 1 }
+
+static const struct fuse_opt mount_opt_spec[] = {
+	A1FS_MOUNT_OPT("trace=%s", trace_path),
+	A1FS_MOUNT_OPT("ro", read_only),
+	FUSE_OPT_KEY("ro", FUSE_OPT_KEY_KEEP),
+	A1FS_MOUNT_OPT("window=%lu", window_mb),
+	A1FS_MOUNT_OPT("max_windows=%lu", max_windows),
+	A1FS_MOUNT_OPT("hugepage", hugepage),
+	A1FS_MOUNT_OPT("mlock", mlock_meta),
+	A1FS_MOUNT_OPT("prefault", prefault),
+	A1FS_MOUNT_OPT("readahead=%lu", readahead_kb),
+	A1FS_MOUNT_OPT("discard", discard),
+	A1FS_MOUNT_OPT("discard_batch=%lu", discard_batch),
+	A1FS_MOUNT_OPT("defrag=%lu", defrag_secs),
+	A1FS_MOUNT_OPT("compress=%s", compress_dir),
+	FUSE_OPT_END
+};
+
+bool a1fs_mount_opt_parse(struct fuse_args *args, a1fs_mount_opts *mopts)
+{
+	mopts->max_windows = 16;
+	mopts->readahead_kb = 2048;
+	return fuse_opt_parse(args, mopts, mount_opt_spec, NULL) == 0;
+}
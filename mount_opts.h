@@ -0,0 +1,68 @@
+/**
+ * a1fs mount options.
+ *
+ * Options specific to this implementation, given with -o on the a1fs command
+ * line next to the regular FUSE options.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "fuse.h"
+
+
+/** Options parsed from -o name[=value] arguments. */
+typedef struct a1fs_mount_opts {
+	/** -o trace=FILE: record every operation to FILE (see trace.h). */
+	const char *trace_path;
+	/**
+	 * -o ro: map the image read-only and shared. The option is also passed on
+	 * to FUSE so the kernel rejects writes before they reach the daemon.
+	 */
+	int read_only;
+	/**
+	 * -o window=MB: map the data blocks in windows of MB MiB on demand instead
+	 * of mapping the whole image (see image.h). 0 maps the whole image.
+	 */
+	unsigned long window_mb;
+	/** -o max_windows=N: bound on the data windows mapped at once. */
+	unsigned long max_windows;
+	/** -o hugepage: madvise(MADV_HUGEPAGE) the image mapping. */
+	int hugepage;
+	/** -o mlock: lock the metadata blocks (superblock to inode table) in memory. */
+	int mlock_meta;
+	/** -o prefault: fault in the metadata and the directories in the background. */
+	int prefault;
+	/** -o readahead=KB: largest readahead window of a sequential reader, 0 disables. */
+	unsigned long readahead_kb;
+	/** -o discard: punch freed blocks out of the image file as they are freed. */
+	int discard;
+	/**
+	 * -o discard_batch=SEC: queue freed blocks and punch them out together at
+	 * most every SEC seconds (and at unmount) instead.
+	 */
+	unsigned long discard_batch;
+	/**
+	 * -o defrag=SEC: every SEC seconds, defragment the next file with many
+	 * extents before running an operation (see also A1FS_IOC_DEFRAG).
+	 */
+	unsigned long defrag_secs;
+	/**
+	 * -o compress=DIR: compress the files created in DIR (a path inside the
+	 * file system) and its new subdirectories from now on.
+	 */
+	const char *compress_dir;
+} a1fs_mount_opts;
+
+/**
+ * Parse the a1fs mount options.
+ *
+ * The recognized options are removed from args so that they are not passed on
+ * to fuse_main(), except for the ones FUSE also understands (ro).
+ *
+ * @param args   command line arguments; updated in place.
+ * @param mopts  pointer to the options struct that receives the result.
+ * @return       true on success; false on failure.
+ */
+bool a1fs_mount_opt_parse(struct fuse_args *args, a1fs_mount_opts *mopts);
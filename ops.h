@@ -0,0 +1,68 @@
+/**
+ * a1fs operations as a library.
+ *
+ * The operations in a1fs.c do not depend on being called by FUSE: a1fs_main.c
+ * mounts them with fuse_main(), while tools such as the benchmarks attach a
+ * context directly and call through a1fs_ops without a mount.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "fuse.h"
+#include "fs_ctx.h"
+#include "mount_opts.h"
+#include "options.h"
+
+
+/** Operations implemented by a1fs.c. */
+extern struct fuse_operations a1fs_ops;
+
+/**
+ * Initialize the file system.
+ *
+ * Maps the image given in opts and initializes the context.
+ *
+ * @param fs     file system context to initialize.
+ * @param opts   command line options.
+ * @param mopts  a1fs mount options.
+ * @return       true on success; false on failure.
+ */
+bool a1fs_init(fs_ctx *fs, a1fs_opts *opts, a1fs_mount_opts *mopts);
+
+/**
+ * Run the operations against fs instead of the FUSE context.
+ *
+ * After this call every a1fs_ops function operates on fs. Pass NULL to go back
+ * to using fuse_get_context().
+ *
+ * @param fs  an initialized file system context, or NULL.
+ */
+void a1fs_attach(fs_ctx *fs);
+
+/**
+ * Rename with the flags of renameat2(): RENAME_NOREPLACE or RENAME_EXCHANGE.
+ *
+ * The FUSE 2 rename operation in a1fs_ops has no flags and calls this with 0.
+ *
+ * @param from   path to the file or directory to rename.
+ * @param to     its new path.
+ * @param flags  0, RENAME_NOREPLACE or RENAME_EXCHANGE.
+ * @return       0 on success; -errno on error.
+ */
+int a1fs_rename2(const char *from, const char *to, unsigned int flags);
+
+/**
+ * Turn compression on or off for a directory (or a single file).
+ *
+ * Files created in a directory with compression on, and in the directories
+ * created in it, are compressed a cluster at a time when they are closed
+ * after a write (see A1FS_INODE_COMPRESS). Files that are already there keep
+ * their data as it is. -o compress=DIR calls this at mount.
+ *
+ * @param path  path to the directory or file.
+ * @param on    true to compress, false to leave new data plain.
+ * @return      0 on success; -errno on error.
+ */
+int a1fs_set_compress(const char *path, bool on);
@@ -0,0 +1,314 @@
+/**
+ * Operation trace capture.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "a1fs_ioctl.h"
+#include "trace.h"
+
+
+/** Trace file, NULL when not capturing. */
+static FILE *trace_file = NULL;
+/** Serializes records from concurrent FUSE threads. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/** CLOCK_MONOTONIC at the start of the capture. */
+static uint64_t trace_base;
+/** The operations being traced. */
+static const struct fuse_operations *inner;
+/** The wrapped operations handed to FUSE. */
+static struct fuse_operations traced;
+
+static const char *op_names[TRACE_OP_MAX] = {
+	[TRACE_STATFS]   = "statfs",
+	[TRACE_GETATTR]  = "getattr",
+	[TRACE_READDIR]  = "readdir",
+	[TRACE_MKDIR]    = "mkdir",
+	[TRACE_RMDIR]    = "rmdir",
+	[TRACE_CREATE]   = "create",
+	[TRACE_UNLINK]   = "unlink",
+	[TRACE_UTIMENS]  = "utimens",
+	[TRACE_TRUNCATE] = "truncate",
+	[TRACE_READ]     = "read",
+	[TRACE_WRITE]    = "write",
+	[TRACE_OPEN]     = "open",
+	[TRACE_RELEASE]  = "release",
+	[TRACE_IOCTL]    = "ioctl",
+	[TRACE_RENAME]   = "rename",
+};
+
+const char *trace_op_name(int op)
+{
+	if (op <= 0 || op >= TRACE_OP_MAX || !op_names[op]) return "unknown";
+	return op_names[op];
+}
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+bool trace_open(const char *path)
+{
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		perror(path);
+		return false;
+	}
+	trace_header hdr = {
+		.magic = A1FS_TRACE_MAGIC,
+		.version = A1FS_TRACE_VERSION,
+		.rec_size = sizeof(trace_rec),
+		.start_time = clock_ns(CLOCK_REALTIME),
+	};
+	trace_base = clock_ns(CLOCK_MONOTONIC);
+	if (fwrite(&hdr, sizeof(hdr), 1, trace_file) != 1) {
+		perror(path);
+		fclose(trace_file);
+		trace_file = NULL;
+		return false;
+	}
+	return true;
+}
+
+void trace_close(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Append a record for an operation that started at start (monotonic ns).
+ * path2 is the second path of the operation, NULL if it has none; ioctl
+ * records fill in the rest of theirs through rec.
+ */
+static void trace_emit_rec(trace_rec *rec, const char *path, const char *path2,
+                           uint64_t start, int result)
+{
+	uint64_t end = clock_ns(CLOCK_MONOTONIC);
+	size_t len = strlen(path), len2 = path2 ? strlen(path2) : 0;
+	rec->path_len = len > UINT16_MAX ? UINT16_MAX : len;
+	rec->path2_len = len2 > UINT16_MAX ? UINT16_MAX : len2;
+	rec->result = result;
+	rec->start = start - trace_base;
+	rec->duration = end - start;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fwrite(rec, sizeof(*rec), 1, trace_file);
+		fwrite(path, 1, rec->path_len, trace_file);
+		if (rec->path2_len) fwrite(path2, 1, rec->path2_len, trace_file);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void trace_emit(int op, const char *path, uint64_t start, int result,
+                       uint64_t offset, uint64_t size)
+{
+	trace_rec rec = { .op = op, .offset = offset, .size = size };
+	trace_emit_rec(&rec, path, NULL, start, result);
+}
+
+
+static int trace_statfs(const char *path, struct statvfs *st)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->statfs(path, st);
+	trace_emit(TRACE_STATFS, path, start, ret, 0, 0);
+	return ret;
+}
+
+static int trace_getattr(const char *path, struct stat *st)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->getattr(path, st);
+	trace_emit(TRACE_GETATTR, path, start, ret, 0, 0);
+	return ret;
+}
+
+static int trace_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->readdir(path, buf, filler, offset, fi);
+	trace_emit(TRACE_READDIR, path, start, ret, offset, 0);
+	return ret;
+}
+
+static int trace_mkdir(const char *path, mode_t mode)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->mkdir(path, mode);
+	trace_emit(TRACE_MKDIR, path, start, ret, 0, mode);
+	return ret;
+}
+
+static int trace_rmdir(const char *path)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->rmdir(path);
+	trace_emit(TRACE_RMDIR, path, start, ret, 0, 0);
+	return ret;
+}
+
+static int trace_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->create(path, mode, fi);
+	trace_emit(TRACE_CREATE, path, start, ret, 0, mode);
+	return ret;
+}
+
+static int trace_unlink(const char *path)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->unlink(path);
+	trace_emit(TRACE_UNLINK, path, start, ret, 0, 0);
+	return ret;
+}
+
+static int trace_utimens(const char *path, const struct timespec times[2])
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->utimens(path, times);
+	//UINT64_MAX marks a NULL times ("set to the current time")
+	trace_emit(TRACE_UTIMENS, path, start, ret,
+	           times ? (uint64_t)times[1].tv_sec : UINT64_MAX,
+	           times ? (uint64_t)times[1].tv_nsec : 0);
+	return ret;
+}
+
+static int trace_truncate(const char *path, off_t size)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->truncate(path, size);
+	trace_emit(TRACE_TRUNCATE, path, start, ret, 0, size);
+	return ret;
+}
+
+static int trace_read(const char *path, char *buf, size_t size, off_t offset,
+                      struct fuse_file_info *fi)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->read(path, buf, size, offset, fi);
+	trace_emit(TRACE_READ, path, start, ret, offset, size);
+	return ret;
+}
+
+static int trace_write(const char *path, const char *buf, size_t size,
+                       off_t offset, struct fuse_file_info *fi)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->write(path, buf, size, offset, fi);
+	trace_emit(TRACE_WRITE, path, start, ret, offset, size);
+	return ret;
+}
+
+static int trace_open_op(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->open(path, fi);
+	trace_emit(TRACE_OPEN, path, start, ret, 0, fi->flags);
+	return ret;
+}
+
+static int trace_release(const char *path, struct fuse_file_info *fi)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->release(path, fi);
+	trace_emit(TRACE_RELEASE, path, start, ret, 0, 0);
+	return ret;
+}
+
+static int trace_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                       unsigned int flags, void *data)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->ioctl(path, cmd, arg, fi, flags, data);
+
+	trace_rec rec = { .op = TRACE_IOCTL, .offset = (unsigned int)cmd };
+	const char *src = NULL;
+	//a NULL argument was rejected, there is nothing more to record
+	if (data && (unsigned int)cmd == A1FS_IOC_CLONE) {
+		src = ((struct a1fs_clone *)data)->src;
+	} else if (data && (unsigned int)cmd == A1FS_IOC_COPY_RANGE) {
+		struct a1fs_copy_range *copy = data;
+		src = copy->src;
+		rec.src_offset = copy->src_offset;
+		rec.dst_offset = copy->dst_offset;
+		rec.size = copy->length;
+	} else if (data && (unsigned int)cmd == A1FS_IOC_DEDUPE_RANGE) {
+		struct a1fs_dedupe_range *dedupe = data;
+		src = dedupe->src;
+		rec.src_offset = dedupe->src_offset;
+		rec.dst_offset = dedupe->dst_offset;
+		rec.size = dedupe->length;
+	}
+	trace_emit_rec(&rec, path, src, start, ret);
+	return ret;
+}
+
+static int trace_rename(const char *from, const char *to)
+{
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	int ret = inner->rename(from, to);
+	trace_rec rec = { .op = TRACE_RENAME };
+	trace_emit_rec(&rec, from, to, start, ret);
+	return ret;
+}
+
+static void trace_destroy(void *ctx)
+{
+	trace_close();
+	if (inner->destroy) inner->destroy(ctx);
+}
+
+const struct fuse_operations *trace_wrap(const struct fuse_operations *ops)
+{
+	inner = ops;
+	traced = *ops;
+	traced.destroy  = trace_destroy;
+	traced.statfs   = trace_statfs;
+	traced.getattr  = trace_getattr;
+	traced.readdir  = trace_readdir;
+	traced.mkdir    = trace_mkdir;
+	traced.rmdir    = trace_rmdir;
+	traced.create   = trace_create;
+	traced.unlink   = trace_unlink;
+	traced.utimens  = trace_utimens;
+	traced.truncate = trace_truncate;
+	traced.read     = trace_read;
+	traced.write    = trace_write;
+	if (ops->open) traced.open = trace_open_op;
+	if (ops->release) traced.release = trace_release;
+	if (ops->ioctl) traced.ioctl = trace_ioctl;
+	if (ops->rename) traced.rename = trace_rename;
+	return &traced;
+}
+
+
+bool trace_read_header(FILE *f, trace_header *hdr)
+{
+	if (fread(hdr, sizeof(*hdr), 1, f) != 1) return false;
+	return hdr->magic == A1FS_TRACE_MAGIC && hdr->version == A1FS_TRACE_VERSION &&
+	       hdr->rec_size == sizeof(trace_rec);
+}
+
+bool trace_next(FILE *f, trace_rec *rec, char *path, char *path2)
+{
+	if (fread(rec, sizeof(*rec), 1, f) != 1) return false;
+	if (rec->path_len >= A1FS_PATH_MAX || rec->path2_len >= A1FS_PATH_MAX) return false;
+	if (fread(path, 1, rec->path_len, f) != rec->path_len) return false;
+	path[rec->path_len] = '\0';
+	if (fread(path2, 1, rec->path2_len, f) != rec->path2_len) return false;
+	path2[rec->path2_len] = '\0';
+	return true;
+}
@@ -0,0 +1,135 @@
+/**
+ * Operation trace capture.
+ *
+ * When the daemon is mounted with -o trace=FILE every call into a1fs_ops is
+ * recorded to FILE in a compact binary format that a1fs_replay can drive
+ * against a fresh image. File data is not recorded, only offsets and sizes.
+ *
+ * Layout: one trace_header followed by records, each a trace_rec followed by
+ * path_len bytes of path and path2_len bytes of a second path (the target of
+ * a rename, the source of a clone, copy or dedupe ioctl), neither
+ * null-terminated.
+ */
+
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "a1fs.h"
+#include "fuse.h"
+
+
+/** Magic value at the start of a trace file. */
+#define A1FS_TRACE_MAGIC 0xA1F5793ACEul
+
+/** Version of the trace format. */
+#define A1FS_TRACE_VERSION 3
+
+/** Traced operations. */
+enum trace_op {
+	TRACE_STATFS = 1,
+	TRACE_GETATTR,
+	TRACE_READDIR,
+	TRACE_MKDIR,
+	TRACE_RMDIR,
+	TRACE_CREATE,
+	TRACE_UNLINK,
+	TRACE_UTIMENS,
+	TRACE_TRUNCATE,
+	TRACE_READ,
+	TRACE_WRITE,
+	TRACE_OPEN,
+	TRACE_RELEASE,
+	TRACE_IOCTL,
+	TRACE_RENAME,
+	TRACE_OP_MAX
+};
+
+/** Trace file header. */
+typedef struct trace_header {
+	/** Must match A1FS_TRACE_MAGIC. */
+	uint64_t magic;
+	/** Must match A1FS_TRACE_VERSION. */
+	uint32_t version;
+	/** Size of a trace_rec, as a sanity check. */
+	uint32_t rec_size;
+	/** CLOCK_REALTIME at the start of the capture, in nanoseconds. */
+	uint64_t start_time;
+} trace_header;
+
+/** One recorded operation. */
+typedef struct trace_rec {
+	/** One of enum trace_op. */
+	uint8_t op;
+	uint8_t pad;
+	/** Bytes of path following the record. */
+	uint16_t path_len;
+	/** Return value of the operation. */
+	int32_t result;
+	/** Start of the call, in nanoseconds since the start of the capture. */
+	uint64_t start;
+	/** Duration of the call in nanoseconds. */
+	uint64_t duration;
+	/** read/write offset; utimens seconds; ioctl request. */
+	uint64_t offset;
+	/**
+	 * read/write/truncate size; mkdir/create mode; open flags; utimens
+	 * nanoseconds; ioctl copy or dedupe length.
+	 */
+	uint64_t size;
+	/** Bytes of the second path following the path, 0 if none. */
+	uint16_t path2_len;
+	uint16_t pad2[3];
+	/** ioctl copy or dedupe source offset. */
+	uint64_t src_offset;
+	/** ioctl copy or dedupe destination offset. */
+	uint64_t dst_offset;
+} trace_rec;
+
+static_assert(sizeof(trace_rec) == 64, "invalid trace record size");
+
+/** Name of a traced operation, e.g. "write". */
+const char *trace_op_name(int op);
+
+/**
+ * Start recording to a file.
+ *
+ * @param path  trace file to create (truncated if it exists).
+ * @return      true on success; false on failure.
+ */
+bool trace_open(const char *path);
+
+/** Flush and close the trace file. */
+void trace_close(void);
+
+/**
+ * Wrap a set of operations so that every call is recorded.
+ *
+ * trace_open() must have been called. The wrapped destroy() closes the trace.
+ *
+ * @param ops  operations to wrap.
+ * @return     operations that record and then call into ops.
+ */
+const struct fuse_operations *trace_wrap(const struct fuse_operations *ops);
+
+/**
+ * Read the header of a trace file.
+ *
+ * @return  true if f starts with a valid header of the current version.
+ */
+bool trace_read_header(FILE *f, trace_header *hdr);
+
+/**
+ * Read the next record of a trace file.
+ *
+ * @param f      trace file positioned after the header or a record.
+ * @param rec    receives the record.
+ * @param path   receives the null-terminated path; at least A1FS_PATH_MAX bytes.
+ * @param path2  receives the null-terminated second path ("" if none); at
+ *               least A1FS_PATH_MAX bytes.
+ * @return       true on success; false at the end of the file or on error.
+ */
+bool trace_next(FILE *f, trace_rec *rec, char *path, char *path2);